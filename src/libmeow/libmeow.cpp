@@ -5,21 +5,35 @@
 //  Created by Lilly Cham on 24/05/2022.
 //
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <string>
 #include <system_error>
+#include <thread>
 #include <utility>
 #include <vector>
 
-///================== //
-/// Library functions //
-///================== //
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifdef _WIN32
 #define DLLEXPORT __declspec(dllexport)
@@ -28,33 +42,1736 @@
 #endif
 
 namespace libmeow {
+  ///======= //
+  /// Output //
+  ///======= //
+
+  /// getOutputFD - the descriptor all meow output goes to, chosen on first use
+  /// from MEOW_OUTPUT: "stderr" (the default), "stdout", or a file path, which
+  /// is truncated and then appended to so every thread's flushes land whole.
+  static int getOutputFD() {
+    static const int FD = [] {
+      const char *Target = getenv("MEOW_OUTPUT");
+      if (!Target || !*Target || !strcmp(Target, "stderr"))
+        return STDERR_FILENO;
+      if (!strcmp(Target, "stdout"))
+        return STDOUT_FILENO;
+      int F = open(Target, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+      if (F < 0) {
+        fprintf(stderr, "libmeow: cannot open output %s: %s\n", Target,
+                strerror(errno));
+        return STDERR_FILENO;
+      }
+      return F;
+    }();
+    return FD;
+  }
+
+  /// OutputBuffer - a per-thread batch of formatted output, written to the
+  /// output descriptor when full, on flushd(), before a runtime abort, and
+  /// when its thread exits (which for the main thread is at exit()).
+  struct OutputBuffer {
+    static constexpr size_t Size = 1 << 16;
+    /// The longest record we format in place: a shortest round-trip double
+    /// is at most 24 characters, plus a separator.
+    static constexpr size_t MaxRecord = 32;
+
+    std::unique_ptr<char[]> Data{new char[Size]};
+    size_t Len = 0;
+
+    ~OutputBuffer() { flush(); }
+
+    void flush() {
+      const char *P = Data.get();
+      size_t Left = Len;
+      while (Left) {
+        ssize_t N = write(getOutputFD(), P, Left);
+        if (N < 0) {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+        P += N;
+        Left -= N;
+      }
+      Len = 0;
+    }
+
+    void put(char C) {
+      if (Len == Size)
+        flush();
+      Data[Len++] = C;
+    }
+
+    void put(const char *S, size_t N) {
+      if (Size - Len < N)
+        flush();
+      memcpy(Data.get() + Len, S, N);
+      Len += N;
+    }
+
+    /// putDouble - append X in the shortest form that reads back exactly.
+    void putDouble(double X) {
+      if (Size - Len < MaxRecord)
+        flush();
+      char *Begin = Data.get() + Len;
+      Len += std::to_chars(Begin, Begin + MaxRecord, X).ptr - Begin;
+    }
+  };
+
+  static thread_local OutputBuffer TheOutput;
+
+  /// flushd - write out everything this thread has printed so far, returning 0.
+  extern "C" DLLEXPORT double flushd() {
+    TheOutput.flush();
+    return 0;
+  }
+
+  ///====== //
+  /// Input //
+  ///====== //
+
+  [[noreturn]] static void InputFail(const char *Why) {
+    TheOutput.flush();
+    fprintf(stderr, "libmeow: bad input: %s\n", Why);
+    abort();
+  }
+
+  /// InputStream - the numbers a program reads, from the source named by
+  /// MEOW_INPUT: "stdin" (the default) or a file path. Input is text, numbers
+  /// separated by whitespace or commas, unless MEOW_INPUT_FORMAT is "binary",
+  /// in which case it is raw native-endian doubles. It is shared by every
+  /// thread, so each read takes the stream's lock.
+  struct InputStream {
+    static constexpr size_t Size = 1 << 20;
+    /// The longest number we parse; a token is never split across refills.
+    static constexpr size_t MaxToken = 512;
+
+    std::mutex Lock;
+    std::unique_ptr<char[]> Data{new char[Size]};
+    char *Pos = Data.get(), *End = Data.get();
+    int FD = STDIN_FILENO;
+    bool Binary = false, AtEOF = false;
+
+    InputStream() {
+      const char *Source = getenv("MEOW_INPUT");
+      if (Source && *Source && strcmp(Source, "stdin")) {
+        FD = open(Source, O_RDONLY);
+        if (FD < 0) {
+          TheOutput.flush();
+          fprintf(stderr, "libmeow: cannot open input %s: %s\n", Source,
+                  strerror(errno));
+          abort();
+        }
+      }
+      const char *Format = getenv("MEOW_INPUT_FORMAT");
+      Binary = Format && !strcmp(Format, "binary");
+    }
+
+    size_t available() const { return End - Pos; }
+
+    /// readSome - read once from FD into Buf, returning 0 at end of input.
+    size_t readSome(char *Buf, size_t N) {
+      for (;;) {
+        ssize_t R = read(FD, Buf, N);
+        if (R >= 0) {
+          AtEOF |= R == 0;
+          return R;
+        }
+        if (errno != EINTR)
+          InputFail(strerror(errno));
+      }
+    }
+
+    /// fill - make at least N bytes available, unless the input ends first.
+    size_t fill(size_t N) {
+      if (available() >= N || AtEOF)
+        return available();
+      size_t Left = available();
+      memmove(Data.get(), Pos, Left);
+      Pos = Data.get();
+      End = Pos + Left;
+      while (available() < N && !AtEOF)
+        End += readSome(End, Data.get() + Size - End);
+      return available();
+    }
+
+    static bool isSeparator(char C) {
+      return isspace((unsigned char)C) || C == ',';
+    }
+
+    /// atEnd - whether no numbers are left, skipping any separators.
+    bool atEnd() {
+      if (Binary)
+        return !fill(1);
+      for (;;) {
+        while (Pos != End && isSeparator(*Pos))
+          ++Pos;
+        if (Pos != End)
+          return false;
+        if (!fill(1))
+          return true;
+      }
+    }
+
+    /// next - read the next number into X, returning false at end of input.
+    bool next(double &X) {
+      if (Binary) {
+        size_t N = fill(sizeof(double));
+        if (N && N < sizeof(double))
+          InputFail("truncated double at end of input");
+        if (!N)
+          return false;
+        memcpy(&X, Pos, sizeof(double));
+        Pos += sizeof(double);
+        return true;
+      }
+
+      if (atEnd())
+        return false;
+      fill(MaxToken);
+      const char *First = Pos + (*Pos == '+');
+      auto [Ptr, EC] = std::from_chars(First, End, X);
+      if (Ptr != End ? !isSeparator(*Ptr) : !AtEOF)
+        InputFail(Ptr == End ? "number too long" : "malformed number");
+      if (EC == std::errc::result_out_of_range)
+        X = strtod(std::string(First, Ptr).c_str(), nullptr);
+      else if (EC != std::errc())
+        InputFail("malformed number");
+      Pos = const_cast<char *>(Ptr);
+      return true;
+    }
+
+    /// readBulk - read up to N numbers into Out, returning how many were read.
+    int64_t readBulk(double *Out, int64_t N) {
+      if (!Binary) {
+        int64_t i = 0;
+        while (i != N && next(Out[i]))
+          ++i;
+        return i;
+      }
+
+      // Copy what is buffered, then read the rest straight into Out.
+      char *Dest = reinterpret_cast<char *>(Out);
+      size_t Want = N * sizeof(double);
+      size_t Got = std::min(Want, available());
+      memcpy(Dest, Pos, Got);
+      Pos += Got;
+      while (Got != Want && !AtEOF)
+        Got += readSome(Dest + Got, Want - Got);
+      if (Got % sizeof(double))
+        InputFail("truncated double at end of input");
+      return Got / sizeof(double);
+    }
+  };
+
+  static InputStream &getInput() {
+    static InputStream TheInput;
+    return TheInput;
+  }
+
+  /// readd - read the next number of input, returning NaN at end of input.
+  extern "C" DLLEXPORT double readd() {
+    InputStream &In = getInput();
+    std::lock_guard<std::mutex> Guard(In.Lock);
+    double X;
+    return In.next(X) ? X : NAN;
+  }
+
+  /// eofd - 1 if no numbers are left to read, else 0.
+  extern "C" DLLEXPORT double eofd() {
+    InputStream &In = getInput();
+    std::lock_guard<std::mutex> Guard(In.Lock);
+    return In.atEnd();
+  }
+
+  /// meow_readv - read up to N numbers into Out, returning how many were
+  /// read; fewer than N only at end of input. Called by the readv builtin.
+  extern "C" DLLEXPORT int64_t meow_readv(double *Out, int64_t N) {
+    InputStream &In = getInput();
+    std::lock_guard<std::mutex> Guard(In.Lock);
+    return In.readBulk(Out, N);
+  }
+
+  ///================== //
+  /// Library functions //
+  ///================== //
+
   /// putchard - putchar that takes a double and returns 0.
   extern "C" DLLEXPORT double putchard(double X) {
-    fputc((char)X, stderr);
+    TheOutput.put((char)X);
     return 0;
   }
 
-  /// printd - printf that takes a double prints it as "%f\n", returning 0.
+  /// printd - print a double on its own line, returning 0.
   extern "C" DLLEXPORT double printd(double X) {
-    fprintf(stderr, "%f\n", X);
+    TheOutput.putDouble(X);
+    TheOutput.put('\n');
+    return 0;
+  }
+
+  /// meow_printv - print the N lanes of a vector as "<a, b, ...>\n",
+  /// returning 0. Called by the printv builtin.
+  extern "C" DLLEXPORT double meow_printv(const double *Lanes, int64_t N) {
+    TheOutput.put('<');
+    for (int64_t i = 0; i != N; ++i) {
+      if (i)
+        TheOutput.put(", ", 2);
+      TheOutput.putDouble(Lanes[i]);
+    }
+    TheOutput.put(">\n", 2);
     return 0;
   }
 
   /// returnd - return a double value
   extern "C" DLLEXPORT double returnd(double X) { return X; }
 
-  // sqrt - square root
-  extern "C" DLLEXPORT double sqrt(double X) { return std::sqrt(X); }
+  // sqrt, pow, sin, cos and tan are libm's own. Defining them here replaced
+  // libm's, so that the std:: versions they wrapped called themselves.
+
+  ///======= //
+  /// Arrays //
+  ///======= //
+
+  /// Arena - a per-thread bump allocator for arrays. Compiled code takes a
+  /// mark when entering a scope that allocates and releases back to it on
+  /// exit, freeing everything allocated since in one step. Released chunks
+  /// are kept for reuse, so a loop that allocates each iteration settles into
+  /// touching the same memory without calling malloc.
+  struct Arena {
+    static constexpr size_t ChunkSize = 1 << 16;
+    static constexpr size_t MaxSpares = 4;
+    static constexpr size_t Align = 64;
+
+    /// Chunk - header of a block of memory; the data follows it.
+    struct alignas(Align) Chunk {
+      Chunk *Prev;
+      size_t Size; // of the data.
+      char *data() { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    Chunk *Cur = nullptr;
+    char *Ptr = nullptr, *End = nullptr;
+    std::vector<Chunk *> Spares; // free chunks of ChunkSize bytes.
+
+    ~Arena() {
+      release(nullptr);
+      for (Chunk *C : Spares)
+        free(C);
+    }
+
+    void *allocate(size_t Bytes) {
+      Bytes = (Bytes + Align - 1) & ~(Align - 1);
+      if ((size_t)(End - Ptr) < Bytes)
+        grow(Bytes);
+      void *Result = Ptr;
+      Ptr += Bytes;
+      return Result;
+    }
+
+    /// grow - start a new chunk with room for at least Bytes.
+    void grow(size_t Bytes) {
+      Chunk *C;
+      if (Bytes <= ChunkSize && !Spares.empty()) {
+        C = Spares.back();
+        Spares.pop_back();
+      } else {
+        size_t Size = std::max(Bytes, ChunkSize);
+        C = static_cast<Chunk *>(aligned_alloc(Align, sizeof(Chunk) + Size));
+        if (!C) {
+          fprintf(stderr, "libmeow: out of memory allocating %zu bytes\n",
+                  Bytes);
+          abort();
+        }
+        C->Size = Size;
+      }
+      C->Prev = Cur;
+      Cur = C;
+      Ptr = C->data();
+      End = Ptr + C->Size;
+    }
+
+    /// release - free everything allocated since Mark was taken. A null Mark
+    /// frees everything.
+    void release(char *Mark) {
+      while (Cur && !(Mark >= Cur->data() && Mark <= End)) {
+        Chunk *Prev = Cur->Prev;
+        if (Cur->Size == ChunkSize && Spares.size() < MaxSpares)
+          Spares.push_back(Cur);
+        else
+          free(Cur);
+        Cur = Prev;
+        End = Cur ? Cur->data() + Cur->Size : nullptr;
+      }
+      Ptr = Cur ? Mark : nullptr;
+    }
+  };
+
+  static thread_local Arena TheArena;
+
+  /// meow_arena_mark - the current position of this thread's arena.
+  extern "C" DLLEXPORT void *meow_arena_mark() { return TheArena.Ptr; }
+
+  /// meow_arena_release - free the arrays this thread allocated since Mark
+  /// was taken. Marks must be released in the reverse order they were taken.
+  extern "C" DLLEXPORT void meow_arena_release(void *Mark) {
+    TheArena.release(static_cast<char *>(Mark));
+  }
+
+  /// meow_alloc - allocate Bytes of zeroed memory in this thread's arena.
+  /// Buffers are 64-byte aligned, so vector loads don't straddle cache lines.
+  extern "C" DLLEXPORT void *meow_alloc(int64_t Bytes) {
+    if (Bytes < 0) {
+      TheOutput.flush();
+      fprintf(stderr, "libmeow: negative or overflowing array size\n");
+      abort();
+    }
+    void *Data = TheArena.allocate(Bytes);
+    if (Bytes)
+      memset(Data, 0, Bytes);
+    return Data;
+  }
+
+  /// meow_array_alloc - allocate a zeroed array of N doubles. Called by the
+  /// array builtin.
+  extern "C" DLLEXPORT double *meow_array_alloc(int64_t N) {
+    int64_t Bytes;
+    if (N < 0 || __builtin_mul_overflow(N, (int64_t)sizeof(double), &Bytes)) {
+      TheOutput.flush();
+      fprintf(stderr, "libmeow: bad array length %lld\n", (long long)N);
+      abort();
+    }
+    return static_cast<double *>(meow_alloc(Bytes));
+  }
+
+  /// meow_bounds_fail - report an out of bounds subscript or slice and abort.
+  extern "C" DLLEXPORT void meow_bounds_fail(int64_t Index, int64_t Len) {
+    TheOutput.flush();
+    fprintf(stderr,
+            "libmeow: index %lld out of bounds for array of length %lld\n",
+            (long long)Index, (long long)Len);
+    abort();
+  }
+
+  ///=========== //
+  /// Array math //
+  ///=========== //
+
+#define MEOW_INLINE inline __attribute__((always_inline))
+
+  /// Vec - W doubles, or W 64-bit integers, operated on as a unit. The array
+  /// math kernels are written once over Vec<W> and instantiated for each
+  /// instruction set the machine might have; see getMathKernels. Vectors are
+  /// only ever passed by reference, so no instantiation depends on the ABI of
+  /// a vector register the default target lacks.
+  template <int W> struct Vec {
+    typedef double D __attribute__((vector_size(W * sizeof(double))));
+    typedef int64_t I __attribute__((vector_size(W * sizeof(int64_t))));
+  };
+
+  /// mapVectors - Y[i] = Op(X[i]) for i in [0, N), a vector at a time. The
+  /// tail is done as one more vector padded with ones. X and Y may be the
+  /// same array.
+  template <int W, typename OpT>
+  static MEOW_INLINE void mapVectors(const double *X, double *Y, int64_t N,
+                                     const OpT &Op) {
+    typename Vec<W>::D V;
+    int64_t i = 0;
+    for (; i + W <= N; i += W) {
+      memcpy(&V, X + i, sizeof V);
+      Op.template apply<W>(V);
+      memcpy(Y + i, &V, sizeof V);
+    }
+    if (i != N) {
+      double Tail[W];
+      for (int l = 0; l != W; ++l)
+        Tail[l] = i + l < N ? X[i + l] : 1.0;
+      memcpy(&V, Tail, sizeof V);
+      Op.template apply<W>(V);
+      memcpy(Tail, &V, sizeof V);
+      std::copy(Tail, Tail + (N - i), Y + i);
+    }
+  }
+
+  /// SinCos - sine, or cosine as the sine a quarter turn on. The argument is
+  /// reduced to R in [-pi/4, pi/4] with X = R + K pi/2, subtracting K pi/2 in
+  /// three parts so that R is exact (Cody-Waite), and the quadrant K picks
+  /// between the Cephes sine and cosine polynomials of R and their negations.
+  struct SinCos {
+    int64_t Quarter;
+
+    /// Past this the reduction loses bits, so larger arguments, infinities
+    /// and NaNs are left to libm, as are zeros to keep the sign of -0.
+    static constexpr double Limit = 0x1p25;
+    static constexpr double TwoOverPi = 0.63661977236758134308;
+    static constexpr double PiOver2A = 1.57079625129699707031;
+    static constexpr double PiOver2B = 7.54978941586159635336e-8;
+    static constexpr double PiOver2C = 5.39030285815811905290e-15;
+
+    template <int W> MEOW_INLINE void apply(typename Vec<W>::D &X) const {
+      using D = typename Vec<W>::D;
+      using I = typename Vec<W>::I;
+      // Adding 1.5 * 2^52 rounds to an integer, which lands in the low bits.
+      const double Shift = 0x1.8p52;
+      D KS = X * TwoOverPi + Shift;
+      D K = KS - Shift;
+      I Q = (I)KS + Quarter;
+      D R = ((X - K * PiOver2A) - K * PiOver2B) - K * PiOver2C;
+      D Z = R * R;
+      D S = Z * 1.58962301576546568060e-10 - 2.50507477628578072866e-8;
+      S = S * Z + 2.75573136213857245213e-6;
+      S = S * Z - 1.98412698295895385996e-4;
+      S = S * Z + 8.33333333332211858878e-3;
+      S = S * Z - 1.66666666666666307295e-1;
+      S = R + R * Z * S;
+      D C = Z * -1.13585365213876817300e-11 + 2.08757008419747316778e-9;
+      C = C * Z - 2.75573141792967388112e-7;
+      C = C * Z + 2.48015872888517045348e-5;
+      C = C * Z - 1.38888888888730564116e-3;
+      C = C * Z + 4.16666666666665929218e-2;
+      C = 1.0 - 0.5 * Z + Z * Z * C;
+      I Odd = -(Q & 1);
+      I Bits = (((I)S & ~Odd) | ((I)C & Odd)) ^ ((Q & 2) << 62);
+      D Y = (D)Bits;
+      for (int l = 0; l != W; ++l)
+        if (!(std::fabs(X[l]) <= Limit) || X[l] == 0)
+          Y[l] = Quarter ? std::cos(X[l]) : std::sin(X[l]);
+      X = Y;
+    }
+  };
+
+  struct Sqrt {
+    template <int W> MEOW_INLINE void apply(typename Vec<W>::D &X) const {
+      for (int l = 0; l != W; ++l)
+        X[l] = std::sqrt(X[l]);
+    }
+  };
+
+  /// IntPow - X to a small integer power, by repeated squaring.
+  struct IntPow {
+    int64_t P;
+
+    template <int W> MEOW_INLINE void apply(typename Vec<W>::D &X) const {
+      typename Vec<W>::D R = typename Vec<W>::D{} + 1.0;
+      for (uint64_t E = P < 0 ? -P : P; E; E >>= 1) {
+        if (E & 1)
+          R *= X;
+        X *= X;
+      }
+      X = P < 0 ? 1.0 / R : R;
+    }
+  };
+
+  struct Pow {
+    double P;
+
+    template <int W> MEOW_INLINE void apply(typename Vec<W>::D &X) const {
+      double Lanes[W];
+      memcpy(Lanes, &X, sizeof Lanes);
+      for (double &L : Lanes)
+        L = std::pow(L, P);
+      memcpy(&X, Lanes, sizeof Lanes);
+    }
+  };
+
+  template <int W>
+  static MEOW_INLINE void powVectors(const double *X, double P, double *Y,
+                                     int64_t N) {
+    if (P == std::trunc(P) && std::fabs(P) <= 64)
+      mapVectors<W>(X, Y, N, IntPow{(int64_t)P});
+    else
+      mapVectors<W>(X, Y, N, Pow{P});
+  }
+
+  template <int W>
+  static MEOW_INLINE void axpyVectors(double A, const double *X, double *Y,
+                                      int64_t N) {
+    typename Vec<W>::D VX, VY;
+    int64_t i = 0;
+    for (; i + W <= N; i += W) {
+      memcpy(&VX, X + i, sizeof VX);
+      memcpy(&VY, Y + i, sizeof VY);
+      VY += A * VX;
+      memcpy(Y + i, &VY, sizeof VY);
+    }
+    for (; i != N; ++i)
+      Y[i] += A * X[i];
+  }
+
+  /// reduceVectors - the sum of X, or with Y the dot product of X and Y.
+  /// Element i is added to partial sum i % 8 whatever the vector width, and
+  /// the partial sums are combined in a fixed order, so every instruction set
+  /// gives the same answer. Products are rounded before they are added.
+  template <int W>
+  static MEOW_INLINE double reduceVectors(const double *X, const double *Y,
+                                          int64_t N) {
+    constexpr int NumVecs = 8 / W;
+    typename Vec<W>::D Acc[NumVecs] = {}, VX, VY;
+    int64_t i = 0;
+    for (; i + 8 <= N; i += 8)
+      for (int v = 0; v != NumVecs; ++v) {
+        memcpy(&VX, X + i + v * W, sizeof VX);
+        if (Y) {
+          memcpy(&VY, Y + i + v * W, sizeof VY);
+          VX *= VY;
+        }
+        Acc[v] += VX;
+      }
+
+    double Part[8];
+    memcpy(Part, Acc, sizeof Part);
+    for (; i != N; ++i) {
+      double T = Y ? X[i] * Y[i] : X[i];
+      Part[i % 8] += T;
+    }
+    return ((Part[0] + Part[4]) + (Part[2] + Part[6])) +
+           ((Part[1] + Part[5]) + (Part[3] + Part[7]));
+  }
+
+  /// MathKernels - the array math entry points for one instruction set.
+  struct MathKernels {
+    void (*Sin)(const double *X, double *Y, int64_t N);
+    void (*Cos)(const double *X, double *Y, int64_t N);
+    void (*Sqrt)(const double *X, double *Y, int64_t N);
+    void (*Pow)(const double *X, double P, double *Y, int64_t N);
+    void (*Axpy)(double A, const double *X, double *Y, int64_t N);
+    double (*Reduce)(const double *X, const double *Y, int64_t N);
+  };
+
+  /// MEOW_MATH_KERNELS - define the MathKernels Name for vectors of W doubles,
+  /// compiled with the function attributes Attrs.
+#define MEOW_MATH_KERNELS(Name, W, Attrs)                                      \
+  Attrs static void Name##Sin(const double *X, double *Y, int64_t N) {         \
+    mapVectors<W>(X, Y, N, SinCos{0});                                         \
+  }                                                                            \
+  Attrs static void Name##Cos(const double *X, double *Y, int64_t N) {         \
+    mapVectors<W>(X, Y, N, SinCos{1});                                         \
+  }                                                                            \
+  Attrs static void Name##Sqrt(const double *X, double *Y, int64_t N) {        \
+    mapVectors<W>(X, Y, N, Sqrt{});                                            \
+  }                                                                            \
+  Attrs static void Name##Pow(const double *X, double P, double *Y,            \
+                              int64_t N) {                                     \
+    powVectors<W>(X, P, Y, N);                                                 \
+  }                                                                            \
+  Attrs static void Name##Axpy(double A, const double *X, double *Y,           \
+                               int64_t N) {                                    \
+    axpyVectors<W>(A, X, Y, N);                                                \
+  }                                                                            \
+  Attrs static double Name##Reduce(const double *X, const double *Y,           \
+                                   int64_t N) {                                \
+    return reduceVectors<W>(X, Y, N);                                          \
+  }                                                                            \
+  static const MathKernels Name = {Name##Sin,  Name##Cos,  Name##Sqrt,         \
+                                   Name##Pow,  Name##Axpy, Name##Reduce};
+
+  MEOW_MATH_KERNELS(GenericKernels, 2, )
+#if defined(__x86_64__) || defined(__i386__)
+  MEOW_MATH_KERNELS(AVX2Kernels, 4, __attribute__((target("avx2,fma"))))
+  MEOW_MATH_KERNELS(AVX512Kernels, 8, __attribute__((target("avx512f"))))
+#endif
+
+  /// getMathKernels - the widest kernels this machine can run, chosen once.
+  static const MathKernels &getMathKernels() {
+    static const MathKernels &Kernels = []() -> const MathKernels & {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f"))
+        return AVX512Kernels;
+      if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return AVX2Kernels;
+#endif
+      return GenericKernels;
+    }();
+    return Kernels;
+  }
+
+  /// meow_vsin - Y[i] = sin(X[i]) for i in [0, N). Called by the vsin builtin,
+  /// as are the kernels below by theirs.
+  extern "C" DLLEXPORT void meow_vsin(const double *X, double *Y, int64_t N) {
+    getMathKernels().Sin(X, Y, N);
+  }
+
+  /// meow_vcos - Y[i] = cos(X[i]) for i in [0, N).
+  extern "C" DLLEXPORT void meow_vcos(const double *X, double *Y, int64_t N) {
+    getMathKernels().Cos(X, Y, N);
+  }
+
+  /// meow_vsqrt - Y[i] = sqrt(X[i]) for i in [0, N).
+  extern "C" DLLEXPORT void meow_vsqrt(const double *X, double *Y, int64_t N) {
+    getMathKernels().Sqrt(X, Y, N);
+  }
+
+  /// meow_vpow - Y[i] = pow(X[i], P) for i in [0, N). Integer powers up to 64
+  /// are done by repeated squaring, so may differ from libm's pow by a few
+  /// units in the last place.
+  extern "C" DLLEXPORT void meow_vpow(const double *X, double P, double *Y,
+                                      int64_t N) {
+    getMathKernels().Pow(X, P, Y, N);
+  }
+
+  /// meow_axpy - Y[i] += A * X[i] for i in [0, N).
+  extern "C" DLLEXPORT void meow_axpy(double A, const double *X, double *Y,
+                                      int64_t N) {
+    getMathKernels().Axpy(A, X, Y, N);
+  }
+
+  /// meow_dot - the dot product of X[0, N) and Y[0, N).
+  extern "C" DLLEXPORT double meow_dot(const double *X, const double *Y,
+                                       int64_t N) {
+    return getMathKernels().Reduce(X, Y, N);
+  }
+
+  /// meow_sum - the sum of X[0, N).
+  extern "C" DLLEXPORT double meow_sum(const double *X, int64_t N) {
+    return getMathKernels().Reduce(X, nullptr, N);
+  }
+
+  ///=============== //
+  /// Random numbers //
+  ///=============== //
+
+  /// RNG - a xoshiro256++ generator. Every thread has its own, and compiled
+  /// code inlines the uniform generator on the state meow_rng_state returns,
+  /// so the layout of S and the algorithm in next() are shared with meowc.
+  struct RNG {
+    uint64_t S[4];
+    /// The second of the pair of normals the polar method makes.
+    double Spare;
+    bool HasSpare;
+
+    static uint64_t rotl(uint64_t X, int K) {
+      return (X << K) | (X >> (64 - K));
+    }
+
+    uint64_t next() {
+      uint64_t Result = rotl(S[0] + S[3], 23) + S[0];
+      uint64_t T = S[1] << 17;
+      S[2] ^= S[0];
+      S[3] ^= S[1];
+      S[1] ^= S[2];
+      S[0] ^= S[3];
+      S[2] ^= T;
+      S[3] = rotl(S[3], 45);
+      return Result;
+    }
+
+    double uniform() { return (next() >> 11) * 0x1p-53; }
+
+    /// normal - a standard normal, by Marsaglia's polar method.
+    double normal() {
+      if (HasSpare) {
+        HasSpare = false;
+        return Spare;
+      }
+      double U, V, R;
+      do {
+        U = 2 * uniform() - 1;
+        V = 2 * uniform() - 1;
+        R = U * U + V * V;
+      } while (R >= 1 || R == 0);
+      double F = std::sqrt(-2 * std::log(R) / R);
+      Spare = V * F;
+      HasSpare = true;
+      return U * F;
+    }
+
+    /// seed - start stream Stream of Seed: the state splitmix64 makes from
+    /// Seed, jumped Stream times.
+    void seed(uint64_t Seed, uint64_t Stream) {
+      for (uint64_t &W : S) {
+        uint64_t Z = (Seed += 0x9e3779b97f4a7c15);
+        Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9;
+        Z = (Z ^ (Z >> 27)) * 0x94d049bb133111eb;
+        W = Z ^ (Z >> 31);
+      }
+      HasSpare = false;
+      while (Stream--)
+        jump();
+    }
+
+    /// jump - advance 2^128 steps, to the start of a stream which won't
+    /// overlap this one for any realistic run.
+    void jump() {
+      static const uint64_t Jump[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                      0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+      uint64_t T[4] = {};
+      for (uint64_t J : Jump)
+        for (int b = 0; b != 64; ++b) {
+          if (J & uint64_t(1) << b)
+            for (int w = 0; w != 4; ++w)
+              T[w] ^= S[w];
+          next();
+        }
+      memcpy(S, T, sizeof S);
+      HasSpare = false;
+    }
+  };
+
+  /// newThreadRNG - the generator for a thread not yet seeded: the Nth thread
+  /// to use one gets stream N of the seed in MEOW_SEED, or of 0, so a program
+  /// is reproducible as long as its threads start drawing in the same order.
+  static RNG newThreadRNG() {
+    static std::atomic<uint64_t> NumThreads{0};
+    const char *Seed = getenv("MEOW_SEED");
+    RNG R;
+    R.seed(Seed ? strtoull(Seed, nullptr, 0) : 0, NumThreads++);
+    return R;
+  }
+
+  static thread_local RNG TheRNG = newThreadRNG();
+
+  /// meow_rng_state - this thread's generator state, which the rand builtin
+  /// advances inline.
+  extern "C" DLLEXPORT uint64_t *meow_rng_state() { return TheRNG.S; }
+
+  /// meow_rng_seed - restart this thread's generator on stream Stream of
+  /// Seed. Called by the seed builtin.
+  extern "C" DLLEXPORT void meow_rng_seed(int64_t Seed, int64_t Stream) {
+    TheRNG.seed(Seed, Stream);
+  }
+
+  /// meow_rng_jump - move this thread's generator on to its next stream.
+  /// Called by the jump builtin.
+  extern "C" DLLEXPORT void meow_rng_jump() { TheRNG.jump(); }
+
+  /// meow_randn - a standard normal. Called by the randn builtin.
+  extern "C" DLLEXPORT double meow_randn() { return TheRNG.normal(); }
+
+  /// meow_rand_fill - fill X[0, N) with uniforms in [0, 1), as repeated
+  /// calls to rand would. Called by the randfill builtin.
+  extern "C" DLLEXPORT void meow_rand_fill(double *X, int64_t N) {
+    RNG R = TheRNG;
+    for (int64_t i = 0; i != N; ++i)
+      X[i] = R.uniform();
+    TheRNG = R;
+  }
+
+  /// meow_randn_fill - fill X[0, N) with standard normals. Called by the
+  /// randnfill builtin.
+  extern "C" DLLEXPORT void meow_randn_fill(double *X, int64_t N) {
+    RNG R = TheRNG;
+    for (int64_t i = 0; i != N; ++i)
+      X[i] = R.normal();
+    TheRNG = R;
+  }
+
+  ///========================= //
+  /// Tasks and parallel loops //
+  ///========================= //
+
+  /// Task - a unit of work for the Scheduler, run once by whichever thread
+  /// takes it.
+  struct Task {
+    void (*Run)(Task *Self);
+  };
+
+  /// Scheduler - the threads spawned tasks and parfor loops run on: the
+  /// program's own threads, and MEOW_THREADS - 1 workers (by default one per
+  /// core, less one).
+  ///
+  /// Each worker has a deque of tasks, and the program's threads share the
+  /// first. A thread pushes the tasks it creates onto the back of its own
+  /// deque and takes them from there, so recursive code runs depth first; when
+  /// its deque runs dry it steals from the front of the others', where the
+  /// oldest and usually largest tasks are. A thread waiting for a task runs
+  /// others until it is done, and only sleeps when there are none to take.
+  class Scheduler {
+  public:
+    using BodyFn = void (*)(int64_t Lo, int64_t Hi, void *Env);
+
+    /// MaxThreads - the most threads MEOW_THREADS may ask for.
+    static constexpr long MaxThreads = 1024;
+
+    Scheduler() {
+      NumThreads = std::max(std::thread::hardware_concurrency(), 1u);
+      if (const char *Threads = getenv("MEOW_THREADS")) {
+        char *End;
+        errno = 0;
+        long N = strtol(Threads, &End, 10);
+        if (End != Threads && !*End && !errno && N >= 1)
+          NumThreads = std::min(N, MaxThreads);
+      }
+      Queues.reset(new Queue[NumThreads]);
+      for (unsigned i = 1; i != NumThreads; ++i)
+        std::thread(&Scheduler::workerMain, this, i).detach();
+    }
+
+    /// getScheduler - the scheduler, started on first use. It is never
+    /// destroyed: its workers may be blocked at exit.
+    static Scheduler &getScheduler() {
+      static Scheduler *S = new Scheduler();
+      return *S;
+    }
+
+    unsigned getNumThreads() const { return NumThreads; }
+
+    /// push - queue T on the deque of thread Owner.
+    void push(Task *T, unsigned Owner) {
+      {
+        std::lock_guard<std::mutex> L(Queues[Owner].Lock);
+        Queues[Owner].Tasks.push_back(T);
+      }
+      ++Queued;
+      if (Sleepers) {
+        std::lock_guard<std::mutex> L(WakeLock);
+        Wake.notify_one();
+      }
+    }
+    void push(Task *T) { push(T, Self); }
+
+    /// helpUntil - run tasks until IsDone holds.
+    template <typename Pred> void helpUntil(Pred IsDone) {
+      while (!IsDone()) {
+        if (Task *T = take()) {
+          T->Run(T);
+          continue;
+        }
+        std::unique_lock<std::mutex> L(WakeLock);
+        ++Sleepers;
+        Wake.wait(L, [&] { return IsDone() || Queued; });
+        --Sleepers;
+      }
+    }
+
+    /// notifyDone - wake the threads waiting in helpUntil to recheck whether
+    /// they are done; call after making a condition they wait for true.
+    void notifyDone() {
+      if (Sleepers) {
+        std::lock_guard<std::mutex> L(WakeLock);
+        Wake.notify_all();
+      }
+    }
+
+    /// parallelFor - call Body on chunks of [Lo, Hi) across the threads,
+    /// returning once every iteration is done. The calling thread's share is
+    /// queued first, so it starts on the front of the range.
+    void parallelFor(int64_t Lo, int64_t Hi, BodyFn Body, void *Env) {
+      if (Hi <= Lo)
+        return;
+      // Hi - Lo may not fit in an int64_t, but always does in a uint64_t.
+      uint64_t N = (uint64_t)Hi - (uint64_t)Lo;
+      if (NumThreads == 1 || N == 1) {
+        Body(Lo, Hi, Env);
+        return;
+      }
+
+      // What the caller printed comes before what the loop prints.
+      TheOutput.flush();
+      int64_t NumChunks = std::min<uint64_t>(N, NumThreads * ChunksPerThread);
+      std::atomic<int64_t> Left{NumChunks};
+      std::vector<Chunk> Chunks(NumChunks);
+      // Chunk c starts c * N / NumChunks iterations in, computed so as not to
+      // overflow: the first N % NumChunks chunks are one iteration longer.
+      auto Start = [&](uint64_t c) -> int64_t {
+        return (uint64_t)Lo + N / NumChunks * c + std::min(c, N % NumChunks);
+      };
+      // Deal each thread a contiguous run of chunks, pushed last to first so
+      // each thread takes its run in order.
+      for (int64_t c = NumChunks; c-- != 0;) {
+        Chunks[c] = {{runChunk}, Start(c), Start(c + 1), Body, Env, &Left};
+        push(&Chunks[c], (Self + c * NumThreads / NumChunks) % NumThreads);
+      }
+      helpUntil([&] { return Left == 0; });
+    }
+
+  private:
+    static constexpr int64_t ChunksPerThread = 16;
+
+    struct Chunk : Task {
+      int64_t Lo, Hi;
+      BodyFn Body;
+      void *Env;
+      std::atomic<int64_t> *Left;
+    };
+    struct Queue {
+      std::mutex Lock;
+      std::deque<Task *> Tasks;
+    };
+
+    unsigned NumThreads;
+    std::unique_ptr<Queue[]> Queues;
+    /// The deque this thread owns; the program's threads share deque 0.
+    static thread_local unsigned Self;
+
+    /// The number of tasks in the deques, and of threads asleep waiting for
+    /// one (or for what they are helping with to finish).
+    std::atomic<int64_t> Queued{0};
+    std::atomic<unsigned> Sleepers{0};
+    std::mutex WakeLock;
+    std::condition_variable Wake;
+
+    static void runChunk(Task *T) {
+      Chunk &C = *static_cast<Chunk *>(T);
+      // The chunks belong to the loop's caller, which may return as soon as
+      // the last one is counted.
+      std::atomic<int64_t> *Left = C.Left;
+      C.Body(C.Lo, C.Hi, C.Env);
+      // Once it is counted the program may exit, so print what it printed.
+      TheOutput.flush();
+      if (--*Left == 0)
+        getScheduler().notifyDone();
+    }
+
+    Task *pop(unsigned Owner, bool Back) {
+      Queue &Q = Queues[Owner];
+      std::lock_guard<std::mutex> L(Q.Lock);
+      if (Q.Tasks.empty())
+        return nullptr;
+      Task *T;
+      if (Back) {
+        T = Q.Tasks.back();
+        Q.Tasks.pop_back();
+      } else {
+        T = Q.Tasks.front();
+        Q.Tasks.pop_front();
+      }
+      --Queued;
+      return T;
+    }
+
+    /// take - the next task for this thread: the newest of its own, or else
+    /// the oldest of another's.
+    Task *take() {
+      if (!Queued)
+        return nullptr;
+      if (Task *T = pop(Self, true))
+        return T;
+      for (unsigned i = 1; i != NumThreads; ++i)
+        if (Task *T = pop((Self + i) % NumThreads, false))
+          return T;
+      return nullptr;
+    }
+
+    void workerMain(unsigned Id) {
+      Self = Id;
+      for (;;) {
+        if (Task *T = take()) {
+          T->Run(T);
+          continue;
+        }
+        std::unique_lock<std::mutex> L(WakeLock);
+        ++Sleepers;
+        Wake.wait(L, [&] { return Queued != 0; });
+        --Sleepers;
+      }
+    }
+
+  };
+
+  thread_local unsigned Scheduler::Self = 0;
 
-  // pow - power
-  extern "C" DLLEXPORT double pow(double X, double Y) { return std::pow(X, Y); }
+  /// meow_parfor - run Body over [Lo, Hi) on the scheduler. Called for parfor
+  /// loops, whose bodies are outlined into functions taking a chunk of the
+  /// range and the loop's captured variables.
+  extern "C" DLLEXPORT void meow_parfor(int64_t Lo, int64_t Hi,
+                                        Scheduler::BodyFn Body, void *Env) {
+    Scheduler::getScheduler().parallelFor(Lo, Hi, Body, Env);
+  }
+
+  /// ReduceBlock - the number of iterations of a parfor reduction folded in
+  /// order into one partial result.
+  static constexpr int64_t ReduceBlock = 1024;
+
+  /// meow_parfor_reduce - reduce [Lo, Hi) on the pool. Called for parfor
+  /// loops with a reduction, whose Block folds a non-empty run of iterations
+  /// in order and whose Combine is the reduction operator. The blocks are
+  /// ReduceBlock iterations from Lo and their results are combined pairwise in
+  /// a fixed tree, so the result depends on the range but never on the number
+  /// of threads or how the blocks were scheduled. An empty range gives Empty.
+  extern "C" DLLEXPORT double
+  meow_parfor_reduce(int64_t Lo, int64_t Hi,
+                     double (*Block)(int64_t Lo, int64_t Hi, void *Env),
+                     void *Env, double (*Combine)(double, double),
+                     double Empty) {
+    if (Hi <= Lo)
+      return Empty;
+
+    struct Reduction {
+      int64_t Lo, Hi;
+      double (*Block)(int64_t, int64_t, void *);
+      void *Env;
+      std::vector<double> Partials;
+    };
+    // Hi - Lo may not fit in an int64_t, but always does in a uint64_t.
+    uint64_t N = (uint64_t)Hi - (uint64_t)Lo;
+    uint64_t Blocks = N / ReduceBlock + (N % ReduceBlock != 0);
+    Reduction Job{Lo, Hi, Block, Env, std::vector<double>(Blocks)};
+    int64_t NumBlocks = Job.Partials.size();
+
+    meow_parfor(
+        0, NumBlocks,
+        [](int64_t First, int64_t End, void *P) {
+          Reduction &R = *static_cast<Reduction *>(P);
+          for (int64_t B = First; B != End; ++B) {
+            int64_t BlockLo = (uint64_t)R.Lo + (uint64_t)B * ReduceBlock;
+            uint64_t Rest = (uint64_t)R.Hi - (uint64_t)BlockLo;
+            int64_t BlockHi = BlockLo + std::min<uint64_t>(Rest, ReduceBlock);
+            R.Partials[B] = R.Block(BlockLo, BlockHi, R.Env);
+          }
+        },
+        &Job);
+
+    for (int64_t Stride = 1; Stride < NumBlocks; Stride *= 2)
+      for (int64_t B = 0; B + Stride < NumBlocks; B += 2 * Stride)
+        Job.Partials[B] =
+            Combine(Job.Partials[B], Job.Partials[B + Stride]);
+    return Job.Partials[0];
+  }
+
+  /// SpawnedTask - a task started by spawn: a call to Fn with a copy of the
+  /// arguments the compiler packed for it, which follow the task in memory.
+  /// It is aligned for any argument, vectors included.
+  struct alignas(64) SpawnedTask : Task {
+    double (*Fn)(void *Env);
+    double Result;
+    std::atomic<bool> Done{false};
+
+    void *getEnv() { return this + 1; }
+  };
+
+  /// meow_spawn - start a call to Fn with a copy of the EnvSize bytes at Env,
+  /// returning a handle for meow_await. With one thread the call runs now.
+  extern "C" DLLEXPORT SpawnedTask *meow_spawn(double (*Fn)(void *Env),
+                                               const void *Env,
+                                               int64_t EnvSize) {
+    void *Mem = ::operator new(sizeof(SpawnedTask) + EnvSize,
+                               std::align_val_t(alignof(SpawnedTask)));
+    SpawnedTask *T = new (Mem) SpawnedTask;
+    memcpy(T->getEnv(), Env, EnvSize);
+    T->Fn = Fn;
+    T->Run = [](Task *Self) {
+      SpawnedTask *Spawned = static_cast<SpawnedTask *>(Self);
+      Spawned->Result = Spawned->Fn(Spawned->getEnv());
+      // Once it is done the program may exit, so print what it printed.
+      TheOutput.flush();
+      Spawned->Done = true;
+      Scheduler::getScheduler().notifyDone();
+    };
+
+    Scheduler &S = Scheduler::getScheduler();
+    if (S.getNumThreads() == 1) {
+      T->Run(T);
+    } else {
+      // What the caller printed comes before what the task prints.
+      TheOutput.flush();
+      S.push(T);
+    }
+    return T;
+  }
+
+  /// meow_await - wait for the task T to finish, running other tasks in the
+  /// meantime, and return its result. Every handle is awaited exactly once,
+  /// which frees it.
+  extern "C" DLLEXPORT double meow_await(SpawnedTask *T) {
+    Scheduler::getScheduler().helpUntil([&] { return T->Done.load(); });
+    double Result = T->Result;
+    T->~SpawnedTask();
+    ::operator delete(T, std::align_val_t(alignof(SpawnedTask)));
+    return Result;
+  }
+
+  ///============= //
+  /// Mapped files //
+  ///============= //
+
+  /// MappedFile - a file of doubles mapped read-only into memory. A file is
+  /// either raw native-endian doubles, or starts with a header:
+  ///
+  ///   char Magic[8] = "MEOWDATA"; int64_t Rank; int64_t Dims[Rank];
+  ///
+  /// followed by the product of Dims doubles in row-major order.
+  struct MappedFile {
+    const double *Data;
+    int64_t Len;
+    std::vector<int64_t> Dims;
+  };
+
+  static constexpr char MappedFileMagic[8] = {'M', 'E', 'O', 'W',
+                                              'D', 'A', 'T', 'A'};
+
+  [[noreturn]] static void MapFail(const char *Path, const char *Why) {
+    TheOutput.flush();
+    fprintf(stderr, "libmeow: cannot map %s: %s\n", Path, Why);
+    abort();
+  }
+
+  /// MapFile - map Path, or find its existing mapping. Files are mapped once
+  /// per process and never unmapped.
+  static const MappedFile &MapFile(const char *Path) {
+    static std::mutex Lock;
+    static std::map<std::string, MappedFile> Files;
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Files.find(Path);
+    if (It != Files.end())
+      return It->second;
+
+    int FD = open(Path, O_RDONLY);
+    if (FD < 0)
+      MapFail(Path, strerror(errno));
+    struct stat St;
+    if (fstat(FD, &St) != 0)
+      MapFail(Path, strerror(errno));
+    size_t Size = St.st_size;
+
+    const char *Base = nullptr;
+    if (Size) {
+      void *P = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, FD, 0);
+      if (P == MAP_FAILED)
+        MapFail(Path, strerror(errno));
+      // Most programs stream through their data once; let the kernel read
+      // ahead aggressively and drop pages behind the scan.
+      madvise(P, Size, MADV_SEQUENTIAL);
+      Base = static_cast<const char *>(P);
+    }
+    close(FD);
+
+    MappedFile F;
+    size_t Offset = 0;
+    if (Size >= 16 && memcmp(Base, MappedFileMagic, 8) == 0) {
+      int64_t Rank;
+      memcpy(&Rank, Base + 8, sizeof(Rank));
+      if (Rank < 0 || (size_t)Rank > (Size - 16) / sizeof(int64_t))
+        MapFail(Path, "truncated header");
+      Offset = 16 + Rank * sizeof(int64_t);
+      F.Dims.resize(Rank);
+      memcpy(F.Dims.data(), Base + 16, Rank * sizeof(int64_t));
+      F.Len = 1;
+      for (int64_t D : F.Dims)
+        if (D < 0 || __builtin_mul_overflow(F.Len, D, &F.Len))
+          MapFail(Path, "bad shape");
+      if ((size_t)F.Len > (Size - Offset) / sizeof(double))
+        MapFail(Path, "shape is larger than the file");
+    } else {
+      if (Size % sizeof(double))
+        MapFail(Path, "size is not a multiple of 8 bytes");
+      F.Len = Size / sizeof(double);
+      F.Dims.push_back(F.Len);
+    }
+    F.Data = reinterpret_cast<const double *>(Base + Offset);
+    return Files.emplace(Path, std::move(F)).first->second;
+  }
+
+  /// meow_map - map Path, storing the number of doubles in *Len and returning
+  /// the first. Called by the map builtin.
+  extern "C" DLLEXPORT const double *meow_map(const char *Path, int64_t *Len) {
+    const MappedFile &F = MapFile(Path);
+    *Len = F.Len;
+    return F.Data;
+  }
+
+  /// meow_map_dim - extent Dim of the shape of Path, or 0 past its rank.
+  extern "C" DLLEXPORT int64_t meow_map_dim(const char *Path, int64_t Dim) {
+    const MappedFile &F = MapFile(Path);
+    return Dim >= 0 && (size_t)Dim < F.Dims.size() ? F.Dims[Dim] : 0;
+  }
 
-  // sin - sine
-  extern "C" DLLEXPORT double sin(double X) { return std::sin(X); }
+  ///============ //
+  /// Memoization //
+  ///============ //
 
-  // cos - cosine
-  extern "C" DLLEXPORT double cos(double X) { return std::cos(X); }
+  /// MemoTable - a fixed-size, open-addressed cache from a tuple of double
+  /// arguments to the result of a 'memo' function. Each slot is stored inline
+  /// as [tag, arg0 ... argN-1, result], so a probe usually touches a single
+  /// cache line. The tag is the key's hash with the low bit set; 0 means empty.
+  /// When a probe window is full, the entry at the home slot is replaced.
+  ///
+  /// Spawned tasks and parfor bodies share a table, so each slot is a seqlock:
+  /// a writer claims it by swapping its tag for Busy, fills it in and then
+  /// publishes the new tag, and a reader that sees the tag change under it
+  /// treats the probe as a miss. Writers that lose a race just drop the entry.
+  struct MemoTable {
+    static constexpr uint64_t NumSlots = 1 << 12; // must be a power of two
+    static constexpr uint64_t MaxProbe = 8;
+    static constexpr uint64_t Busy = 2; // never a tag: tags are odd
 
-  // tan - tangent
-  extern "C" DLLEXPORT double tan(double X) { return std::tan(X); }
-} // namespace libmeow
\ No newline at end of file
+    uint64_t NumArgs;
+    uint64_t Stride; // in 64-bit words
+    std::unique_ptr<uint64_t[]> Slots;
+
+    MemoTable(uint64_t N)
+        : NumArgs(N), Stride(N + 2),
+          Slots(new uint64_t[NumSlots * (N + 2)]()) {}
+
+    /// hash - mix the bit patterns of the arguments (splitmix64 finalizer).
+    uint64_t hash(const double *Args) const {
+      uint64_t H = 0x9e3779b97f4a7c15ULL * (NumArgs + 1);
+      for (uint64_t i = 0; i != NumArgs; ++i) {
+        uint64_t Bits;
+        memcpy(&Bits, &Args[i], sizeof(Bits));
+        H = (H ^ Bits) * 0xbf58476d1ce4e5b9ULL;
+        H ^= H >> 31;
+      }
+      H = (H ^ (H >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      H = (H ^ (H >> 27)) * 0x94d049bb133111ebULL;
+      return (H ^ (H >> 31)) | 1;
+    }
+
+    uint64_t *slot(uint64_t Idx) const {
+      return &Slots[(Idx & (NumSlots - 1)) * Stride];
+    }
+
+    static std::atomic_ref<uint64_t> word(uint64_t *Slot, uint64_t i) {
+      return std::atomic_ref<uint64_t>(Slot[i]);
+    }
+  };
+
+  /// meow_memo_init - the cache in *Table for a memo function taking NumArgs
+  /// arguments, created if *Table is still null. Threads that race to create
+  /// it agree on one.
+  extern "C" DLLEXPORT void *meow_memo_init(void **Table, int64_t NumArgs) {
+    std::atomic_ref<void *> Ref(*Table);
+    void *Old = Ref.load(std::memory_order_acquire);
+    if (Old)
+      return Old;
+    auto *New = new MemoTable(NumArgs);
+    if (Ref.compare_exchange_strong(Old, New, std::memory_order_acq_rel,
+                                    std::memory_order_acquire))
+      return New;
+    delete New;
+    return Old;
+  }
+
+  /// meow_memo_free - free a table from meow_memo_init, when the code that
+  /// uses it is unloaded. Does nothing if Table is null.
+  extern "C" DLLEXPORT void meow_memo_free(void *Table) {
+    delete static_cast<MemoTable *>(Table);
+  }
+
+  /// meow_memo_get - look Args up in the table, storing the cached result in
+  /// Result and returning 1 on a hit, or returning 0 on a miss.
+  extern "C" DLLEXPORT int32_t meow_memo_get(void *Table, const double *Args,
+                                             double *Result) {
+    auto *T = static_cast<MemoTable *>(Table);
+    uint64_t Tag = T->hash(Args);
+    for (uint64_t i = 0; i != MemoTable::MaxProbe; ++i) {
+      uint64_t *Slot = T->slot(Tag + i);
+      uint64_t Seen = T->word(Slot, 0).load(std::memory_order_acquire);
+      if (Seen == 0)
+        return 0;
+      if (Seen != Tag)
+        continue;
+      bool Same = true;
+      for (uint64_t a = 0; a != T->NumArgs && Same; ++a) {
+        uint64_t Bits;
+        memcpy(&Bits, &Args[a], sizeof(Bits));
+        Same = T->word(Slot, a + 1).load(std::memory_order_relaxed) == Bits;
+      }
+      uint64_t Bits =
+          T->word(Slot, T->Stride - 1).load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (T->word(Slot, 0).load(std::memory_order_relaxed) != Tag)
+        return 0;
+      if (Same) {
+        memcpy(Result, &Bits, sizeof(double));
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  /// meow_memo_put - cache Result for Args, evicting the entry in the home
+  /// slot if the probe window has no free slot.
+  extern "C" DLLEXPORT void meow_memo_put(void *Table, const double *Args,
+                                          double Result) {
+    auto *T = static_cast<MemoTable *>(Table);
+    uint64_t Tag = T->hash(Args);
+    uint64_t *Slot = T->slot(Tag);
+    uint64_t Old = T->word(Slot, 0).load(std::memory_order_relaxed);
+    for (uint64_t i = 0; i != MemoTable::MaxProbe; ++i) {
+      uint64_t *Probe = T->slot(Tag + i);
+      uint64_t Seen = T->word(Probe, 0).load(std::memory_order_relaxed);
+      if (Seen == Tag)
+        return; // cached already, or being cached by another thread
+      if (Seen == 0) {
+        Slot = Probe;
+        Old = 0;
+        break;
+      }
+    }
+    if (Old == MemoTable::Busy ||
+        !T->word(Slot, 0).compare_exchange_strong(Old, MemoTable::Busy,
+                                                  std::memory_order_relaxed))
+      return;
+    std::atomic_thread_fence(std::memory_order_release);
+    for (uint64_t a = 0; a != T->NumArgs; ++a) {
+      uint64_t Bits;
+      memcpy(&Bits, &Args[a], sizeof(Bits));
+      T->word(Slot, a + 1).store(Bits, std::memory_order_relaxed);
+    }
+    uint64_t Bits;
+    memcpy(&Bits, &Result, sizeof(Bits));
+    T->word(Slot, T->Stride - 1).store(Bits, std::memory_order_relaxed);
+    T->word(Slot, 0).store(Tag, std::memory_order_release);
+  }
+
+  ///============================ //
+  /// Profile-guided optimization //
+  ///============================ //
+
+  /// ProfileModule - the counters of one -profile-generate object file.
+  struct ProfileModule {
+    const char *const *Names;
+    uint64_t *const *Counters;
+    int64_t NumCounters;
+    std::string Path;
+  };
+
+  static std::vector<ProfileModule> &getProfileModules() {
+    static std::vector<ProfileModule> Modules;
+    return Modules;
+  }
+
+  /// WriteProfiles - at exit, merge each module's counters into its profile
+  /// file, so repeated runs of a workload accumulate. MEOW_PROFILE_FILE
+  /// overrides the path chosen at compile time.
+  static void WriteProfiles() {
+    const char *Override = getenv("MEOW_PROFILE_FILE");
+    std::map<std::string, std::map<std::string, uint64_t>> Files;
+    for (const ProfileModule &M : getProfileModules()) {
+      auto &Counts = Files[Override ? Override : M.Path];
+      for (int64_t i = 0; i != M.NumCounters; ++i)
+        Counts[M.Names[i]] += *M.Counters[i];
+    }
+
+    for (auto &[Path, Counts] : Files) {
+      std::ifstream In(Path);
+      std::string Line;
+      while (std::getline(In, Line)) {
+        size_t Space = Line.rfind(' ');
+        if (Line.empty() || Line[0] == '#' || Space == std::string::npos)
+          continue;
+        Counts[Line.substr(0, Space)] +=
+            strtoull(Line.c_str() + Space + 1, nullptr, 10);
+      }
+      In.close();
+
+      FILE *Out = fopen(Path.c_str(), "w");
+      if (!Out) {
+        fprintf(stderr, "libmeow: could not write profile %s\n", Path.c_str());
+        continue;
+      }
+      fprintf(Out, "# meow profile v1\n");
+      for (auto &[Name, Count] : Counts)
+        fprintf(Out, "%s %llu\n", Name.c_str(), (unsigned long long)Count);
+      fclose(Out);
+    }
+  }
+
+  /// meow_prof_register - called from the constructor of a -profile-generate
+  /// object file with the names and addresses of its counters.
+  extern "C" DLLEXPORT void meow_prof_register(const char *const *Names,
+                                               uint64_t *const *Counters,
+                                               int64_t NumCounters,
+                                               const char *Path) {
+    auto &Modules = getProfileModules();
+    if (Modules.empty())
+      atexit(WriteProfiles);
+    Modules.push_back({Names, Counters, NumCounters, Path});
+  }
+
+  ///================ //
+  /// Instrumentation //
+  ///================ //
+
+  /// InstSite, InstDescriptor - the counter sites of an --instrument object
+  /// file, as meowc lays them out. Kind is 0 for a function entry, 1 for a
+  /// call site (Detail is the callee) and 2 for a loop.
+  struct InstSite {
+    const char *Name;
+    const char *Detail;
+    int64_t Kind;
+    int64_t Offset;
+  };
+  struct InstDescriptor {
+    int64_t Id;
+    int64_t NumCounters;
+    int64_t NumSites;
+    const InstSite *Sites;
+    const char *Path;
+  };
+
+  /// InstLoopBuckets - the buckets of a loop's trip count histogram, after
+  /// its runs and total trips: bucket 0 counts runs of no trips, bucket k
+  /// runs of [2^(k-1), 2^k) trips, and the last anything more.
+  static constexpr int64_t InstLoopBuckets = 33;
+
+  /// InstModule - a registered descriptor, copied so the counters can be
+  /// written after JIT-compiled code has been freed.
+  struct InstModule {
+    struct Site {
+      std::string Name, Detail;
+      int64_t Kind, Offset;
+    };
+    std::vector<Site> Sites;
+    int64_t NumCounters;
+    std::string Path;
+  };
+
+  /// InstState - every registered module, and the counter array of each
+  /// thread that has run its code. Arrays outlive their threads, so the
+  /// counts of finished workers are still written.
+  struct InstState {
+    std::mutex Lock;
+    std::vector<InstModule> Modules;
+    std::vector<std::pair<int64_t, uint64_t *>> Arrays;
+    int SignalPipe[2] = {-1, -1};
+  };
+
+  static InstState &getInstState() {
+    static InstState *S = new InstState;
+    return *S;
+  }
+
+  /// InstArrays - this thread's counter array for each module, by id.
+  static thread_local std::vector<uint64_t *> InstArrays;
+
+  static void writeJSONString(FILE *Out, const std::string &S) {
+    fputc('"', Out);
+    for (char C : S) {
+      if (C == '"' || C == '\\')
+        fprintf(Out, "\\%c", C);
+      else if (static_cast<unsigned char>(C) < 0x20)
+        fprintf(Out, "\\u%04x", C);
+      else
+        fputc(C, Out);
+    }
+    fputc('"', Out);
+  }
+
+  /// InstCounts - the counts of one file, summed over threads and over
+  /// modules that share site names.
+  struct InstCounts {
+    std::map<std::string, uint64_t> Entries;
+    std::map<std::string, std::pair<std::string, uint64_t>> Calls;
+    std::map<std::string, std::vector<uint64_t>> Loops;
+    size_t Threads = 0;
+  };
+
+  /// bucketRange - the trip counts bucket I of a loop histogram counts.
+  static std::pair<uint64_t, uint64_t> bucketRange(int64_t I) {
+    if (I == 0)
+      return {0, 0};
+    if (I == InstLoopBuckets - 1)
+      return {uint64_t(1) << (I - 1), UINT64_MAX};
+    return {uint64_t(1) << (I - 1), (uint64_t(1) << I) - 1};
+  }
+
+  /// sortedByCount - the entries of M, most counted first.
+  template <typename Map, typename Count>
+  static std::vector<typename Map::const_pointer> sortedByCount(const Map &M,
+                                                                Count C) {
+    std::vector<typename Map::const_pointer> V;
+    for (auto &E : M)
+      V.push_back(&E);
+    std::stable_sort(V.begin(), V.end(),
+                     [&](auto *A, auto *B) { return C(*A) > C(*B); });
+    return V;
+  }
+
+  static void writeInstJSON(FILE *Out, const InstCounts &C) {
+    fprintf(Out, "{\n  \"threads\": %zu,\n  \"functions\": [", C.Threads);
+    const char *Sep = "\n";
+    for (auto *E : sortedByCount(C.Entries, [](auto &E) { return E.second; })) {
+      fprintf(Out, "%s    {\"name\": ", Sep);
+      writeJSONString(Out, E->first);
+      fprintf(Out, ", \"entries\": %llu}", (unsigned long long)E->second);
+      Sep = ",\n";
+    }
+    fprintf(Out, "\n  ],\n  \"calls\": [");
+    Sep = "\n";
+    for (auto *E :
+         sortedByCount(C.Calls, [](auto &E) { return E.second.second; })) {
+      fprintf(Out, "%s    {\"site\": ", Sep);
+      writeJSONString(Out, E->first);
+      fprintf(Out, ", \"callee\": ");
+      writeJSONString(Out, E->second.first);
+      fprintf(Out, ", \"count\": %llu}",
+              (unsigned long long)E->second.second);
+      Sep = ",\n";
+    }
+    fprintf(Out, "\n  ],\n  \"loops\": [");
+    Sep = "\n";
+    auto Trips = [](auto &E) { return E.second[1]; };
+    for (auto *E : sortedByCount(C.Loops, Trips)) {
+      const std::vector<uint64_t> &L = E->second;
+      fprintf(Out, "%s    {\"site\": ", Sep);
+      writeJSONString(Out, E->first);
+      fprintf(Out, ", \"runs\": %llu, \"trips\": %llu, \"histogram\": [",
+              (unsigned long long)L[0], (unsigned long long)L[1]);
+      const char *BucketSep = "";
+      for (int64_t i = 0; i != InstLoopBuckets; ++i) {
+        if (!L[2 + i])
+          continue;
+        auto [Min, Max] = bucketRange(i);
+        fprintf(Out, "%s{\"min\": %llu, ", BucketSep, (unsigned long long)Min);
+        if (Max == UINT64_MAX)
+          fprintf(Out, "\"max\": null, ");
+        else
+          fprintf(Out, "\"max\": %llu, ", (unsigned long long)Max);
+        fprintf(Out, "\"runs\": %llu}", (unsigned long long)L[2 + i]);
+        BucketSep = ", ";
+      }
+      fprintf(Out, "]}");
+      Sep = ",\n";
+    }
+    fprintf(Out, "\n  ]\n}\n");
+  }
+
+  /// writeInstCSV - the counts as kind,site,detail,count rows. A loop has a
+  /// row for its runs, one for its trips, and one for each bucket of its
+  /// histogram with runs in it, whose detail is the range of trip counts.
+  static void writeInstCSV(FILE *Out, const InstCounts &C) {
+    fprintf(Out, "kind,site,detail,count\n");
+    for (auto *E : sortedByCount(C.Entries, [](auto &E) { return E.second; }))
+      fprintf(Out, "entry,%s,,%llu\n", E->first.c_str(),
+              (unsigned long long)E->second);
+    for (auto *E :
+         sortedByCount(C.Calls, [](auto &E) { return E.second.second; }))
+      fprintf(Out, "call,%s,%s,%llu\n", E->first.c_str(),
+              E->second.first.c_str(), (unsigned long long)E->second.second);
+    auto Trips = [](auto &E) { return E.second[1]; };
+    for (auto *E : sortedByCount(C.Loops, Trips)) {
+      const std::vector<uint64_t> &L = E->second;
+      const char *Site = E->first.c_str();
+      fprintf(Out, "loop,%s,runs,%llu\n", Site, (unsigned long long)L[0]);
+      fprintf(Out, "loop,%s,trips,%llu\n", Site, (unsigned long long)L[1]);
+      for (int64_t i = 0; i != InstLoopBuckets; ++i) {
+        if (!L[2 + i])
+          continue;
+        auto [Min, Max] = bucketRange(i);
+        if (Max == UINT64_MAX)
+          fprintf(Out, "loop,%s,%llu+,%llu\n", Site, (unsigned long long)Min,
+                  (unsigned long long)L[2 + i]);
+        else
+          fprintf(Out, "loop,%s,%llu-%llu,%llu\n", Site,
+                  (unsigned long long)Min, (unsigned long long)Max,
+                  (unsigned long long)L[2 + i]);
+      }
+    }
+  }
+
+  /// meow_inst_write - write out the counts so far. Other threads may still
+  /// be counting, so the counts are a snapshot. Each file is rewritten whole;
+  /// MEOW_INSTRUMENT_FILE overrides the path chosen at compile time.
+  extern "C" DLLEXPORT void meow_inst_write() {
+    InstState &S = getInstState();
+    std::lock_guard<std::mutex> Guard(S.Lock);
+    if (S.Modules.empty())
+      return;
+
+    const char *Override = getenv("MEOW_INSTRUMENT_FILE");
+    std::map<std::string, InstCounts> Files;
+    std::vector<std::vector<uint64_t>> Totals(S.Modules.size());
+    for (size_t i = 0; i != S.Modules.size(); ++i)
+      Totals[i].resize(S.Modules[i].NumCounters);
+    for (auto &[Id, Array] : S.Arrays) {
+      for (int64_t i = 0; i != S.Modules[Id].NumCounters; ++i)
+        Totals[Id][i] += std::atomic_ref<uint64_t>(Array[i]).load(
+            std::memory_order_relaxed);
+      Files[Override ? Override : S.Modules[Id].Path].Threads++;
+    }
+
+    for (size_t i = 0; i != S.Modules.size(); ++i) {
+      const InstModule &M = S.Modules[i];
+      InstCounts &C = Files[Override ? Override : M.Path];
+      for (const InstModule::Site &Site : M.Sites) {
+        const uint64_t *Counts = &Totals[i][Site.Offset];
+        if (Site.Kind == 0) {
+          C.Entries[Site.Name] += Counts[0];
+        } else if (Site.Kind == 1) {
+          auto &Call = C.Calls[Site.Name];
+          Call.first = Site.Detail;
+          Call.second += Counts[0];
+        } else {
+          auto &Loop = C.Loops[Site.Name];
+          Loop.resize(2 + InstLoopBuckets);
+          for (int64_t j = 0; j != 2 + InstLoopBuckets; ++j)
+            Loop[j] += Counts[j];
+        }
+      }
+    }
+
+    for (auto &[Path, C] : Files) {
+      FILE *Out = fopen(Path.c_str(), "w");
+      if (!Out) {
+        fprintf(stderr, "libmeow: could not write counters %s\n",
+                Path.c_str());
+        continue;
+      }
+      if (Path.size() >= 4 && Path.compare(Path.size() - 4, 4, ".csv") == 0)
+        writeInstCSV(Out, C);
+      else
+        writeInstJSON(Out, C);
+      fclose(Out);
+    }
+  }
+
+  /// InstSignalHandler - SIGUSR1 asks for the counts; the writer thread
+  /// writes them, as little is safe to do in a handler.
+  static void InstSignalHandler(int) {
+    int SavedErrno = errno;
+    char C = 0;
+    if (write(getInstState().SignalPipe[1], &C, 1) < 0) {
+      // Nothing can be done about it here.
+    }
+    errno = SavedErrno;
+  }
+
+  /// startInstWriter - write the counts at exit and on SIGUSR1.
+  static void startInstWriter(InstState &S) {
+    atexit(meow_inst_write);
+    if (pipe(S.SignalPipe) != 0)
+      return;
+    std::thread([&S] {
+      char C;
+      while (read(S.SignalPipe[0], &C, 1) == 1 || errno == EINTR)
+        meow_inst_write();
+    }).detach();
+    struct sigaction SA = {};
+    SA.sa_handler = InstSignalHandler;
+    SA.sa_flags = SA_RESTART;
+    sigemptyset(&SA.sa_mask);
+    sigaction(SIGUSR1, &SA, nullptr);
+  }
+
+  /// newInstArray - register the module D if this is the first time any
+  /// thread has asked for it, and give this thread its counter array.
+  static uint64_t *newInstArray(InstDescriptor *D) {
+    InstState &S = getInstState();
+    std::lock_guard<std::mutex> Guard(S.Lock);
+    std::atomic_ref<int64_t> Id(D->Id);
+    if (Id.load(std::memory_order_relaxed) < 0) {
+      InstModule M;
+      for (int64_t i = 0; i != D->NumSites; ++i) {
+        const InstSite &Site = D->Sites[i];
+        M.Sites.push_back({Site.Name, Site.Detail ? Site.Detail : "",
+                           Site.Kind, Site.Offset});
+      }
+      M.NumCounters = D->NumCounters;
+      M.Path = D->Path;
+      if (S.Modules.empty())
+        startInstWriter(S);
+      S.Modules.push_back(std::move(M));
+      Id.store(S.Modules.size() - 1, std::memory_order_release);
+    }
+
+    int64_t I = Id.load(std::memory_order_relaxed);
+    uint64_t *Array = new uint64_t[std::max<int64_t>(D->NumCounters, 1)]();
+    S.Arrays.emplace_back(I, Array);
+    if (InstArrays.size() <= size_t(I))
+      InstArrays.resize(I + 1);
+    InstArrays[I] = Array;
+    return Array;
+  }
+
+  /// meow_inst_counters - this thread's counter array for the module D.
+  /// Called on entry to each function of an --instrument object file.
+  extern "C" DLLEXPORT uint64_t *meow_inst_counters(InstDescriptor *D) {
+    int64_t Id =
+        std::atomic_ref<int64_t>(D->Id).load(std::memory_order_acquire);
+    if (Id >= 0 && size_t(Id) < InstArrays.size() && InstArrays[Id])
+      return InstArrays[Id];
+    return newInstArray(D);
+  }
+} // namespace libmeow
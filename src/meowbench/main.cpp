@@ -0,0 +1,944 @@
+//
+//  main.cpp
+//  meowbench
+//
+//  The benchmark harness behind make bench. It compiles each meow program
+//  it is given at each optimization level, in each mode (AOT, JIT and the
+//  interpreter), runs it repeatedly, and reports the median runtime and its
+//  variance as a table and as JSON, checking that every configuration
+//  prints the same output.
+//
+//  A program's problem size is the first number of its input. A line
+//  "# size: <compiled> <interpreted>" in the program gives the sizes to run
+//  it at; the interpreter gets a smaller one so it finishes in about the
+//  same time. Without that line the program runs on empty input.
+//
+//  With --scale it measures meowc itself instead: it generates synthetic
+//  programs of each size with --generate, and reports how meowc's compile
+//  time and peak memory grow with the number of functions.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+/// ============== //
+///    Options     //
+/// ============== //
+
+struct Options {
+  std::string Meowc = "build/meowc";
+  std::string Libmeow = "build/libmeow.o";
+  /// The driver that links AOT output against libmeow, split on spaces.
+  std::string Linker = "c++ -pthread";
+  std::string OptLevels = "0123";
+  std::vector<std::string> Modes = {"aot", "jit", "interp"};
+  unsigned Runs = 5;
+  unsigned Warmup = 1;
+  std::string JSONFile;
+  std::vector<std::string> Programs;
+
+  /// --generate: write a synthetic program of this many functions.
+  unsigned long Generate = 0;
+  /// --scale: the numbers of functions to time meowc compiling.
+  std::vector<unsigned long> Scale;
+  unsigned Depth = 8;
+  unsigned Vars = 8;
+  unsigned long Seed = 1;
+  /// Compiles that take more CPU seconds than this are stopped, and larger
+  /// sizes skipped.
+  unsigned Budget = 600;
+  bool Phases = false;
+};
+
+static void usage() {
+  fprintf(stderr,
+          "usage: meowbench [options] <program.meow>...\n"
+          "  --meowc=PATH     the compiler (build/meowc)\n"
+          "  --libmeow=PATH   the runtime AOT programs link against "
+          "(build/libmeow.o)\n"
+          "  --link=CMD       the driver that links them (c++ -pthread)\n"
+          "  --opt=LEVELS     optimization levels to compile at (0123)\n"
+          "  --modes=LIST     comma-separated aot, jit and interp "
+          "(aot,jit,interp)\n"
+          "  --runs=N         timed runs of each configuration (5)\n"
+          "  --warmup=N       untimed runs before them (1)\n"
+          "  --json=FILE      also write the results as JSON to FILE ('-' "
+          "for stdout)\n"
+          "\n"
+          "       meowbench --generate=N [generator options]\n"
+          "       meowbench --scale=N,N,... [generator options] [options]\n"
+          "  --generate=N     write a synthetic program of N functions to "
+          "stdout\n"
+          "  --scale=LIST     time meowc compiling synthetic programs of each "
+          "size\n"
+          "  --depth=N        expression nesting depth of each function (8)\n"
+          "  --vars=N         length of each function's var chain (8)\n"
+          "  --seed=N         seed for the generator (1)\n"
+          "  --budget=SECS    CPU seconds a compile may take before the larger "
+          "sizes\n"
+          "                   are skipped (600)\n"
+          "  --phases         break compile time down with meowc "
+          "-time-report-json\n");
+  exit(2);
+}
+
+/// split - the non-empty pieces of S between Sep characters.
+static std::vector<std::string> split(const std::string &S, char Sep) {
+  std::vector<std::string> Pieces;
+  std::string Piece;
+  std::istringstream In(S);
+  while (std::getline(In, Piece, Sep))
+    if (!Piece.empty())
+      Pieces.push_back(Piece);
+  return Pieces;
+}
+
+/// option - whether Arg is --Name=<value>, setting Value if it is.
+static bool option(const std::string &Arg, const char *Name,
+                   std::string &Value) {
+  std::string Prefix = std::string("--") + Name + "=";
+  if (Arg.compare(0, Prefix.size(), Prefix))
+    return false;
+  Value = Arg.substr(Prefix.size());
+  return true;
+}
+
+/// count - the number S spells.
+static unsigned long count(const std::string &S) {
+  char *End;
+  unsigned long N = strtoul(S.c_str(), &End, 10);
+  if (S.empty() || *End)
+    usage();
+  return N;
+}
+
+static Options parseOptions(int argc, char **argv) {
+  Options O;
+  for (int I = 1; I < argc; ++I) {
+    std::string Arg = argv[I], V;
+    if (option(Arg, "meowc", O.Meowc) || option(Arg, "libmeow", O.Libmeow) ||
+        option(Arg, "link", O.Linker) || option(Arg, "opt", O.OptLevels) ||
+        option(Arg, "json", O.JSONFile))
+      continue;
+    if (option(Arg, "modes", V))
+      O.Modes = split(V, ',');
+    else if (option(Arg, "runs", V))
+      O.Runs = count(V);
+    else if (option(Arg, "warmup", V))
+      O.Warmup = count(V);
+    else if (option(Arg, "generate", V))
+      O.Generate = count(V);
+    else if (option(Arg, "scale", V))
+      for (const std::string &N : split(V, ','))
+        O.Scale.push_back(count(N));
+    else if (option(Arg, "depth", V))
+      O.Depth = count(V);
+    else if (option(Arg, "vars", V))
+      O.Vars = count(V);
+    else if (option(Arg, "seed", V))
+      O.Seed = count(V);
+    else if (option(Arg, "budget", V))
+      O.Budget = count(V);
+    else if (Arg == "--phases")
+      O.Phases = true;
+    else if (Arg.size() > 1 && Arg[0] == '-')
+      usage();
+    else
+      O.Programs.push_back(Arg);
+  }
+
+  bool Synthetic = O.Generate || !O.Scale.empty();
+  if (O.Programs.empty() != Synthetic || !O.Runs || O.OptLevels.empty())
+    usage();
+  for (unsigned long N : O.Scale)
+    if (!N)
+      usage();
+  for (char L : O.OptLevels)
+    if (L < '0' || L > '3')
+      usage();
+  for (const std::string &M : O.Modes)
+    if (M != "aot" && M != "jit" && M != "interp")
+      usage();
+  return O;
+}
+
+/// ============== //
+///    Running     //
+/// ============== //
+
+/// RunResult - how a command ended, and what it cost.
+struct RunResult {
+  bool Ok = false;
+  double Seconds = 0;
+  long MaxRSSKB = 0;
+  int Signal = 0; ///< The signal that killed it, if one did.
+  std::string Error;
+};
+
+/// run - run Argv in Dir with stdin from InputFile and stdout and stderr to
+/// OutputFile. A signal is a failure, and so is a nonzero exit status unless
+/// AnyStatus is set: AOT programs return main's double as their status.
+/// With a CPULimit, the command is killed after that many CPU seconds.
+static RunResult run(const std::vector<std::string> &Argv, const fs::path &Dir,
+                     const fs::path &InputFile, const fs::path &OutputFile,
+                     bool AnyStatus = false, unsigned CPULimit = 0) {
+  RunResult R;
+  std::vector<char *> Args;
+  for (const std::string &A : Argv)
+    Args.push_back(const_cast<char *>(A.c_str()));
+  Args.push_back(nullptr);
+
+  auto Start = std::chrono::steady_clock::now();
+  pid_t Pid = fork();
+  if (Pid < 0) {
+    R.Error = std::string("cannot fork: ") + strerror(errno);
+    return R;
+  }
+  if (Pid == 0) {
+    int In = open(InputFile.c_str(), O_RDONLY);
+    int Out = open(OutputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (In < 0 || Out < 0 || chdir(Dir.c_str()) < 0)
+      _exit(127);
+    if (CPULimit) {
+      struct rlimit Limit = {CPULimit, CPULimit + 1};
+      setrlimit(RLIMIT_CPU, &Limit);
+    }
+    dup2(In, 0);
+    dup2(Out, 1);
+    dup2(Out, 2);
+    execvp(Args[0], Args.data());
+    _exit(127);
+  }
+
+  int Status;
+  struct rusage Usage;
+  while (wait4(Pid, &Status, 0, &Usage) < 0)
+    if (errno != EINTR) {
+      R.Error = std::string("cannot wait: ") + strerror(errno);
+      return R;
+    }
+  R.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            Start)
+                  .count();
+  // ru_maxrss is in bytes on macOS and in kilobytes elsewhere.
+#ifdef __APPLE__
+  R.MaxRSSKB = Usage.ru_maxrss / 1024;
+#else
+  R.MaxRSSKB = Usage.ru_maxrss;
+#endif
+
+  if (WIFSIGNALED(Status))
+    R.Signal = WTERMSIG(Status);
+  if (R.Signal)
+    R.Error = std::string("killed by signal ") + strsignal(WTERMSIG(Status));
+  else if (WEXITSTATUS(Status) == 127)
+    R.Error = "cannot run " + Argv[0];
+  else if (!AnyStatus && WEXITSTATUS(Status))
+    R.Error = "exited with status " + std::to_string(WEXITSTATUS(Status));
+  R.Ok = R.Error.empty();
+  return R;
+}
+
+static std::string readFile(const fs::path &Path) {
+  std::ifstream In(Path, std::ios::binary);
+  std::ostringstream S;
+  S << In.rdbuf();
+  return S.str();
+}
+
+static void writeFile(const fs::path &Path, const std::string &Contents) {
+  std::ofstream Out(Path, std::ios::binary);
+  Out << Contents;
+}
+
+/// tail - the last line or so of a failed command's output, for the report.
+static std::string tail(const std::string &Output) {
+  std::string S = Output.substr(0, Output.find_last_not_of("\n") + 1);
+  size_t NL = S.find_last_of('\n');
+  if (NL != std::string::npos)
+    S = S.substr(NL + 1);
+  return S.size() > 200 ? S.substr(0, 200) : S;
+}
+
+/// ============== //
+///   Statistics   //
+/// ============== //
+
+/// Stats - the summary of one configuration's timed runs. Variance is the
+/// sample variance.
+struct Stats {
+  double Median = 0, Mean = 0, Variance = 0, Min = 0, Max = 0;
+};
+
+static Stats summarize(std::vector<double> Samples) {
+  Stats S;
+  if (Samples.empty())
+    return S;
+  std::sort(Samples.begin(), Samples.end());
+  size_t N = Samples.size();
+  S.Median = N % 2 ? Samples[N / 2]
+                   : (Samples[N / 2 - 1] + Samples[N / 2]) / 2;
+  S.Min = Samples.front();
+  S.Max = Samples.back();
+  for (double X : Samples)
+    S.Mean += X;
+  S.Mean /= N;
+  if (N > 1) {
+    for (double X : Samples)
+      S.Variance += (X - S.Mean) * (X - S.Mean);
+    S.Variance /= N - 1;
+  }
+  return S;
+}
+
+/// ============== //
+///   Benchmarks   //
+/// ============== //
+
+/// Result - one configuration of one program.
+struct Result {
+  std::string Program;
+  std::string Mode;
+  char Opt = 0; ///< '0'-'3', or 0 for the interpreter, which has no levels.
+  std::string Size;
+  double CompileSeconds = -1; ///< AOT only: meowc plus the link.
+  std::vector<double> Samples;
+  Stats Summary;
+  long MaxRSSKB = 0;
+  /// "ok", "mismatch" when the output differs from the first configuration
+  /// run at the same size, or "unchecked" when there is nothing to compare.
+  std::string Check = "unchecked";
+  std::string Error;
+};
+
+/// programSizes - the compiled and interpreted problem sizes from the
+/// program's "# size:" line, empty if it has none.
+static std::pair<std::string, std::string> programSizes(const fs::path &P) {
+  std::ifstream In(P);
+  std::string Line;
+  while (std::getline(In, Line)) {
+    if (Line.compare(0, 7, "# size:"))
+      continue;
+    std::vector<std::string> Sizes = split(Line.substr(7), ' ');
+    if (Sizes.empty())
+      break;
+    return {Sizes[0], Sizes.size() > 1 ? Sizes[1] : Sizes[0]};
+  }
+  return {"", ""};
+}
+
+/// Bench - runs every configuration of one program in a scratch directory.
+class Bench {
+  const Options &O;
+  fs::path Program;
+  fs::path Dir;
+  /// The output of the first configuration run at each problem size.
+  std::map<std::string, std::string> Reference;
+
+  fs::path inputFor(const std::string &Size) {
+    fs::path Input = Dir / ("input-" + (Size.empty() ? "none" : Size));
+    writeFile(Input, Size.empty() ? "" : Size + "\n");
+    return Input;
+  }
+
+  /// check - compare Output with the reference for Size, making it the
+  /// reference if there is none yet.
+  std::string check(const std::string &Size, const std::string &Output) {
+    auto [It, Inserted] = Reference.try_emplace(Size, Output);
+    if (Inserted)
+      return "unchecked";
+    return It->second == Output ? "ok" : "mismatch";
+  }
+
+  /// measure - run Argv Warmup + Runs times on Size, recording the timed
+  /// runs in R.
+  void measure(Result &R, const std::vector<std::string> &Argv,
+               bool AnyStatus) {
+    fs::path Input = inputFor(R.Size), Output = Dir / "output.txt";
+    for (unsigned I = 0; I < O.Warmup + O.Runs; ++I) {
+      RunResult Run = run(Argv, Dir, Input, Output, AnyStatus);
+      if (!Run.Ok) {
+        R.Error = Run.Error + ": " + tail(readFile(Output));
+        return;
+      }
+      if (I == 0)
+        R.Check = check(R.Size, readFile(Output));
+      if (I < O.Warmup)
+        continue;
+      R.Samples.push_back(Run.Seconds);
+      R.MaxRSSKB = std::max(R.MaxRSSKB, Run.MaxRSSKB);
+    }
+    R.Summary = summarize(R.Samples);
+  }
+
+public:
+  Bench(const Options &Opts, fs::path Prog, fs::path Scratch)
+      : O(Opts), Program(std::move(Prog)), Dir(std::move(Scratch)) {}
+
+  void runAll(std::vector<Result> &Results) {
+    auto [CompiledSize, InterpSize] = programSizes(Program);
+    std::string Name = Program.stem().string();
+    fs::path Exe = Dir / "a.out";
+    bool HaveExe = false;
+    auto NewResult = [&](const std::string &Mode, char Opt,
+                         const std::string &Size) {
+      Result R;
+      R.Program = Name;
+      R.Mode = Mode;
+      R.Opt = Opt;
+      R.Size = Size;
+      return R;
+    };
+
+    for (const std::string &Mode : O.Modes) {
+      if (Mode == "interp") {
+        Result R = NewResult(Mode, 0, InterpSize);
+        // Nothing else runs at the interpreter's size, so an AOT build
+        // prints the output to check it against.
+        if (HaveExe && !Reference.count(InterpSize)) {
+          fs::path Output = Dir / "output.txt";
+          if (run({Exe.string()}, Dir, inputFor(InterpSize), Output, true).Ok)
+            Reference[InterpSize] = readFile(Output);
+        }
+        measure(R, {O.Meowc, "-interp", Program.string()}, false);
+        Results.push_back(R);
+        continue;
+      }
+
+      for (char Level : O.OptLevels) {
+        std::string Opt = std::string("-O") + Level;
+        Result R = NewResult(Mode, Level, CompiledSize);
+        if (Mode == "jit") {
+          measure(R,
+                  {O.Meowc, Opt, "-run", "-interp-threshold=0",
+                   Program.string()},
+                  false);
+          Results.push_back(R);
+          continue;
+        }
+
+        // AOT: meowc writes output.o to the scratch directory, and the
+        // linker makes it a program.
+        fs::path Log = Dir / "compile.txt", Null = inputFor("");
+        RunResult Compile =
+            run({O.Meowc, Opt, Program.string()}, Dir, Null, Log);
+        RunResult Link;
+        if (Compile.Ok) {
+          std::vector<std::string> Argv = split(O.Linker, ' ');
+          Argv.insert(Argv.end(), {(Dir / "output.o").string(), O.Libmeow,
+                                   "-o", Exe.string()});
+          Link = run(Argv, Dir, Null, Log);
+        }
+        if (!Compile.Ok || !Link.Ok) {
+          R.Error = (Compile.Ok ? "link: " + Link.Error
+                                : "compile: " + Compile.Error) +
+                    ": " + tail(readFile(Log));
+          Results.push_back(R);
+          continue;
+        }
+        HaveExe = true;
+        R.CompileSeconds = Compile.Seconds + Link.Seconds;
+        measure(R, {Exe.string()}, true);
+        Results.push_back(R);
+      }
+    }
+  }
+};
+
+/// ============== //
+///   Reporting    //
+/// ============== //
+
+static std::string optName(const Result &R) {
+  return R.Opt ? std::string("-O") + R.Opt : "-";
+}
+
+static void printHeader(FILE *Out) {
+  fprintf(Out, "%-12s %-7s %-4s %10s %12s %12s %10s %9s  %s\n", "program",
+          "mode", "opt", "size", "median (ms)", "stddev (ms)", "min (ms)",
+          "rss (KB)", "output");
+}
+
+static void printRow(FILE *Out, const Result &R) {
+  fprintf(Out, "%-12s %-7s %-4s %10s ", R.Program.c_str(), R.Mode.c_str(),
+          optName(R).c_str(), R.Size.empty() ? "-" : R.Size.c_str());
+  if (!R.Error.empty())
+    fprintf(Out, "FAILED: %s\n", R.Error.c_str());
+  else
+    fprintf(Out, "%12.3f %12.3f %10.3f %9ld  %s\n", R.Summary.Median * 1e3,
+            std::sqrt(R.Summary.Variance) * 1e3, R.Summary.Min * 1e3,
+            R.MaxRSSKB, R.Check.c_str());
+}
+
+static std::string jsonString(const std::string &S) {
+  std::string J = "\"";
+  for (unsigned char C : S) {
+    if (C == '"' || C == '\\') {
+      J += '\\';
+      J += C;
+    } else if (C < 0x20) {
+      char Buf[8];
+      snprintf(Buf, sizeof(Buf), "\\u%04x", C);
+      J += Buf;
+    } else {
+      J += C;
+    }
+  }
+  return J + "\"";
+}
+
+static std::string jsonNumber(double X) {
+  char Buf[32];
+  snprintf(Buf, sizeof(Buf), "%.9g", X);
+  return Buf;
+}
+
+static void writeJSON(std::ostream &Out, const Options &O,
+                      const std::vector<Result> &Results) {
+  Out << "{\n  \"meowc\": " << jsonString(O.Meowc)
+      << ",\n  \"runs\": " << O.Runs << ",\n  \"warmup\": " << O.Warmup
+      << ",\n  \"results\": [";
+  for (size_t I = 0; I < Results.size(); ++I) {
+    const Result &R = Results[I];
+    Out << (I ? ",\n" : "\n") << "    {\"program\": " << jsonString(R.Program)
+        << ", \"mode\": " << jsonString(R.Mode) << ", \"opt\": "
+        << (R.Opt ? std::string(1, R.Opt) : "null")
+        << ", \"size\": " << (R.Size.empty() ? "null" : R.Size);
+    if (!R.Error.empty()) {
+      Out << ", \"error\": " << jsonString(R.Error) << "}";
+      continue;
+    }
+    if (R.CompileSeconds >= 0)
+      Out << ", \"compile_s\": " << jsonNumber(R.CompileSeconds);
+    Out << ", \"median_s\": " << jsonNumber(R.Summary.Median)
+        << ", \"mean_s\": " << jsonNumber(R.Summary.Mean)
+        << ", \"variance_s2\": " << jsonNumber(R.Summary.Variance)
+        << ", \"stddev_s\": " << jsonNumber(std::sqrt(R.Summary.Variance))
+        << ", \"min_s\": " << jsonNumber(R.Summary.Min)
+        << ", \"max_s\": " << jsonNumber(R.Summary.Max)
+        << ", \"max_rss_kb\": " << R.MaxRSSKB
+        << ", \"output\": " << jsonString(R.Check) << ", \"samples_s\": [";
+    for (size_t J = 0; J < R.Samples.size(); ++J)
+      Out << (J ? ", " : "") << jsonNumber(R.Samples[J]);
+    Out << "]}";
+  }
+  Out << "\n  ]\n}\n";
+}
+
+/// ============== //
+///   Generator    //
+/// ============== //
+
+/// Rand - a small xorshift generator, so a seed always makes the same
+/// program.
+struct Rand {
+  uint64_t S;
+  explicit Rand(uint64_t Seed) : S(Seed * 0x9E3779B97F4A7C15ull | 1) {}
+  uint64_t next() {
+    S ^= S >> 12;
+    S ^= S << 25;
+    S ^= S >> 27;
+    return S * 0x2545F4914F6CDD1Dull;
+  }
+  unsigned below(unsigned N) { return next() % N; }
+};
+
+/// The user-defined operators a synthetic program declares, and the
+/// precedence of each binary one.
+static const char GenBinaryOps[] = "|&^%$@?/>";
+static const unsigned GenPrecedences[] = {5, 6, 15, 25, 30, 35, 45, 50, 55};
+static const char GenUnaryOps[] = "!~";
+static const char *const GenBuiltinOps[] = {"+", "-", "*", "<"};
+
+/// Generator - writes a synthetic program for --generate and --scale. Each
+/// function f<i>(a b) binds a chain of Vars vars, each made from the ones
+/// before it, and returns an expression nested Depth deep that mixes the
+/// builtin and user-defined operators, ifs, and calls to earlier functions.
+class Generator {
+  const Options &O;
+  std::ostream &Out;
+  Rand R;
+  unsigned long Fn = 0; ///< The function being written.
+  unsigned Scope = 0;   ///< How many of its vars are bound.
+
+  void op() {
+    unsigned N = sizeof(GenBinaryOps) - 1;
+    unsigned I = R.below(N + 4);
+    if (I < N)
+      Out << ' ' << GenBinaryOps[I] << ' ';
+    else
+      Out << ' ' << GenBuiltinOps[I - N] << ' ';
+  }
+
+  void leaf() {
+    unsigned I = R.below(Scope + 3);
+    if (I < Scope)
+      Out << 'v' << I;
+    else if (I == Scope)
+      Out << 'a';
+    else if (I == Scope + 1)
+      Out << 'b';
+    else
+      Out << R.below(100) * 0.25;
+  }
+
+  void expr(unsigned Depth) {
+    if (!Depth)
+      return leaf();
+    switch (R.below(8)) {
+    case 0: // A call to one of the last few functions.
+      if (Fn) {
+        Out << 'f' << Fn - 1 - R.below(std::min<unsigned long>(Fn, 16))
+            << '(';
+        expr(Depth - 1);
+        Out << ", ";
+        leaf();
+        Out << ')';
+        return;
+      }
+      [[fallthrough]];
+    case 1:
+      Out << "(if ";
+      leaf();
+      Out << " < ";
+      leaf();
+      Out << " then ";
+      expr(Depth - 1);
+      Out << " else ";
+      leaf();
+      Out << ')';
+      return;
+    case 2:
+      Out << GenUnaryOps[R.below(sizeof(GenUnaryOps) - 1)] << '(';
+      expr(Depth - 1);
+      Out << ')';
+      return;
+    case 3:
+    case 4:
+      Out << '(';
+      leaf();
+      op();
+      expr(Depth - 1);
+      Out << ')';
+      return;
+    default:
+      Out << '(';
+      expr(Depth - 1);
+      op();
+      leaf();
+      Out << ')';
+      return;
+    }
+  }
+
+  void function() {
+    Out << "func f" << Fn << "(a b)\n";
+    Scope = 0;
+    if (O.Vars) {
+      Out << "  var ";
+      for (unsigned V = 0; V < O.Vars; ++V) {
+        Out << (V ? ",\n      v" : "v") << V << " = ";
+        leaf();
+        op();
+        leaf();
+        ++Scope;
+      }
+      Out << " in\n";
+    }
+    Out << "    ";
+    expr(O.Depth);
+    Out << ";\n";
+  }
+
+public:
+  Generator(const Options &Opts, std::ostream &OS)
+      : O(Opts), Out(OS), R(Opts.Seed) {}
+
+  void program(unsigned long Functions) {
+    Out << "# Generated by meowbench --generate=" << Functions
+        << " --depth=" << O.Depth << " --vars=" << O.Vars
+        << " --seed=" << O.Seed << ".\nextern printd(x);\n";
+    for (unsigned I = 0; I < sizeof(GenBinaryOps) - 1; ++I) {
+      Out << "func binary " << GenBinaryOps[I] << ' ' << GenPrecedences[I]
+          << " (x y) ";
+      if (GenBinaryOps[I] == '>')
+        Out << "y < x;\n";
+      else if (I)
+        Out << "(x " << GenBinaryOps[I - 1] << " y)*0.5 + " << I << ";\n";
+      else
+        Out << "x*0.5 + y*0.25;\n";
+    }
+    Out << "func unary ! (v) 1 - v;\n"
+           "func unary ~ (v) v*0.5 + 1;\n";
+    for (Fn = 0; Fn < Functions; ++Fn)
+      function();
+    Out << "printd(f" << Functions - 1 << "(1, 2));\n";
+  }
+};
+
+/// ============== //
+///    Scaling     //
+/// ============== //
+
+/// ScaleResult - meowc compiling one synthetic program at one level.
+struct ScaleResult {
+  unsigned long Functions = 0;
+  char Opt = 0;
+  uintmax_t SourceBytes = 0;
+  double Seconds = 0;
+  long MaxRSSKB = 0;
+  /// How time and peak RSS grow from the previous size: x in N^x, or NaN
+  /// for the first size.
+  double TimeExponent = NAN, RSSExponent = NAN;
+  /// Wall time in each of meowc's phases, with --phases.
+  std::vector<std::pair<std::string, double>> Phases;
+  std::string Error; ///< Why the compile failed, or that it was skipped.
+  bool OverBudget = false;
+};
+
+/// readPhases - the wall time of each phase in a -time-report-json file.
+static std::vector<std::pair<std::string, double>>
+readPhases(const fs::path &Path) {
+  std::string JSON = readFile(Path);
+  size_t Begin = JSON.find("\"phases\""), End = JSON.find("\"passes\"");
+  if (Begin == std::string::npos || End == std::string::npos)
+    return {};
+  std::regex Phase("\"name\": \"([a-z]+)\",\\s*\"wall\": ([-+.0-9eE]+)");
+  std::vector<std::pair<std::string, double>> Phases;
+  for (std::sregex_iterator I(JSON.begin() + Begin, JSON.begin() + End, Phase),
+       E;
+       I != E; ++I)
+    Phases.push_back({(*I)[1].str(), strtod((*I)[2].str().c_str(), nullptr)});
+  return Phases;
+}
+
+static void printScaleHeader(FILE *Out) {
+  fprintf(Out, "%10s %-4s %12s %12s %12s %9s %10s %8s\n", "functions", "opt",
+          "source (KB)", "compile (s)", "us/function", "time ~N^", "rss (MB)",
+          "rss ~N^");
+}
+
+static void printScaleRow(FILE *Out, const ScaleResult &R) {
+  fprintf(Out, "%10lu -O%c  %12ju ", R.Functions, R.Opt, R.SourceBytes / 1024);
+  if (!R.Error.empty()) {
+    fprintf(Out, "%s\n", R.Error == "skipped" || R.OverBudget
+                              ? R.Error.c_str()
+                              : ("FAILED: " + R.Error).c_str());
+    return;
+  }
+  // The first size has nothing to grow from.
+  auto Exponent = [](double X) {
+    char Buf[16] = "-";
+    if (!std::isnan(X))
+      snprintf(Buf, sizeof(Buf), "%.2f", X);
+    return std::string(Buf);
+  };
+  fprintf(Out, "%12.3f %12.2f %9s %10.1f %8s\n", R.Seconds,
+          R.Seconds * 1e6 / R.Functions, Exponent(R.TimeExponent).c_str(),
+          R.MaxRSSKB / 1024.0, Exponent(R.RSSExponent).c_str());
+  if (R.Phases.empty())
+    return;
+  fprintf(Out, "%16s", "");
+  for (auto &[Name, Wall] : R.Phases)
+    if (Wall)
+      fprintf(Out, " %s %.3f", Name.c_str(), Wall);
+  fprintf(Out, "\n");
+}
+
+/// jsonOptional - a number, or null for NaN.
+static std::string jsonOptional(double X) {
+  return std::isnan(X) ? "null" : jsonNumber(X);
+}
+
+static void writeScaleJSON(std::ostream &Out, const Options &O,
+                           const std::vector<ScaleResult> &Results) {
+  Out << "{\n  \"meowc\": " << jsonString(O.Meowc)
+      << ",\n  \"depth\": " << O.Depth << ",\n  \"vars\": " << O.Vars
+      << ",\n  \"seed\": " << O.Seed << ",\n  \"scale\": [";
+  for (size_t I = 0; I < Results.size(); ++I) {
+    const ScaleResult &R = Results[I];
+    Out << (I ? ",\n" : "\n") << "    {\"functions\": " << R.Functions
+        << ", \"opt\": " << R.Opt << ", \"source_bytes\": " << R.SourceBytes;
+    if (!R.Error.empty()) {
+      Out << ", \"error\": " << jsonString(R.Error) << "}";
+      continue;
+    }
+    Out << ", \"compile_s\": " << jsonNumber(R.Seconds)
+        << ", \"max_rss_kb\": " << R.MaxRSSKB
+        << ", \"time_exponent\": " << jsonOptional(R.TimeExponent)
+        << ", \"rss_exponent\": " << jsonOptional(R.RSSExponent);
+    if (!R.Phases.empty()) {
+      Out << ", \"phases\": {";
+      for (size_t J = 0; J < R.Phases.size(); ++J)
+        Out << (J ? ", " : "") << jsonString(R.Phases[J].first) << ": "
+            << jsonNumber(R.Phases[J].second);
+      Out << "}";
+    }
+    Out << "}";
+  }
+  Out << "\n  ]\n}\n";
+}
+
+/// runScale - compile a synthetic program of each size in O.Scale at each
+/// level, smallest first. Once a level fails or runs over the budget, its
+/// larger sizes are skipped.
+static void runScale(const Options &O, const fs::path &Dir, FILE *Table,
+                     std::vector<ScaleResult> &Results) {
+  std::vector<unsigned long> Sizes = O.Scale;
+  std::sort(Sizes.begin(), Sizes.end());
+  std::map<char, ScaleResult> Last;
+  std::map<char, bool> Stopped;
+
+  fs::path Source = Dir / "scale.meow", Report = Dir / "phases.json",
+           Null = "/dev/null";
+  for (unsigned long N : Sizes) {
+    {
+      std::ofstream Out(Source);
+      Generator(O, Out).program(N);
+    }
+    std::error_code EC;
+    uintmax_t Bytes = fs::file_size(Source, EC);
+
+    for (char Level : O.OptLevels) {
+      ScaleResult R;
+      R.Functions = N;
+      R.Opt = Level;
+      R.SourceBytes = Bytes;
+      if (Stopped[Level]) {
+        R.Error = "skipped";
+        Results.push_back(R);
+        printScaleRow(Table, R);
+        continue;
+      }
+
+      // meowc prints the module's IR as it compiles, which is part of the
+      // cost; it goes to /dev/null.
+      std::vector<std::string> Argv = {O.Meowc, std::string("-O") + Level,
+                                       Source.string()};
+      if (O.Phases)
+        Argv.insert(Argv.begin() + 1, "-time-report-json=" + Report.string());
+      RunResult Run = run(Argv, Dir, Null, Null, false, O.Budget);
+      R.Seconds = Run.Seconds;
+      R.MaxRSSKB = Run.MaxRSSKB;
+      if (!Run.Ok) {
+        R.OverBudget = Run.Signal == SIGXCPU;
+        R.Error = R.OverBudget ? "over the " + std::to_string(O.Budget) +
+                                     "s budget"
+                               : Run.Error;
+        Stopped[Level] = true;
+      } else {
+        if (O.Phases)
+          R.Phases = readPhases(Report);
+        auto P = Last.find(Level);
+        if (P != Last.end()) {
+          double Growth = std::log(double(N) / P->second.Functions);
+          R.TimeExponent = std::log(R.Seconds / P->second.Seconds) / Growth;
+          R.RSSExponent =
+              std::log(double(R.MaxRSSKB) / P->second.MaxRSSKB) / Growth;
+        }
+        Last[Level] = R;
+      }
+      Results.push_back(R);
+      printScaleRow(Table, R);
+      fflush(Table);
+    }
+  }
+  fs::remove(Source);
+}
+
+int main(int argc, char **argv) {
+  Options O = parseOptions(argc, argv);
+  if (O.Generate) {
+    Generator(O, std::cout).program(O.Generate);
+    return !std::cout;
+  }
+
+  // Programs and tools are named relative to where we started, but each
+  // program is compiled and run in its own scratch directory.
+  std::error_code EC;
+  fs::path Meowc = O.Meowc;
+  if (Meowc.has_parent_path())
+    O.Meowc = fs::absolute(Meowc).lexically_normal().string();
+  O.Libmeow = fs::absolute(O.Libmeow).lexically_normal().string();
+  for (const std::string &P : O.Programs)
+    if (!fs::exists(P)) {
+      fprintf(stderr, "meowbench: no such program: %s\n", P.c_str());
+      return 1;
+    }
+
+  std::string Template = (fs::temp_directory_path(EC) / "meowbench.XXXXXX");
+  if (!mkdtemp(Template.data())) {
+    fprintf(stderr, "meowbench: cannot make a scratch directory: %s\n",
+            strerror(errno));
+    return 1;
+  }
+  fs::path Scratch = Template;
+
+  // The table goes to stderr when the JSON has stdout.
+  FILE *Table = O.JSONFile == "-" ? stderr : stdout;
+  std::vector<Result> Results;
+  std::vector<ScaleResult> ScaleResults;
+  if (!O.Scale.empty()) {
+    printScaleHeader(Table);
+    runScale(O, Scratch, Table, ScaleResults);
+  } else {
+    printHeader(Table);
+  }
+  for (const std::string &P : O.Programs) {
+    fs::path Program = fs::absolute(P);
+    size_t First = Results.size();
+    fs::path Dir = Scratch / Program.stem();
+    fs::create_directories(Dir, EC);
+    Bench(O, Program, Dir).runAll(Results);
+    for (size_t I = First; I < Results.size(); ++I)
+      printRow(Table, Results[I]);
+    fflush(Table);
+  }
+  fs::remove_all(Scratch, EC);
+
+  auto Write = [&](std::ostream &Out) {
+    if (O.Scale.empty())
+      writeJSON(Out, O, Results);
+    else
+      writeScaleJSON(Out, O, ScaleResults);
+  };
+  if (O.JSONFile == "-") {
+    Write(std::cout);
+  } else if (!O.JSONFile.empty()) {
+    std::ofstream Out(O.JSONFile);
+    Write(Out);
+    if (!Out) {
+      fprintf(stderr, "meowbench: cannot write %s\n", O.JSONFile.c_str());
+      return 1;
+    }
+  }
+
+  bool Failed = false;
+  for (const Result &R : Results)
+    Failed |= !R.Error.empty() || R.Check == "mismatch";
+  for (const ScaleResult &R : ScaleResults)
+    Failed |= !R.Error.empty() && R.Error != "skipped" && !R.OverBudget;
+  return Failed;
+}
@@ -0,0 +1,114 @@
+//
+//  main.cpp
+//  meowclient
+//
+//  The thin client for meowc --server. It takes meowc's command line, and
+//  has the server compile or run the program in this directory and with
+//  these standard streams, exiting with the status the server replies with.
+//  See the Server section of meowc for the protocol.
+//
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// readAll - read exactly Size bytes from FD.
+static bool readAll(int FD, void *Buf, size_t Size) {
+  char *P = static_cast<char *>(Buf);
+  while (Size) {
+    ssize_t N = read(FD, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+/// writeAll - write all Size bytes of Buf to FD.
+static bool writeAll(int FD, const void *Buf, size_t Size) {
+  const char *P = static_cast<const char *>(Buf);
+  while (Size) {
+    ssize_t N = write(FD, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  // The server's socket: $MEOWC_SOCKET, or meowc.sock as for meowc --server.
+  const char *Path = getenv("MEOWC_SOCKET");
+  if (!Path || !*Path)
+    Path = "meowc.sock";
+
+  // The request is the working directory and then the arguments, each
+  // NUL-terminated.
+  char Cwd[PATH_MAX];
+  if (!getcwd(Cwd, sizeof(Cwd))) {
+    fprintf(stderr, "meowclient: cannot get working directory: %s\n",
+            strerror(errno));
+    return 1;
+  }
+  std::string Payload(Cwd, strlen(Cwd) + 1);
+  for (int i = 1; i < argc; ++i)
+    Payload.append(argv[i], strlen(argv[i]) + 1);
+
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  if (strlen(Path) >= sizeof(Addr.sun_path)) {
+    fprintf(stderr, "meowclient: socket path too long: %s\n", Path);
+    return 1;
+  }
+  strcpy(Addr.sun_path, Path);
+  int Sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Sock < 0 ||
+      connect(Sock, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0) {
+    fprintf(stderr, "meowclient: cannot connect to %s: %s\n", Path,
+            strerror(errno));
+    return 1;
+  }
+
+  // Our standard streams go with the length of the request.
+  uint32_t Len = Payload.size();
+  int FDs[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  iovec IOV = {&Len, sizeof(Len)};
+  alignas(cmsghdr) char Control[CMSG_SPACE(sizeof(FDs))] = {};
+  msghdr Msg = {};
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control;
+  Msg.msg_controllen = sizeof(Control);
+  cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+  C->cmsg_level = SOL_SOCKET;
+  C->cmsg_type = SCM_RIGHTS;
+  C->cmsg_len = CMSG_LEN(sizeof(FDs));
+  memcpy(CMSG_DATA(C), FDs, sizeof(FDs));
+
+  if (sendmsg(Sock, &Msg, 0) != sizeof(Len) ||
+      !writeAll(Sock, Payload.data(), Payload.size())) {
+    fprintf(stderr, "meowclient: cannot send request: %s\n", strerror(errno));
+    return 1;
+  }
+
+  int32_t Status;
+  if (!readAll(Sock, &Status, sizeof(Status))) {
+    fprintf(stderr, "meowclient: the server closed the connection\n");
+    return 1;
+  }
+  return Status;
+}
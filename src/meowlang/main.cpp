@@ -5,12 +5,21 @@
 //  Created by Lilly Cham on 23/05/2022.
 //
 
-#include "../../../llvm-project/llvm/examples/Kaleidoscope/include/KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/Analysis/BasicAliasAnalysis.h"
 #include "llvm/Analysis/Passes.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DIBuilder.h"
@@ -20,32 +29,616 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/MC/SubtargetFeature.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/SaveAndRestore.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/SCCP.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <system_error>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 using namespace llvm;
 using namespace llvm::orc;
 
+/// ==================== //
+/// Command line options //
+/// ==================== //
+
+static cl::opt<char>
+    OptLevel("O",
+             cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] "
+                      "(default = '-O0')"),
+             cl::Prefix, cl::init('0'));
+
+static cl::opt<unsigned> SpecializeBudget(
+    "specialize-budget",
+    cl::desc("Maximum number of instructions constant-argument "
+             "specialization may add to the module (0 disables it)"),
+    cl::init(2000));
+
+static cl::opt<unsigned> SpecializeMinCalls(
+    "specialize-min-calls",
+    cl::desc("Number of call sites that must share a constant argument "
+             "pattern before the callee is specialized for it"),
+    cl::init(2));
+
+static cl::opt<std::string>
+    MCPU("mcpu",
+         cl::desc("Target a specific cpu type (-mcpu=native for the host)"),
+         cl::value_desc("cpu-name"), cl::init("generic"));
+
+static cl::opt<std::string>
+    MAttrs("mattr", cl::desc("Target specific attributes (e.g. +avx2,+fma)"),
+           cl::value_desc("a1,+a2,-a3,..."));
+
+/// -ffast-math - LLVM registers an option with this name itself, so we reuse
+/// it when it exists rather than registering a duplicate.
+static cl::opt<bool> *FastMath;
+
+static void RegisterFastMathOption() {
+  const char *Desc =
+      "Allow aggressive, lossy floating-point optimizations. Implies "
+      "-fno-honor-nans, -fno-honor-infinities, -fno-signed-zeros, "
+      "-fassociative-math and -ffp-contract=fast";
+  auto &Options = cl::getRegisteredOptions();
+  auto I = Options.find("ffast-math");
+  if (I == Options.end()) {
+    FastMath = new cl::opt<bool>("ffast-math", cl::desc(Desc));
+    return;
+  }
+  FastMath = static_cast<cl::opt<bool> *>(I->second);
+  FastMath->setDescription(Desc);
+  FastMath->setHiddenFlag(cl::NotHidden);
+}
+
+static cl::opt<bool>
+    NoHonorNaNs("fno-honor-nans",
+                cl::desc("Assume floating-point values are never NaN (nnan)"));
+
+static cl::opt<bool> NoHonorInfinities(
+    "fno-honor-infinities",
+    cl::desc("Assume floating-point values are never infinite (ninf)"));
+
+static cl::opt<bool> NoSignedZeros(
+    "fno-signed-zeros",
+    cl::desc("Ignore the sign of floating-point zeros (nsz)"));
+
+static cl::opt<bool> AssociativeMath(
+    "fassociative-math",
+    cl::desc("Allow floating-point operations to be reassociated (reassoc)"));
+
+enum FPContractMode { FPC_Off, FPC_On, FPC_Fast };
+static cl::opt<FPContractMode> FPContract(
+    "ffp-contract", cl::desc("Form fused floating-point multiply-adds"),
+    cl::values(clEnumValN(FPC_Off, "off", "Never fuse"),
+               clEnumValN(FPC_On, "on",
+                          "Fuse a multiply feeding an add or subtract "
+                          "within the same expression (default)"),
+               clEnumValN(FPC_Fast, "fast",
+                          "Fuse across expressions (contract)")),
+    cl::init(FPC_On));
+
+static cl::opt<std::string> ProfileGenerate(
+    "profile-generate", cl::ValueOptional,
+    cl::desc("Instrument function entries and branches, writing a profile to "
+             "<file> (default meow.profdata) when the program exits"),
+    cl::value_desc("file"));
+
+static cl::opt<std::string> ProfileUse(
+    "profile-use",
+    cl::desc("Use the profile in <file> to annotate branch weights and "
+             "function entry counts"),
+    cl::value_desc("file"));
+
+static cl::opt<std::string> Instrument(
+    "instrument", cl::ValueOptional,
+    cl::desc("Count function entries, call sites and for loop trip counts in "
+             "per-thread counters, which the program writes to <file> "
+             "(default meow-counters.json, CSV if it ends in .csv) when it "
+             "exits or gets SIGUSR1"),
+    cl::value_desc("file"));
+
+static cl::opt<bool> ArenaScopes(
+    "arena-scopes", cl::init(true),
+    cl::desc("Free the arrays a function or var block allocates when it "
+             "returns, unless they escape (default on)"));
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input file>"),
+                                          cl::init("-"));
+
+static cl::opt<bool> RunProgram(
+    "run", cl::desc("Run the program instead of writing output.o, in the "
+                    "interpreter if it is small enough and in the JIT "
+                    "otherwise"));
+
+static cl::opt<bool> ForceInterp(
+    "interp", cl::desc("Run the program in the interpreter, failing if it "
+                       "uses a feature the interpreter lacks"));
+
+static cl::opt<unsigned> InterpThreshold(
+    "interp-threshold", cl::init(4096),
+    cl::desc("Size in bytes of the largest program -run will interpret "
+             "(default 4096)"));
+
+static cl::opt<bool> Session(
+    "session",
+    cl::desc("Run the program in the JIT one definition or expression at a "
+             "time, reading standard input as it arrives. Each definition "
+             "gets a module of its own, and redefining a function moves its "
+             "callers to the new code and frees the old"));
+
+static cl::opt<std::string> ServerSocket(
+    "server", cl::ValueOptional, cl::value_desc("socket"),
+    cl::desc("Serve compile and run requests from meowclient on the Unix "
+             "domain socket <socket> (default meowc.sock)"));
+
+static cl::opt<bool> EmitDebugInfo(
+    "g", cl::desc("Emit debug info: a subprogram and line table for each "
+                  "function"));
+
+static cl::opt<bool> PerfMap(
+    "perf-map",
+    cl::desc("With -run, list the functions the JIT compiles in "
+             "/tmp/perf-<pid>.map for perf"));
+
+static cl::opt<bool> JITDump(
+    "jitdump",
+    cl::desc("With -run, write the code the JIT compiles, with its line "
+             "tables, to a jitdump file for perf inject --jit (implies -g)"));
+
+static cl::opt<bool> TimeReport(
+    "time-report",
+    cl::desc("Report the time and memory spent in each compiler phase, "
+             "optimization pass and function, on stderr"));
+
+static cl::opt<std::string> TimeReportJSON(
+    "time-report-json", cl::value_desc("file"),
+    cl::desc("Write the time report as JSON to <file> ('-' for stdout)"));
+
+static cl::opt<unsigned> TimeReportFunctions(
+    "time-report-functions", cl::init(10),
+    cl::desc("Number of the slowest functions the time report breaks down "
+             "(default 10)"));
+
+/// =========== //
+/// Time report //
+/// =========== //
+
+/// The time report charges wall time, CPU time and the memory allocated with
+/// operator new to the phase of compilation that is running. Regions nest:
+/// while a region runs, the region it interrupted is paused, so each phase is
+/// charged only for its own work. Lexing happens on demand inside parsing,
+/// but is still reported as its own phase.
+
+enum TimePhase {
+  TP_Lex,
+  TP_Parse,
+  TP_Codegen,
+  TP_Verify,
+  TP_Optimize,
+  TP_Emit,
+  TP_Run,
+  TP_Other,
+  NumTimePhases
+};
+
+static const char *const TimePhaseNames[NumTimePhases] = {
+    "lex", "parse", "codegen", "verify", "optimize", "emit", "run", "other"};
+
+/// AllocatedBytes, Allocations - the memory operator new has handed out while
+/// CountAllocations is set.
+static bool CountAllocations = false;
+static std::atomic<uint64_t> AllocatedBytes{0};
+static std::atomic<uint64_t> Allocations{0};
+
+void *operator new(std::size_t Size) {
+  if (CountAllocations) {
+    AllocatedBytes.fetch_add(Size, std::memory_order_relaxed);
+    Allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (void *P = std::malloc(Size ? Size : 1))
+    return P;
+  report_bad_alloc_error("Allocation failed");
+}
+
+namespace {
+  /// TimeStats - the cost of some part of compilation.
+  struct TimeStats {
+    double Wall = 0, CPU = 0;
+    uint64_t Bytes = 0, Allocs = 0;
+    unsigned Count = 0;
+
+    void add(const TimeStats &S) {
+      Wall += S.Wall;
+      CPU += S.CPU;
+      Bytes += S.Bytes;
+      Allocs += S.Allocs;
+      Count += S.Count;
+    }
+  };
+
+  /// FunctionTimes - the cost of each phase for one function.
+  struct FunctionTimes {
+    TimeStats Phases[NumTimePhases];
+
+    double getWall() const {
+      double Wall = 0;
+      for (const TimeStats &S : Phases)
+        Wall += S.Wall;
+      return Wall;
+    }
+  };
+
+  /// TimeFrame - a region that is running, or paused while another runs.
+  /// Start is when it was last charged.
+  struct TimeFrame {
+    TimePhase Phase;
+    TimeStats *Pass;
+    FunctionTimes *Fn;
+    TimeStats Start;
+  };
+} // end namespace
+
+static bool TimeReportEnabled = false;
+static TimeStats PhaseTimes[NumTimePhases];
+static std::map<std::string, TimeStats> PassTimes;
+static std::map<std::string, FunctionTimes> FunctionTimesByName;
+static std::vector<TimeFrame> TimeFrames;
+
+/// TimedFunction - the function whose definition is being compiled, if any.
+static FunctionTimes *TimedFunction = nullptr;
+
+/// sampleTime - the wall time, CPU time and allocations so far.
+static TimeStats sampleTime() {
+  TimeStats S;
+  S.Wall = std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+               .count();
+  S.CPU = double(std::clock()) / CLOCKS_PER_SEC;
+  S.Bytes = AllocatedBytes.load(std::memory_order_relaxed);
+  S.Allocs = Allocations.load(std::memory_order_relaxed);
+  return S;
+}
+
+/// chargeTimeFrame - charge F for the time since it was last charged.
+static void chargeTimeFrame(TimeFrame &F, const TimeStats &Now) {
+  TimeStats D;
+  D.Wall = Now.Wall - F.Start.Wall;
+  D.CPU = Now.CPU - F.Start.CPU;
+  D.Bytes = Now.Bytes - F.Start.Bytes;
+  D.Allocs = Now.Allocs - F.Start.Allocs;
+  PhaseTimes[F.Phase].add(D);
+  if (F.Pass)
+    F.Pass->add(D);
+  if (F.Fn)
+    F.Fn->Phases[F.Phase].add(D);
+  F.Start = Now;
+}
+
+/// pushTimeFrame - start a region, pausing the one it interrupts.
+static void pushTimeFrame(TimePhase Phase, TimeStats *Pass, FunctionTimes *Fn) {
+  TimeStats Now = sampleTime();
+  if (!TimeFrames.empty())
+    chargeTimeFrame(TimeFrames.back(), Now);
+  TimeFrames.push_back({Phase, Pass, Fn, Now});
+}
+
+/// popTimeFrame - end the innermost region, resuming the one it interrupted.
+static void popTimeFrame() {
+  TimeStats Now = sampleTime();
+  TimeFrame &F = TimeFrames.back();
+  chargeTimeFrame(F, Now);
+  PhaseTimes[F.Phase].Count++;
+  if (F.Pass)
+    F.Pass->Count++;
+  if (F.Fn)
+    F.Fn->Phases[F.Phase].Count++;
+  TimeFrames.pop_back();
+  if (!TimeFrames.empty())
+    TimeFrames.back().Start = Now;
+}
+
+namespace {
+  /// TimeRegion - charge the enclosing scope to a phase, and to the function
+  /// being compiled.
+  class TimeRegion {
+    bool Active;
+
+  public:
+    explicit TimeRegion(TimePhase Phase) : Active(TimeReportEnabled) {
+      if (Active)
+        pushTimeFrame(Phase, nullptr, TimedFunction);
+    }
+    ~TimeRegion() {
+      if (Active)
+        popTimeFrame();
+    }
+    TimeRegion(const TimeRegion &) = delete;
+    TimeRegion &operator=(const TimeRegion &) = delete;
+  };
+
+  /// FunctionTimeScope - charge the regions in the enclosing scope to the
+  /// function named by setName. The name is only known once the prototype is
+  /// parsed, so the costs are kept aside until the scope ends.
+  class FunctionTimeScope {
+    FunctionTimes Pending;
+    FunctionTimes *Saved;
+    std::string Name;
+
+  public:
+    FunctionTimeScope() : Saved(TimedFunction) { TimedFunction = &Pending; }
+    ~FunctionTimeScope() {
+      TimedFunction = Saved;
+      if (!TimeReportEnabled || Name.empty())
+        return;
+      FunctionTimes &FT = FunctionTimesByName[Name];
+      for (unsigned i = 0; i != NumTimePhases; ++i)
+        FT.Phases[i].add(Pending.Phases[i]);
+    }
+    FunctionTimeScope(const FunctionTimeScope &) = delete;
+    FunctionTimeScope &operator=(const FunctionTimeScope &) = delete;
+
+    void setName(const std::string &N) { Name = N; }
+  };
+} // end namespace
+
+/// StartTimeReport - start timing a compilation, if a report was asked for.
+/// Everything no other region claims is charged to "other".
+static void StartTimeReport() {
+  TimeReportEnabled = TimeReport || !TimeReportJSON.empty();
+  for (TimeStats &S : PhaseTimes)
+    S = TimeStats();
+  PassTimes.clear();
+  FunctionTimesByName.clear();
+  TimeFrames.clear();
+  if (!TimeReportEnabled)
+    return;
+  CountAllocations = true;
+  pushTimeFrame(TP_Other, nullptr, nullptr);
+}
+
+/// isSpecialPass - whether PassID only runs other passes, so the time report
+/// leaves its time to them.
+static bool isSpecialPass(StringRef PassID) {
+  return PassID.contains("PassManager") || PassID.contains("PassAdaptor") ||
+         PassID.contains("AnalysisManagerProxy") ||
+         PassID.startswith("DevirtSCCRepeatedPass");
+}
+
+/// getPassFunction - the function a pass or analysis is running on, if any.
+static const Function *getPassFunction(Any IR) {
+  if (any_isa<const Function *>(IR))
+    return any_cast<const Function *>(IR);
+  if (any_isa<const Loop *>(IR))
+    return any_cast<const Loop *>(IR)->getHeader()->getParent();
+  return nullptr;
+}
+
+/// RegisterTimeReportCallbacks - time each pass and analysis the pass
+/// managers run, charging function passes to their function.
+static void RegisterTimeReportCallbacks(PassInstrumentationCallbacks &PIC) {
+  if (!TimeReportEnabled)
+    return;
+  auto Begin = [](StringRef PassID, Any IR) {
+    if (isSpecialPass(PassID))
+      return;
+    FunctionTimes *Fn = nullptr;
+    if (const Function *F = getPassFunction(IR))
+      Fn = &FunctionTimesByName[F->getName().str()];
+    pushTimeFrame(TP_Optimize, &PassTimes[PassID.str()], Fn);
+  };
+  auto End = [](StringRef PassID) {
+    if (!isSpecialPass(PassID))
+      popTimeFrame();
+  };
+  PIC.registerBeforeNonSkippedPassCallback(Begin);
+  PIC.registerAfterPassCallback(
+      [End](StringRef PassID, Any, const PreservedAnalyses &) { End(PassID); });
+  PIC.registerAfterPassInvalidatedCallback(
+      [End](StringRef PassID, const PreservedAnalyses &) { End(PassID); });
+  PIC.registerBeforeAnalysisCallback([Begin](StringRef PassID, Any IR) {
+    Begin(PassID, IR);
+  });
+  PIC.registerAfterAnalysisCallback(
+      [End](StringRef PassID, Any) { End(PassID); });
+}
+
+/// getPeakRSS - the most memory the process has had resident, in bytes.
+static uint64_t getPeakRSS() {
+  rusage RU;
+  if (getrusage(RUSAGE_SELF, &RU))
+    return 0;
+#ifdef __APPLE__
+  return RU.ru_maxrss;
+#else
+  return uint64_t(RU.ru_maxrss) * 1024;
+#endif
+}
+
+static void printTimeRow(raw_ostream &OS, StringRef Name, const TimeStats &S,
+                         const TimeStats &Total) {
+  double Percent = Total.Wall > 0 ? 100 * S.Wall / Total.Wall : 0;
+  OS << format("  %10.4f %10.4f %5.1f%% %12.1f %10llu  ", S.Wall, S.CPU,
+               Percent, S.Bytes / 1024.0, (unsigned long long)S.Allocs)
+     << Name << "\n";
+}
+
+static void printTimeHeader(raw_ostream &OS, StringRef Title) {
+  OS << "\n" << Title << "\n"
+     << "     Wall (s)    CPU (s)   Wall   Alloc (KiB)     Allocs  Name\n";
+}
+
+static void writeTimeStats(json::OStream &J, const TimeStats &S) {
+  J.attribute("wall", S.Wall);
+  J.attribute("cpu", S.CPU);
+  J.attribute("bytes", int64_t(S.Bytes));
+  J.attribute("allocs", int64_t(S.Allocs));
+  J.attribute("count", int64_t(S.Count));
+}
+
+/// FinishTimeReport - stop timing, and print the report as text and JSON as
+/// asked.
+static void FinishTimeReport(const char *Argv0) {
+  if (!TimeReportEnabled)
+    return;
+  while (!TimeFrames.empty())
+    popTimeFrame();
+  CountAllocations = false;
+  TimeReportEnabled = false;
+
+  TimeStats Total;
+  for (const TimeStats &S : PhaseTimes)
+    Total.add(S);
+  uint64_t PeakRSS = getPeakRSS();
+
+  std::vector<std::pair<std::string, const TimeStats *>> Passes;
+  for (auto &P : PassTimes)
+    Passes.emplace_back(P.first, &P.second);
+  std::stable_sort(Passes.begin(), Passes.end(), [](auto &A, auto &B) {
+    return A.second->Wall > B.second->Wall;
+  });
+
+  std::vector<std::pair<std::string, const FunctionTimes *>> Functions;
+  for (auto &F : FunctionTimesByName)
+    Functions.emplace_back(F.first, &F.second);
+  std::stable_sort(Functions.begin(), Functions.end(), [](auto &A, auto &B) {
+    return A.second->getWall() > B.second->getWall();
+  });
+  if (Functions.size() > TimeReportFunctions)
+    Functions.resize(TimeReportFunctions);
+
+  if (TimeReport) {
+    raw_ostream &OS = errs();
+    OS << "===" << std::string(73, '-') << "===\n"
+       << "                            meowc time report\n"
+       << "===" << std::string(73, '-') << "===\n";
+    OS << format("  Total: %.4fs wall, %.4fs CPU, %.1f KiB in %llu "
+                 "allocations, %.1f MiB peak RSS\n",
+                 Total.Wall, Total.CPU, Total.Bytes / 1024.0,
+                 (unsigned long long)Total.Allocs, PeakRSS / 1048576.0);
+
+    printTimeHeader(OS, "Phases:");
+    for (unsigned i = 0; i != NumTimePhases; ++i)
+      printTimeRow(OS, TimePhaseNames[i], PhaseTimes[i], Total);
+
+    if (!Passes.empty()) {
+      printTimeHeader(OS, "Optimization passes and analyses, slowest first:");
+      for (auto &[Name, S] : Passes)
+        printTimeRow(OS, Name, *S, Total);
+    }
+
+    if (!Functions.empty()) {
+      OS << "\nSlowest functions:\n";
+      for (auto &[Name, FT] : Functions) {
+        OS << format("  %10.4fs  ", FT->getWall()) << Name << "\n";
+        for (unsigned i = 0; i != NumTimePhases; ++i)
+          if (FT->Phases[i].Count)
+            printTimeRow(OS, std::string("  ") + TimePhaseNames[i],
+                         FT->Phases[i], Total);
+      }
+    }
+    OS << "\n";
+  }
+
+  if (TimeReportJSON.empty())
+    return;
+  // raw_fd_ostream takes "-" to mean stdout, after what we have written there.
+  outs().flush();
+  std::error_code EC;
+  raw_fd_ostream Out(TimeReportJSON, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << Argv0 << ": cannot write " << TimeReportJSON << ": "
+           << EC.message() << "\n";
+    return;
+  }
+  json::OStream J(Out, 2);
+  J.object([&] {
+    J.attributeObject("total", [&] { writeTimeStats(J, Total); });
+    J.attribute("peak_rss", int64_t(PeakRSS));
+    J.attributeArray("phases", [&] {
+      for (unsigned i = 0; i != NumTimePhases; ++i)
+        J.object([&] {
+          J.attribute("name", TimePhaseNames[i]);
+          writeTimeStats(J, PhaseTimes[i]);
+        });
+    });
+    J.attributeArray("passes", [&] {
+      for (auto &[Name, S] : Passes)
+        J.object([&] {
+          J.attribute("name", Name);
+          writeTimeStats(J, *S);
+        });
+    });
+    J.attributeArray("functions", [&] {
+      for (auto &[Name, FT] : Functions)
+        J.object([&] {
+          J.attribute("name", Name);
+          J.attribute("wall", FT->getWall());
+          J.attributeObject("phases", [&] {
+            for (unsigned i = 0; i != NumTimePhases; ++i)
+              if (FT->Phases[i].Count)
+                J.attributeObject(TimePhaseNames[i],
+                                  [&] { writeTimeStats(J, FT->Phases[i]); });
+          });
+        });
+    });
+  });
+  Out << "\n";
+}
+
 /// ===== //
 /// Lexer //
 /// ===== //
@@ -80,22 +673,111 @@ enum Token {
   // Block definition - {}
   tok_startblk = -14,
   tok_endblk = -15,
+
+  // function qualifiers
+  tok_pure = -16,
+  tok_memo = -17,
+  tok_fastmath = -18,
+
+  // record declaration
+  tok_record = -19,
+
+  // string literal
+  tok_string = -20,
+
+  // parallel loop
+  tok_parfor = -21,
+
+  // associative operator qualifier
+  tok_assoc = -22,
+
+  // tasks
+  tok_spawn = -23,
+  tok_await = -24,
+
+  // generators
+  tok_gen = -25,
+  tok_yield = -26,
 };
 
 static std::string IdentifierStr; // Filled in if tok_identifier
 static double NumVal;             // Filled in if tok_number
+static std::string StringVal;     // Filled in if tok_string
+
+/// Source - the program being compiled, read in full before lexing starts.
+/// SourcePtr is the next character the lexer will read.
+static std::unique_ptr<MemoryBuffer> Source;
+static const char *SourcePtr;
+
+/// LastChar - the character after the last token, which the lexer has read
+/// but not yet consumed.
+static int LastChar = ' ';
+
+/// StreamBuf - what a session lexing standard input has read of it but not
+/// yet lexed. Without a Source, the lexer reads standard input as it comes,
+/// so each top-level item can run before the next is typed.
+static char StreamBuf[4096];
+static const char *StreamPtr = StreamBuf, *StreamEnd = StreamBuf;
+
+/// readChar - Return the next character of the source, or EOF.
+static int readChar() {
+  if (!Source) {
+    while (StreamPtr == StreamEnd) {
+      ssize_t N = read(0, StreamBuf, sizeof(StreamBuf));
+      if (N < 0 && errno == EINTR)
+        continue;
+      if (N <= 0)
+        return EOF;
+      StreamPtr = StreamBuf;
+      StreamEnd = StreamBuf + N;
+    }
+    return static_cast<unsigned char>(*StreamPtr++);
+  }
+  if (SourcePtr == Source->getBufferEnd())
+    return EOF;
+  return static_cast<unsigned char>(*SourcePtr++);
+}
+
+struct SourceLocation {
+  int Line;
+  int Col;
+};
+static SourceLocation CurLoc;
+static SourceLocation LexLoc = {1, 0};
+
+/// advance - Return the next character of the source, keeping track of the
+/// line and column the lexer is at.
+static int advance() {
+  int C = readChar();
+
+  if (C == '\n') {
+    LexLoc.Line++;
+    LexLoc.Col = 0;
+  } else
+    LexLoc.Col++;
+  return C;
+}
 
-/// gettok - Return the next token from standard input.
+/// rewindSource - Start lexing the source again from the beginning.
+static void rewindSource() {
+  SourcePtr = Source->getBufferStart();
+  LastChar = ' ';
+  LexLoc = {1, 0};
+}
+
+/// gettok - Return the next token from the source.
 static int gettok() {
-  static int LastChar = ' ';
+  TimeRegion Lex(TP_Lex);
 
   // Skip any whitespace.
   while (isspace(LastChar))
-    LastChar = getchar();
+    LastChar = advance();
+
+  CurLoc = LexLoc;
 
   if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
     IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
+    while (isalnum((LastChar = advance())))
       IdentifierStr += LastChar;
 
     if (IdentifierStr == "func")
@@ -110,6 +792,12 @@ static int gettok() {
       return tok_else;
     if (IdentifierStr == "for")
       return tok_for;
+    if (IdentifierStr == "parfor")
+      return tok_parfor;
+    if (IdentifierStr == "spawn")
+      return tok_spawn;
+    if (IdentifierStr == "await")
+      return tok_await;
     if (IdentifierStr == "in")
       return tok_in;
     if (IdentifierStr == "binary")
@@ -118,24 +806,54 @@ static int gettok() {
       return tok_unary;
     if (IdentifierStr == "var")
       return tok_var;
+    if (IdentifierStr == "pure")
+      return tok_pure;
+    if (IdentifierStr == "memo")
+      return tok_memo;
+    if (IdentifierStr == "fastmath")
+      return tok_fastmath;
+    if (IdentifierStr == "assoc")
+      return tok_assoc;
+    if (IdentifierStr == "gen")
+      return tok_gen;
+    if (IdentifierStr == "yield")
+      return tok_yield;
+    if (IdentifierStr == "record")
+      return tok_record;
     return tok_identifier;
   }
 
   if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
+    // A '.' not followed by a digit is a field access.
     std::string NumStr;
+    if (LastChar == '.') {
+      LastChar = advance();
+      if (!isdigit(LastChar))
+        return '.';
+      NumStr = ".";
+    }
     do {
       NumStr += LastChar;
-      LastChar = getchar();
+      LastChar = advance();
     } while (isdigit(LastChar) || LastChar == '.');
 
     NumVal = strtod(NumStr.c_str(), nullptr);
     return tok_number;
   }
 
+  if (LastChar == '"') { // String: "[^"]*"
+    StringVal.clear();
+    while ((LastChar = advance()) != '"' && LastChar != EOF)
+      StringVal += LastChar;
+    if (LastChar == '"')
+      LastChar = advance(); // eat the closing quote.
+    return tok_string;
+  }
+
   if (LastChar == '#') {
     // Comment until end of line.
     do
-      LastChar = getchar();
+      LastChar = advance();
     while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
     if (LastChar != EOF)
@@ -148,13 +866,14 @@ static int gettok() {
 
   // Otherwise, just return the character as its ascii value.
   int ThisChar = LastChar;
-  LastChar = getchar();
+  LastChar = advance();
   return ThisChar;
 }
 
 namespace {
   class PrototypeAST;
   class ExprAST;
+  class IndexExprAST;
 } // namespace
 
 struct DebugInfo {
@@ -164,25 +883,10 @@ struct DebugInfo {
 
   void emitLocation(ExprAST *AST);
   DIType *getDoubleTy();
+  DISubprogram *beginFunction(Function *F, unsigned Line);
+  void endFunction(DISubprogram *SP);
 } KSDbgInfo;
 
-struct SourceLocation {
-  int Line;
-  int Col;
-};
-static SourceLocation CurLoc;
-static SourceLocation LexLoc = {1, 0};
-
-static int advance() {
-  int LastChar = getchar();
-
-  if (LastChar == '\n' || LastChar == '\r') {
-    LexLoc.Line++;
-    LexLoc.Col = 0;
-  } else
-    LexLoc.Col++;
-  return LastChar;
-}
 
 // ==================== //
 // Abstract syntax tree //
@@ -194,14 +898,43 @@ namespace {
     return O << std::string(size, ' ');
   }
 
-  // Base class for AST Nodes
+  // Base class for AST Nodes. Nodes support LLVM-style RTTI (isa<>,
+  // dyn_cast<>) through their kind.
   class ExprAST {
+  public:
+    enum ExprKind {
+      EK_Number,
+      EK_Variable,
+      EK_Unary,
+      EK_Binary,
+      EK_Call,
+      EK_If,
+      EK_For,
+      EK_ForIn,
+      EK_Yield,
+      EK_ParFor,
+      EK_ReduceStep,
+      EK_Spawn,
+      EK_Await,
+      EK_Var,
+      EK_Index,
+      EK_Slice,
+      EK_Field,
+      EK_String,
+    };
+
+  private:
+    const ExprKind Kind;
     SourceLocation Loc;
 
   public:
-    ExprAST(SourceLocation Loc = CurLoc) : Loc(Loc) {}
+    ExprAST(ExprKind Kind, SourceLocation Loc = CurLoc)
+        : Kind(Kind), Loc(Loc) {}
     virtual ~ExprAST() {}
     virtual Value *codegen() = 0;
+    /// forEachChild - call Fn on each direct subexpression.
+    virtual void forEachChild(function_ref<void(ExprAST &)> Fn) {}
+    ExprKind getKind() const { return Kind; }
     int getLine() const { return Loc.Line; }
     int getCol() const { return Loc.Col; }
     virtual raw_ostream &dump(raw_ostream &out, int ind) {
@@ -214,9 +947,23 @@ namespace {
     double Val;
 
   public:
-    NumberExprAST(double Val) : Val(Val) {}
+    NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
+
+    Value *codegen() override;
+    double getValue() const { return Val; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
+  };
+
+  /// StringExprAST - Expression class for string literals. Strings are only
+  /// used as file names for builtins such as map.
+  class StringExprAST : public ExprAST {
+    std::string Val;
+
+  public:
+    StringExprAST(const std::string &Val) : ExprAST(EK_String), Val(Val) {}
 
     Value *codegen() override;
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_String; }
   };
 
   /// VariableExprAST - Expression class for referencing variables
@@ -224,10 +971,14 @@ namespace {
     std::string Name;
 
   public:
-    VariableExprAST(const std::string &Name) : Name(Name) {}
+    VariableExprAST(const std::string &Name)
+        : ExprAST(EK_Variable), Name(Name) {}
 
     Value *codegen() override;
     const std::string &getName() const { return Name; }
+    static bool classof(const ExprAST *E) {
+      return E->getKind() == EK_Variable;
+    }
   };
 
   /// UnaryExprAST - Expression class for a unary operator.
@@ -237,9 +988,15 @@ namespace {
 
   public:
     UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-        : Opcode(Opcode), Operand(std::move(Operand)) {}
+        : ExprAST(EK_Unary), Opcode(Opcode), Operand(std::move(Operand)) {}
 
     Value *codegen() override;
+    char getOpcode() const { return Opcode; }
+    ExprAST *getOperand() const { return Operand.get(); }
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Operand);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Unary; }
   };
 
   /// BinaryExprAST - Expression class for a binary operator.
@@ -250,8 +1007,17 @@ namespace {
   public:
     BinaryExprAST(SourceLocation Loc, char Op, std::unique_ptr<ExprAST> LHS,
                   std::unique_ptr<ExprAST> RHS)
-        : ExprAST(Loc), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+        : ExprAST(EK_Binary, Loc), Op(Op), LHS(std::move(LHS)),
+          RHS(std::move(RHS)) {}
     Value *codegen() override;
+    char getOp() const { return Op; }
+    ExprAST *getLHS() const { return LHS.get(); }
+    ExprAST *getRHS() const { return RHS.get(); }
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*LHS);
+      Fn(*RHS);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
     raw_ostream &dump(raw_ostream &out, int ind) override {
       ExprAST::dump(out << "binary" << Op, ind);
       LHS->dump(indent(out, ind) << "LHS:", ind + 1);
@@ -268,9 +1034,16 @@ namespace {
   public:
     CallExprAST(const std::string &Callee,
                 std::vector<std::unique_ptr<ExprAST>> Args)
-        : Callee(Callee), Args(std::move(Args)) {}
+        : ExprAST(EK_Call), Callee(Callee), Args(std::move(Args)) {}
 
     Value *codegen() override;
+    const std::string &getCallee() const { return Callee; }
+    ArrayRef<std::unique_ptr<ExprAST>> getArgs() const { return Args; }
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      for (auto &Arg : Args)
+        Fn(*Arg);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
   };
 
   /// IfExprAST - Expression class for if/then/else.
@@ -280,9 +1053,18 @@ namespace {
   public:
     IfExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Cond,
               std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
-        : ExprAST(Loc), Cond(std::move(Cond)), Then(std::move(Then)),
+        : ExprAST(EK_If, Loc), Cond(std::move(Cond)), Then(std::move(Then)),
           Else(std::move(Else)) {}
     Value *codegen() override;
+    ExprAST *getCond() const { return Cond.get(); }
+    ExprAST *getThen() const { return Then.get(); }
+    ExprAST *getElse() const { return Else.get(); }
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Cond);
+      Fn(*Then);
+      Fn(*Else);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
     raw_ostream &dump(raw_ostream &out, int ind) override {
       ExprAST::dump(out << "if", ind);
       Cond->dump(indent(out, ind) << "Cond:", ind + 1);
@@ -301,48 +1083,311 @@ namespace {
     ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
                std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
                std::unique_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-          Step(std::move(Step)), Body(std::move(Body)) {}
+        : ExprAST(EK_For), VarName(VarName), Start(std::move(Start)),
+          End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
+
+    Value *codegen() override;
+    const std::string &getVarName() const { return VarName; }
+    ExprAST *getStart() const { return Start.get(); }
+    ExprAST *getEnd() const { return End.get(); }
+    ExprAST *getStep() const { return Step.get(); }
+    ExprAST *getBody() const { return Body.get(); }
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Start);
+      Fn(*End);
+      if (Step)
+        Fn(*Step);
+      Fn(*Body);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+
+  private:
+    Value *codegenLoop(AllocaInst *Alloca, const std::string &Site,
+                       AllocaInst *Counter = nullptr,
+                       Value *CounterEnd = nullptr);
+    bool findUncheckedIndexes(std::vector<IndexExprAST *> &Indexes);
+  };
+
+  /// ForInExprAST - Expression class for for/in over a generator, which runs
+  /// the body for each value the call to a gen function yields.
+  class ForInExprAST : public ExprAST {
+    std::string VarName;
+    std::unique_ptr<CallExprAST> Gen;
+    std::unique_ptr<ExprAST> Body;
+
+  public:
+    ForInExprAST(const std::string &VarName, std::unique_ptr<CallExprAST> Gen,
+                 std::unique_ptr<ExprAST> Body)
+        : ExprAST(EK_ForIn), VarName(VarName), Gen(std::move(Gen)),
+          Body(std::move(Body)) {}
+
+    Value *codegen() override;
+    const std::string &getVarName() const { return VarName; }
+    CallExprAST *getGen() const { return Gen.get(); }
+    ExprAST *getBody() const { return Body.get(); }
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Gen);
+      Fn(*Body);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_ForIn; }
+  };
+
+  /// YieldExprAST - Expression class for yield, which passes a value to the
+  /// loop consuming a gen function and suspends it until the next is wanted.
+  class YieldExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Val;
+
+  public:
+    YieldExprAST(std::unique_ptr<ExprAST> Val)
+        : ExprAST(EK_Yield), Val(std::move(Val)) {}
+
+    Value *codegen() override;
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override { Fn(*Val); }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Yield; }
+  };
+
+  /// ParForExprAST - Expression class for parfor/in, a loop whose iterations
+  /// run in parallel. The loop over a chunk of the range is an ordinary
+  /// ForExprAST over the variables LoName to LastName, which is outlined into
+  /// a function for the runtime to call. A parfor with a Reduce operator
+  /// folds the values of its body into AccName and returns the result.
+  class ParForExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Start, End;
+    std::unique_ptr<ForExprAST> Loop;
+    std::string Reduce;
+
+  public:
+    static constexpr const char *LoName = "parfor.lo";
+    static constexpr const char *LastName = "parfor.last";
+    static constexpr const char *AccName = "parfor.acc";
+    static constexpr const char *FirstName = "parfor.first";
+
+    ParForExprAST(std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
+                  std::unique_ptr<ForExprAST> Loop, std::string Reduce = "")
+        : ExprAST(EK_ParFor), Start(std::move(Start)), End(std::move(End)),
+          Loop(std::move(Loop)), Reduce(std::move(Reduce)) {}
+
+    Value *codegen() override;
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Start);
+      Fn(*End);
+      Fn(*Loop);
+    }
+    static bool classof(const ExprAST *E) {
+      return E->getKind() == EK_ParFor;
+    }
+
+  private:
+    bool findCaptures(std::vector<std::string> &Captures);
+  };
+
+  /// ReduceStepExprAST - Expression class for one iteration of a parfor
+  /// reduction, which folds its operand into the accumulator. Operators with
+  /// no identity start from the first operand, flagged by FirstName.
+  class ReduceStepExprAST : public ExprAST {
+    std::string Op;
+    std::unique_ptr<ExprAST> Operand;
+
+  public:
+    ReduceStepExprAST(std::string Op, std::unique_ptr<ExprAST> Operand)
+        : ExprAST(EK_ReduceStep), Op(std::move(Op)),
+          Operand(std::move(Operand)) {}
+
+    Value *codegen() override;
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Operand);
+    }
+    static bool classof(const ExprAST *E) {
+      return E->getKind() == EK_ReduceStep;
+    }
+  };
+
+  /// SpawnExprAST - Expression class for spawn, which starts a call to run in
+  /// parallel with the caller and returns a task to await its result.
+  class SpawnExprAST : public ExprAST {
+    std::unique_ptr<CallExprAST> Call;
+
+  public:
+    SpawnExprAST(std::unique_ptr<CallExprAST> Call)
+        : ExprAST(EK_Spawn), Call(std::move(Call)) {}
+
+    Value *codegen() override;
+    CallExprAST &getCall() { return *Call; }
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override { Fn(*Call); }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Spawn; }
+  };
+
+  /// AwaitExprAST - Expression class for await, which waits for a task to
+  /// finish and returns its result.
+  class AwaitExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Handle;
+
+  public:
+    AwaitExprAST(std::unique_ptr<ExprAST> Handle)
+        : ExprAST(EK_Await), Handle(std::move(Handle)) {}
 
     Value *codegen() override;
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Handle);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Await; }
   };
 
-  /// VarExprAST - Expression class for var/in
+  /// VarExprAST - Expression class for var/in. Each variable may carry a type
+  /// annotation; an empty VarTypes entry means the type of its initializer.
   class VarExprAST : public ExprAST {
     std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    std::vector<std::string> VarTypes;
     std::unique_ptr<ExprAST> Body;
 
   public:
     VarExprAST(
         std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-        std::unique_ptr<ExprAST> Body)
-        : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+        std::vector<std::string> VarTypes, std::unique_ptr<ExprAST> Body)
+        : ExprAST(EK_Var), VarNames(std::move(VarNames)),
+          VarTypes(std::move(VarTypes)), Body(std::move(Body)) {}
+
+    Value *codegen() override;
+    ArrayRef<std::pair<std::string, std::unique_ptr<ExprAST>>>
+    getVarNames() const {
+      return VarNames;
+    }
+    ArrayRef<std::string> getVarTypes() const { return VarTypes; }
+    ExprAST *getBody() const { return Body.get(); }
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      for (auto &Var : VarNames)
+        if (Var.second)
+          Fn(*Var.second);
+      Fn(*Body);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
+  };
+
+  /// IndexExprAST - Expression class for an array element, a[i]. It may also
+  /// be the target of an assignment.
+  class IndexExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Array, Index;
+
+  public:
+    IndexExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Array,
+                 std::unique_ptr<ExprAST> Index)
+        : ExprAST(EK_Index, Loc), Array(std::move(Array)),
+          Index(std::move(Index)) {}
+
+    Value *codegen() override;
+    /// codegenAddress - emit the bounds check and return the element's address.
+    Value *codegenAddress(bool ForStore = false);
+    /// codegenElement - emit the array and the bounds-checked index of the
+    /// element into A and I, returning false on error.
+    bool codegenElement(Value *&A, Value *&I);
+    ExprAST *getArray() const { return Array.get(); }
+    ExprAST *getIndex() const { return Index.get(); }
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Array);
+      Fn(*Index);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Index; }
+  };
+
+  /// SliceExprAST - Expression class for a subrange of an array, a[lo:hi].
+  /// The slice aliases the array. Either bound may be omitted.
+  class SliceExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Array, Lo, Hi;
+
+  public:
+    SliceExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Array,
+                 std::unique_ptr<ExprAST> Lo, std::unique_ptr<ExprAST> Hi)
+        : ExprAST(EK_Slice, Loc), Array(std::move(Array)), Lo(std::move(Lo)),
+          Hi(std::move(Hi)) {}
+
+    Value *codegen() override;
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Array);
+      if (Lo)
+        Fn(*Lo);
+      if (Hi)
+        Fn(*Hi);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Slice; }
+  };
+
+  /// FieldExprAST - Expression class for a field of a record array element,
+  /// a[i].f. It may also be the target of an assignment.
+  class FieldExprAST : public ExprAST {
+    std::unique_ptr<IndexExprAST> Element;
+    std::string FieldName;
+
+  public:
+    FieldExprAST(SourceLocation Loc, std::unique_ptr<IndexExprAST> Element,
+                 const std::string &FieldName)
+        : ExprAST(EK_Field, Loc), Element(std::move(Element)),
+          FieldName(FieldName) {}
 
     Value *codegen() override;
+    /// codegenAddress - emit the bounds check and return the field's address,
+    /// setting FieldTy to the type it is stored as.
+    Value *codegenAddress(Type *&FieldTy);
+    void forEachChild(function_ref<void(ExprAST &)> Fn) override {
+      Fn(*Element);
+    }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Field; }
   };
 
   /// PrototypeAST - This class represents the "prototype" for a function,
   /// which captures its name, and its argument names (thus implicitly the
   /// number of arguments the function takes), as well as if it is an operator.
+  /// Arguments and the result are doubles unless annotated with another type.
+  /// A prototype may also be qualified as 'pure' (no calls to impure
+  /// functions), 'memo' (results are cached by argument values),
+  /// 'fastmath' (floating-point math may be reassociated and contracted),
+  /// 'gen' (the function yields doubles to a for/in loop instead of returning)
+  /// and, for binary operators, 'assoc' (the operator is associative, so
+  /// parfor may reduce with it).
   class PrototypeAST {
     std::string Name;
     std::vector<std::string> Args;
     bool IsOperator;
     unsigned Precedence; // Precedence if a binary op.
     int Line;
+    std::vector<std::string> ArgTypes;
+    std::string RetType;
+    bool IsPure = false;
+    bool IsMemo = false;
+    bool IsFastMath = false;
+    bool IsAssociative = false;
+    bool IsGenerator = false;
 
   public:
     PrototypeAST(SourceLocation Loc, const std::string &Name,
                  std::vector<std::string> Args, bool IsOperator = false,
-                 unsigned Prec = 0)
+                 unsigned Prec = 0, std::vector<std::string> ArgTypes = {},
+                 std::string RetType = "double")
         : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-          Precedence(Prec), Line(Loc.Line) {}
+          Precedence(Prec), Line(Loc.Line), ArgTypes(std::move(ArgTypes)),
+          RetType(std::move(RetType)) {
+      this->ArgTypes.resize(this->Args.size(), "double");
+    }
     Function *codegen();
     const std::string &getName() const { return Name; }
+    unsigned getNumArgs() const { return Args.size(); }
+    const std::string &getArgName(unsigned i) const { return Args[i]; }
+    const std::string &getArgType(unsigned i) const { return ArgTypes[i]; }
+    const std::string &getRetType() const { return RetType; }
 
     bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
     bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
 
+    bool isPure() const { return IsPure; }
+    bool isMemo() const { return IsMemo; }
+    bool isFastMath() const { return IsFastMath; }
+    bool isAssociative() const { return IsAssociative; }
+    bool isGenerator() const { return IsGenerator; }
+    void setPure() { IsPure = true; }
+    void setMemo() { IsMemo = true; }
+    void setFastMath() { IsFastMath = true; }
+    void setAssociative() { IsAssociative = true; }
+    void setGenerator() { IsGenerator = true; }
+
     char getOperatorName() const {
       assert(isUnaryOp() || isBinaryOp());
       return Name[Name.size() - 1];
@@ -352,6 +1397,36 @@ namespace {
     int getLine() const { return Line; }
   };
 
+  /// RecordAST - This class represents a record declaration: its name, its
+  /// double or int fields, and whether arrays of it are laid out as an array
+  /// of structs or as a struct of arrays (one array per field). Int fields are
+  /// stored as 64-bit integers and read as doubles.
+  class RecordAST {
+    std::string Name;
+    std::vector<std::string> FieldNames;
+    std::vector<std::string> FieldTypes;
+    bool IsSoA;
+
+  public:
+    RecordAST(const std::string &Name, std::vector<std::string> FieldNames,
+              std::vector<std::string> FieldTypes, bool IsSoA)
+        : Name(Name), FieldNames(std::move(FieldNames)),
+          FieldTypes(std::move(FieldTypes)), IsSoA(IsSoA) {}
+
+    const std::string &getName() const { return Name; }
+    bool isSoA() const { return IsSoA; }
+    unsigned getNumFields() const { return FieldNames.size(); }
+    bool isIntField(unsigned i) const { return FieldTypes[i] == "int"; }
+
+    /// getFieldIndex - the index of the field named Field, or -1.
+    int getFieldIndex(const std::string &Field) const {
+      for (unsigned i = 0, e = FieldNames.size(); i != e; ++i)
+        if (FieldNames[i] == Field)
+          return i;
+      return -1;
+    }
+  };
+
   /// FunctionAST - Expression class which represents the function itself
   class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto;
@@ -362,6 +1437,8 @@ namespace {
                 std::unique_ptr<ExprAST> Body)
         : Proto(std::move(Proto)), Body(std::move(Body)) {}
     Function *codegen();
+    const PrototypeAST &getProto() const { return *Proto; }
+    ExprAST &getBody() const { return *Body; }
   };
 } // end namespace
 
@@ -390,10 +1467,22 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
   return nullptr;
 }
 
+std::unique_ptr<FunctionAST> LogErrorF(const char *Str) {
+  LogError(Str);
+  return nullptr;
+}
+
+/// SubscriptDepth - how many '[' ... ']' we are inside. Within a subscript,
+/// ':' separates the bounds of a slice rather than being a binary operator;
+/// parentheses restore the operator.
+static int SubscriptDepth = 0;
+
 /// GetTokPrecedence - get the precedence of the pending binary operator token.
 static int GetTokPrecedence() {
   if (!isascii(CurTok))
     return -1;
+  if (CurTok == ':' && SubscriptDepth)
+    return -1;
   int TokPrec = BinOpPrecedence[CurTok];
   if (TokPrec <= 0)
     return -1;
@@ -401,8 +1490,35 @@ static int GetTokPrecedence() {
 }
 
 static std::unique_ptr<ExprAST> ParseExpression();
+static std::unique_ptr<ExprAST> ParseUnary();
 static std::unique_ptr<PrototypeAST> ParsePrototype();
 
+/// typename ::= 'const'? identifier ('[' ']')?
+static bool ParseTypeName(std::string &Name) {
+  Name.clear();
+  if (CurTok == tok_identifier && IdentifierStr == "const") {
+    Name = "const ";
+    getNextToken(); // eat 'const'.
+  }
+  if (CurTok != tok_identifier) {
+    LogError("expected type name");
+    return false;
+  }
+  Name += IdentifierStr;
+  getNextToken(); // eat the type name.
+
+  if (CurTok == '[') {
+    getNextToken(); // eat '['.
+    if (CurTok != ']') {
+      LogError("expected ']' in array type");
+      return false;
+    }
+    getNextToken(); // eat ']'.
+    Name += "[]";
+  }
+  return true;
+}
+
 /// toplevelexpr ::= expression
 static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
   SourceLocation FnLoc = CurLoc;
@@ -415,52 +1531,209 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
   return nullptr;
 }
 
-/// external ::= 'extern' prototype
+/// PureRuntimeFunctions - libmeow and libm functions known to have no side
+/// effects, so 'pure' functions may call them without declaring them pure.
+static const char *const PureRuntimeFunctions[] = {"returnd", "sqrt", "pow",
+                                                    "sin",     "cos",  "tan"};
+
+/// external ::= 'extern' 'pure'? prototype
 static std::unique_ptr<PrototypeAST> ParseExtern() {
   getNextToken(); // eat extern.
-  return ParsePrototype();
-}
 
-/// definition ::= 'func' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-  getNextToken(); // eat func.
+  bool IsPure = false;
+  if (CurTok == tok_pure) {
+    IsPure = true;
+    getNextToken(); // eat pure.
+  }
+  if (CurTok == tok_memo)
+    return LogErrorP("'memo' is only valid on function definitions");
+
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
 
-  if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-  return nullptr;
+  for (const char *Name : PureRuntimeFunctions)
+    if (Proto->getName() == Name)
+      IsPure = true;
+  if (IsPure)
+    Proto->setPure();
+  return Proto;
 }
 
-/// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = std::make_unique<NumberExprAST>(NumVal);
-  getNextToken(); // consume the number
-  return std::move(Result);
-}
+/// record ::= 'record' ('aos' | 'soa')? identifier '(' field* ')'
+/// field ::= identifier (':' ('double' | 'int'))?
+static std::unique_ptr<RecordAST> ParseRecord() {
+  getNextToken(); // eat record.
+
+  // The layout defaults to an array of structs.
+  bool IsSoA = false;
+  if (CurTok == tok_identifier &&
+      (IdentifierStr == "aos" || IdentifierStr == "soa")) {
+    IsSoA = IdentifierStr == "soa";
+    getNextToken(); // eat the layout.
+  }
 
-/// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-  getNextToken(); // eat (.
-  auto V = ParseExpression();
-  if (!V)
+  if (CurTok != tok_identifier) {
+    LogError("expected record name");
     return nullptr;
+  }
+  std::string Name = IdentifierStr;
+  getNextToken(); // eat the name.
 
-  if (CurTok != ')')
-    return LogError("expected ')'");
-  getNextToken(); // eat ).
-  return V;
-}
+  if (CurTok != '(') {
+    LogError("expected '(' in record declaration");
+    return nullptr;
+  }
+  getNextToken(); // eat '('.
 
-/// identifierexpr
+  std::vector<std::string> FieldNames, FieldTypes;
+  while (CurTok == tok_identifier) {
+    if (std::find(FieldNames.begin(), FieldNames.end(), IdentifierStr) !=
+        FieldNames.end()) {
+      LogError(("duplicate field '" + IdentifierStr + "'").c_str());
+      return nullptr;
+    }
+    FieldNames.push_back(IdentifierStr);
+    FieldTypes.push_back("double");
+    getNextToken(); // eat the field name.
+
+    if (CurTok == ':') {
+      getNextToken(); // eat ':'.
+      if (!ParseTypeName(FieldTypes.back()))
+        return nullptr;
+      if (FieldTypes.back() != "double" && FieldTypes.back() != "int") {
+        LogError("record fields must be double or int");
+        return nullptr;
+      }
+    }
+  }
+  if (CurTok != ')') {
+    LogError("expected ')' in record declaration");
+    return nullptr;
+  }
+  getNextToken(); // eat ')'.
+  if (FieldNames.empty()) {
+    LogError("records must have at least one field");
+    return nullptr;
+  }
+
+  return std::make_unique<RecordAST>(Name, std::move(FieldNames),
+                                     std::move(FieldTypes), IsSoA);
+}
+
+/// definition ::= 'func' qualifier* prototype expression
+/// qualifier ::= 'pure' | 'memo' | 'fastmath' | 'assoc' | 'gen'
+static std::unique_ptr<FunctionAST> ParseDefinition() {
+  getNextToken(); // eat func.
+
+  bool IsPure = false, IsMemo = false, IsFastMath = false, IsAssoc = false,
+       IsGen = false;
+  while (true) {
+    if (CurTok == tok_pure)
+      IsPure = true;
+    else if (CurTok == tok_memo)
+      IsMemo = true;
+    else if (CurTok == tok_fastmath)
+      IsFastMath = true;
+    else if (CurTok == tok_assoc)
+      IsAssoc = true;
+    else if (CurTok == tok_gen)
+      IsGen = true;
+    else
+      break;
+    getNextToken(); // eat the qualifier.
+  }
+  if (IsMemo && !IsPure)
+    return LogErrorF("'memo' requires the function to be 'pure'");
+
+  auto Proto = ParsePrototype();
+  if (!Proto)
+    return nullptr;
+  if (IsPure)
+    Proto->setPure();
+  if (IsMemo) {
+    // The memo tables are keyed on doubles.
+    for (unsigned i = 0, e = Proto->getNumArgs(); i != e; ++i)
+      if (Proto->getArgType(i) != "double")
+        return LogErrorF("'memo' functions may only take doubles");
+    if (Proto->getRetType() != "double")
+      return LogErrorF("'memo' functions must return a double");
+    Proto->setMemo();
+  }
+  if (IsFastMath)
+    Proto->setFastMath();
+  if (IsAssoc) {
+    // parfor reductions combine partial results through a pointer to the
+    // operator, so it must have the same type as the builtin ones.
+    if (!Proto->isBinaryOp())
+      return LogErrorF("'assoc' may only qualify a binary operator");
+    if (Proto->getArgType(0) != "double" || Proto->getArgType(1) != "double" ||
+        Proto->getRetType() != "double")
+      return LogErrorF("'assoc' operators must take and return doubles");
+    Proto->setAssociative();
+  }
+  if (IsGen) {
+    if (IsPure || Proto->isUnaryOp() || Proto->isBinaryOp())
+      return LogErrorF("'gen' functions may not be 'pure' or operators");
+    if (Proto->getRetType() != "double")
+      return LogErrorF("'gen' functions yield doubles and return nothing");
+    Proto->setGenerator();
+  }
+
+  if (auto E = ParseExpression())
+    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+  return nullptr;
+}
+
+/// numberexpr ::= number
+static std::unique_ptr<ExprAST> ParseNumberExpr() {
+  auto Result = std::make_unique<NumberExprAST>(NumVal);
+  getNextToken(); // consume the number
+  return std::move(Result);
+}
+
+/// stringexpr ::= string
+static std::unique_ptr<ExprAST> ParseStringExpr() {
+  auto Result = std::make_unique<StringExprAST>(StringVal);
+  getNextToken(); // consume the string
+  return std::move(Result);
+}
+
+/// parenexpr ::= '(' expression ')'
+static std::unique_ptr<ExprAST> ParseParenExpr() {
+  getNextToken(); // eat (.
+  SaveAndRestore<int> NotInSubscript(SubscriptDepth, 0);
+  auto V = ParseExpression();
+  if (!V)
+    return nullptr;
+
+  if (CurTok != ')')
+    return LogError("expected ')'");
+  getNextToken(); // eat ).
+  return V;
+}
+
+/// identifierexpr
 ///   ::= identifier
 ///   ::= identifier '(' expression* ')'
+///   ::= 'array' ':' identifier '(' expression ')'
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   std::string IdName = IdentifierStr;
 
   getNextToken(); // eat identifier.
 
+  // An array of records names the record after the builtin; the call is to
+  // "array:Record".
+  if (IdName == "array" && CurTok == ':') {
+    getNextToken(); // eat ':'.
+    if (CurTok != tok_identifier)
+      return LogError("expected record name after 'array:'");
+    IdName += ":" + IdentifierStr;
+    getNextToken(); // eat the record name.
+    if (CurTok != '(')
+      return LogError("expected '(' after record array type");
+  }
+
   if (CurTok != '(') // Simple variable ref.
     return std::make_unique<VariableExprAST>(IdName);
 
@@ -489,6 +1762,39 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   return std::make_unique<CallExprAST>(IdName, std::move(Args));
 }
 
+/// spawnexpr ::= 'spawn' identifier '(' expression* ')'
+static std::unique_ptr<ExprAST> ParseSpawnExpr() {
+  getNextToken(); // eat spawn.
+  if (CurTok != tok_identifier)
+    return LogError("expected a call after spawn");
+
+  auto E = ParseIdentifierExpr();
+  if (!E)
+    return nullptr;
+  if (!isa<CallExprAST>(E.get()))
+    return LogError("expected a call after spawn");
+  std::unique_ptr<CallExprAST> Call(static_cast<CallExprAST *>(E.release()));
+  return std::make_unique<SpawnExprAST>(std::move(Call));
+}
+
+/// yieldexpr ::= 'yield' expression
+static std::unique_ptr<ExprAST> ParseYieldExpr() {
+  getNextToken(); // eat yield.
+  auto Val = ParseExpression();
+  if (!Val)
+    return nullptr;
+  return std::make_unique<YieldExprAST>(std::move(Val));
+}
+
+/// awaitexpr ::= 'await' unary
+static std::unique_ptr<ExprAST> ParseAwaitExpr() {
+  getNextToken(); // eat await.
+  auto Handle = ParseUnary();
+  if (!Handle)
+    return nullptr;
+  return std::make_unique<AwaitExprAST>(std::move(Handle));
+}
+
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
 static std::unique_ptr<ExprAST> ParseIfExpr() {
   SourceLocation IfLoc = CurLoc;
@@ -521,7 +1827,33 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
                                      std::move(Else));
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+/// forinexpr ::= 'for' identifier 'in' identifier '(' expression* ')' 'in'
+///               expression
+static std::unique_ptr<ExprAST> ParseForInExpr(const std::string &IdName) {
+  getNextToken(); // eat 'in'.
+  if (CurTok != tok_identifier)
+    return LogError("expected a call to a gen function after 'in'");
+  auto E = ParseIdentifierExpr();
+  if (!E)
+    return nullptr;
+  if (!isa<CallExprAST>(E.get()))
+    return LogError("expected a call to a gen function after 'in'");
+  std::unique_ptr<CallExprAST> Gen(static_cast<CallExprAST *>(E.release()));
+
+  if (CurTok != tok_in)
+    return LogError("expected 'in' after for");
+  getNextToken(); // eat 'in'.
+
+  auto Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+  return std::make_unique<ForInExprAST>(IdName, std::move(Gen),
+                                        std::move(Body));
+}
+
+/// forexpr
+///   ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+///   ::= forinexpr
 static std::unique_ptr<ExprAST> ParseForExpr() {
   getNextToken(); // eat the for.
 
@@ -531,6 +1863,8 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
   std::string IdName = IdentifierStr;
   getNextToken(); // eat identifier.
 
+  if (CurTok == tok_in)
+    return ParseForInExpr(IdName);
   if (CurTok != '=')
     return LogError("expected '=' after for");
   getNextToken(); // eat '='.
@@ -567,8 +1901,76 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
                                       std::move(Step), std::move(Body));
 }
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
+/// parforexpr
+///   ::= 'parfor' identifier '=' expr ',' expr ('reduce' reduceop)?
+///       'in' expression
+/// reduceop ::= '+' | '*' | 'min' | 'max' | binary operator
+///
+/// The body runs once for each integer from the start up to but not including
+/// the end, in no particular order and possibly at the same time. With
+/// 'reduce', the loop returns its body values combined with the operator.
+static std::unique_ptr<ExprAST> ParseParForExpr() {
+  SourceLocation ParForLoc = CurLoc;
+  getNextToken(); // eat the parfor.
+
+  if (CurTok != tok_identifier)
+    return LogError("expected identifier after parfor");
+
+  std::string IdName = IdentifierStr;
+  getNextToken(); // eat identifier.
+
+  if (CurTok != '=')
+    return LogError("expected '=' after parfor");
+  getNextToken(); // eat '='.
+
+  auto Start = ParseExpression();
+  if (!Start)
+    return nullptr;
+  if (CurTok != ',')
+    return LogError("expected ',' after parfor start value");
+  getNextToken();
+
+  auto End = ParseExpression();
+  if (!End)
+    return nullptr;
+
+  std::string Reduce;
+  if (CurTok == tok_identifier && IdentifierStr == "reduce") {
+    getNextToken(); // eat 'reduce'.
+    if (CurTok == tok_identifier &&
+        (IdentifierStr == "min" || IdentifierStr == "max"))
+      Reduce = IdentifierStr;
+    else if (isascii(CurTok) && ispunct(CurTok))
+      Reduce = std::string(1, (char)CurTok);
+    else
+      return LogError("expected an operator after 'reduce'");
+    getNextToken(); // eat the operator.
+  }
+
+  if (CurTok != tok_in)
+    return LogError("expected 'in' after parfor");
+  getNextToken(); // eat 'in'.
+
+  auto Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+  if (!Reduce.empty())
+    Body = std::make_unique<ReduceStepExprAST>(Reduce, std::move(Body));
+
+  // for i = lo, i < last in body, which runs the body for lo through last.
+  auto Cond = std::make_unique<BinaryExprAST>(
+      ParForLoc, '<', std::make_unique<VariableExprAST>(IdName),
+      std::make_unique<VariableExprAST>(ParForExprAST::LastName));
+  auto Loop = std::make_unique<ForExprAST>(
+      IdName, std::make_unique<VariableExprAST>(ParForExprAST::LoName),
+      std::move(Cond), nullptr, std::move(Body));
+  return std::make_unique<ParForExprAST>(std::move(Start), std::move(End),
+                                         std::move(Loop), std::move(Reduce));
+}
+
+/// varexpr ::= 'var' identifier (':' typename)? ('=' expression)?
+//                    (',' identifier (':' typename)? ('=' expression)?)*
+//                    'in' expression
 static std::unique_ptr<ExprAST> ParseVarExpr() {
   getNextToken(); // eat the var.
 
@@ -578,10 +1980,20 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
   if (CurTok != tok_identifier)
     return LogError("expected identifier after var");
 
+  std::vector<std::string> VarTypes;
   while (true) {
     std::string Name = IdentifierStr;
     getNextToken(); // eat identifier.
 
+    // Read the optional type annotation.
+    std::string Type;
+    if (CurTok == ':') {
+      getNextToken(); // eat the ':'.
+      if (!ParseTypeName(Type))
+        return nullptr;
+    }
+    VarTypes.push_back(Type);
+
     // Read the optional initializer.
     std::unique_ptr<ExprAST> Init = nullptr;
     if (CurTok == '=') {
@@ -612,16 +2024,22 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
   if (!Body)
     return nullptr;
 
-  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(VarTypes),
+                                      std::move(Body));
 }
 
 /// primary
 ///   ::= identifierexpr
 ///   ::= numberexpr
+///   ::= stringexpr
 ///   ::= parenexpr
 ///   ::= ifexpr
 ///   ::= forexpr
+///   ::= parforexpr
 ///   ::= varexpr
+///   ::= spawnexpr
+///   ::= awaitexpr
+///   ::= yieldexpr
 static std::unique_ptr<ExprAST> ParsePrimary() {
   switch (CurTok) {
   default:
@@ -630,24 +2048,86 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
     return ParseIdentifierExpr();
   case tok_number:
     return ParseNumberExpr();
+  case tok_string:
+    return ParseStringExpr();
   case '(':
     return ParseParenExpr();
   case tok_if:
     return ParseIfExpr();
   case tok_for:
     return ParseForExpr();
+  case tok_parfor:
+    return ParseParForExpr();
   case tok_var:
     return ParseVarExpr();
+  case tok_spawn:
+    return ParseSpawnExpr();
+  case tok_await:
+    return ParseAwaitExpr();
+  case tok_yield:
+    return ParseYieldExpr();
   }
 }
 
-/// unary
+/// postfix
 ///   ::= primary
+///   ::= postfix '[' expression ']'
+///   ::= postfix '[' expression? ':' expression? ']'
+///   ::= postfix '[' expression ']' '.' identifier
+static std::unique_ptr<ExprAST> ParsePostfix() {
+  auto E = ParsePrimary();
+  while (E && (CurTok == '[' || CurTok == '.')) {
+    if (CurTok == '.') {
+      SourceLocation FieldLoc = CurLoc;
+      if (!isa<IndexExprAST>(E.get()))
+        return LogError("'.' must follow a subscript of a record array");
+      getNextToken(); // eat '.'.
+      if (CurTok != tok_identifier)
+        return LogError("expected field name after '.'");
+      std::unique_ptr<IndexExprAST> Element(
+          static_cast<IndexExprAST *>(E.release()));
+      E = std::make_unique<FieldExprAST>(FieldLoc, std::move(Element),
+                                         IdentifierStr);
+      getNextToken(); // eat the field name.
+      continue;
+    }
+
+    SourceLocation SubscriptLoc = CurLoc;
+    getNextToken(); // eat '['.
+
+    SaveAndRestore<int> InSubscript(SubscriptDepth, SubscriptDepth + 1);
+    std::unique_ptr<ExprAST> Lo, Hi;
+    bool IsSlice = false;
+    if (CurTok != ':' && !(Lo = ParseExpression()))
+      return nullptr;
+    if (CurTok == ':') {
+      IsSlice = true;
+      getNextToken(); // eat ':'.
+      if (CurTok != ']' && !(Hi = ParseExpression()))
+        return nullptr;
+    }
+
+    if (CurTok != ']')
+      return LogError("expected ']'");
+    getNextToken(); // eat ']'.
+
+    if (IsSlice)
+      E = std::make_unique<SliceExprAST>(SubscriptLoc, std::move(E),
+                                         std::move(Lo), std::move(Hi));
+    else
+      E = std::make_unique<IndexExprAST>(SubscriptLoc, std::move(E),
+                                         std::move(Lo));
+  }
+  return E;
+}
+
+/// unary
+///   ::= postfix
 ///   ::= '!' unary
 static std::unique_ptr<ExprAST> ParseUnary() {
   // If the current token is not an operator, it must be a primary expr.
   if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
-    return ParsePrimary();
+    return ParsePostfix();
 
   // If this is a unary operator, read it.
   int Opc = CurTok;
@@ -707,9 +2187,10 @@ static std::unique_ptr<ExprAST> ParseExpression() {
 }
 
 /// prototype
-///   ::= id '(' id* ')'
-///   ::= binary LETTER number? (id, id)
-///   ::= unary LETTER (id)
+///   ::= id '(' arg* ')' (':' typename)?
+///   ::= binary LETTER number? (arg, arg) (':' typename)?
+///   ::= unary LETTER (arg) (':' typename)?
+/// arg ::= id (':' typename)?
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
   std::string FnName;
 
@@ -757,23 +2238,211 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   if (CurTok != '(')
     return LogErrorP("Expected '(' in prototype");
 
-  std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
+  std::vector<std::string> ArgNames, ArgTypes;
+  getNextToken(); // eat '('.
+  while (CurTok == tok_identifier) {
     ArgNames.push_back(IdentifierStr);
+    ArgTypes.push_back("double");
+    getNextToken(); // eat identifier.
+
+    if (CurTok == ':') {
+      getNextToken(); // eat ':'.
+      if (!ParseTypeName(ArgTypes.back()))
+        return nullptr;
+    }
+  }
   if (CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
 
   // success.
   getNextToken(); // eat ')'.
 
+  // Read the optional result type.
+  std::string RetType = "double";
+  if (CurTok == ':') {
+    getNextToken(); // eat ':'.
+    if (!ParseTypeName(RetType))
+      return nullptr;
+  }
+
   // Verify right number of names for operator.
   if (Kind && ArgNames.size() != Kind)
     return LogErrorP("Invalid number of operands for operator");
 
   return std::make_unique<PrototypeAST>(FnLoc, FnName, ArgNames, Kind != 0,
-                                        BinaryPrecedence);
+                                        BinaryPrecedence, ArgTypes, RetType);
 }
 
+/// === //
+/// JIT //
+/// === //
+
+namespace {
+  /// PerfMapListener - list each function the JIT loads in
+  /// /tmp/perf-<pid>.map, where perf looks for the names of JIT-compiled
+  /// code. The map has no line numbers; a jitdump has them.
+  class PerfMapListener : public JITEventListener {
+    std::string Entries;
+    FILE *Map = nullptr;
+    pid_t MapPid = 0;
+
+    /// open - open the map for this process, writing out what the process
+    /// inherited from the one that forked it.
+    bool open() {
+      if (Map && MapPid == getpid())
+        return true;
+      if (Map)
+        fclose(Map);
+      MapPid = getpid();
+      std::string Path = "/tmp/perf-" + std::to_string(MapPid) + ".map";
+      Map = fopen(Path.c_str(), "w");
+      if (!Map)
+        return false;
+      fputs(Entries.c_str(), Map);
+      return true;
+    }
+
+  public:
+    void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                            const RuntimeDyld::LoadedObjectInfo &L) override {
+      // The debug object has its sections at the addresses they were loaded.
+      object::OwningBinary<object::ObjectFile> DebugObj =
+          L.getObjectForDebug(Obj);
+      const object::ObjectFile *O = DebugObj.getBinary();
+      if (!O)
+        return;
+      std::string New;
+      for (auto &[Sym, Size] : object::computeSymbolSizes(*O)) {
+        Expected<object::SymbolRef::Type> Type = Sym.getType();
+        Expected<StringRef> Name = Sym.getName();
+        Expected<uint64_t> Addr = Sym.getAddress();
+        if (!Type || !Name || !Addr ||
+            *Type != object::SymbolRef::ST_Function) {
+          consumeError(Type.takeError());
+          consumeError(Name.takeError());
+          consumeError(Addr.takeError());
+          continue;
+        }
+        raw_string_ostream(New)
+            << format_hex_no_prefix(*Addr, 1) << ' '
+            << format_hex_no_prefix(Size, 1) << ' ' << *Name << '\n';
+      }
+      Entries += New;
+      if (Map && MapPid == getpid()) {
+        fputs(New.c_str(), Map);
+        fflush(Map);
+      } else if (open()) {
+        fflush(Map);
+      }
+    }
+
+    /// reopen - start the map of a forked child, which runs the code its
+    /// parent loaded.
+    void reopen() {
+      if (!Entries.empty() && open())
+        fflush(Map);
+    }
+  };
+
+  /// MeowJIT - an ORC JIT which compiles whole modules, as KaleidoscopeJIT
+  /// does, and tells debuggers and profilers about the code it loads.
+  class MeowJIT {
+    std::unique_ptr<ExecutionSession> ES;
+    Triple TT;
+    DataLayout DL;
+    MangleAndInterner Mangle;
+    RTDyldObjectLinkingLayer ObjectLayer;
+    IRCompileLayer CompileLayer;
+    JITDylib &MainJD;
+    /// Stubs - the stubs a session calls its functions through, made on
+    /// first use.
+    std::unique_ptr<IndirectStubsManager> Stubs;
+
+  public:
+    MeowJIT(std::unique_ptr<ExecutionSession> ES, JITTargetMachineBuilder JTMB,
+            DataLayout DL)
+        : ES(std::move(ES)), TT(JTMB.getTargetTriple()), DL(std::move(DL)),
+          Mangle(*this->ES, this->DL),
+          ObjectLayer(*this->ES,
+                      [] { return std::make_unique<SectionMemoryManager>(); }),
+          CompileLayer(*this->ES, ObjectLayer,
+                       std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+          MainJD(this->ES->createBareJITDylib("<main>")) {
+      MainJD.addGenerator(
+          cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+              this->DL.getGlobalPrefix())));
+    }
+
+    ~MeowJIT() {
+      if (auto Err = ES->endSession())
+        ES->reportError(std::move(Err));
+    }
+
+    static Expected<std::unique_ptr<MeowJIT>> Create() {
+      auto EPC = SelfExecutorProcessControl::Create();
+      if (!EPC)
+        return EPC.takeError();
+
+      auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+      JITTargetMachineBuilder JTMB(
+          ES->getExecutorProcessControl().getTargetTriple());
+      auto DL = JTMB.getDefaultDataLayoutForTarget();
+      if (!DL)
+        return DL.takeError();
+
+      return std::make_unique<MeowJIT>(std::move(ES), std::move(JTMB),
+                                       std::move(*DL));
+    }
+
+    const DataLayout &getDataLayout() const { return DL; }
+
+    JITDylib &getMainJITDylib() { return MainJD; }
+
+    /// addEventListener - tell L about each object loaded from now on.
+    void addEventListener(JITEventListener &L) {
+      ObjectLayer.registerJITEventListener(L);
+    }
+
+    Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+      if (!RT)
+        RT = MainJD.getDefaultResourceTracker();
+      return CompileLayer.add(RT, std::move(TSM));
+    }
+
+    Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
+      return ES->lookup({&MainJD}, Mangle(Name.str()));
+    }
+
+    /// addStub - define Name, in RT, as a stub that jumps to Addr. A stub
+    /// made for Name before, by an earlier session, is reused.
+    Error addStub(StringRef Name, JITTargetAddress Addr, ResourceTrackerSP RT) {
+      if (!Stubs) {
+        auto Builder = createLocalIndirectStubsManagerBuilder(TT);
+        if (!Builder)
+          return make_error<StringError>("no JIT stubs for " + TT.str(),
+                                         inconvertibleErrorCode());
+        Stubs = Builder();
+      }
+      if (Stubs->findStub(Name, false)) {
+        if (auto Err = Stubs->updatePointer(Name, Addr))
+          return Err;
+      } else if (auto Err =
+                     Stubs->createStub(Name, Addr, JITSymbolFlags::Exported)) {
+        return Err;
+      }
+      return MainJD.define(
+          absoluteSymbols({{Mangle(Name.str()), Stubs->findStub(Name, false)}}),
+          RT);
+    }
+
+    /// updateStub - point the stub addStub made for Name at Addr. Callers
+    /// jump through the stub's pointer, which is updated in one store.
+    Error updateStub(StringRef Name, JITTargetAddress Addr) {
+      return Stubs->updatePointer(Name, Addr);
+    }
+  };
+} // end namespace
+
 // =============== //
 // Codegen globals //
 // =============== //
@@ -784,8 +2453,20 @@ static std::unique_ptr<IRBuilder<>> Builder;
 static ExitOnError ExitOnErr;
 
 static std::map<std::string, AllocaInst *> NamedValues;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
+static std::unique_ptr<MeowJIT> TheJIT;
+/// ThePerfMap - the JIT's perf map listener, once -perf-map has asked for it.
+static std::unique_ptr<PerfMapListener> ThePerfMap;
 static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+static std::map<std::string, std::unique_ptr<RecordAST>> Records;
+
+/// CurFunction - the prototype of the function currently being generated, used
+/// to enforce the 'pure' qualifier on its calls. CurFunctionTouchesMemory is
+/// set if it calls something that isn't readnone (e.g. a memoized function),
+/// and CurFunctionTouchesArrays if it reads or writes array elements, directly
+/// or through a call.
+static PrototypeAST *CurFunction = nullptr;
+static bool CurFunctionTouchesMemory = false;
+static bool CurFunctionTouchesArrays = false;
 
 // ================== //
 // Debug Info Support //
@@ -802,17 +2483,44 @@ DIType *DebugInfo::getDoubleTy() {
 }
 
 void DebugInfo::emitLocation(ExprAST *AST) {
-  if (!AST)
+  // Locations must be scoped to a subprogram, so there's nothing to emit
+  // outside of one.
+  if (!AST || LexicalBlocks.empty())
     return Builder->SetCurrentDebugLocation(DebugLoc());
-  DIScope *Scope;
-  if (LexicalBlocks.empty())
-    Scope = TheCU;
-  else
-    Scope = LexicalBlocks.back();
+  DIScope *Scope = LexicalBlocks.back();
   Builder->SetCurrentDebugLocation(DILocation::get(
       Scope->getContext(), AST->getLine(), AST->getCol(), Scope));
 }
 
+static DISubroutineType *CreateFunctionType(unsigned NumArgs, DIFile *Unit);
+
+/// beginFunction - with -g, give F a subprogram for the definition at Line,
+/// and scope the locations emitted from now on to it. Code generated into a
+/// function of its own, such as a parfor body, begins a function too.
+DISubprogram *DebugInfo::beginFunction(Function *F, unsigned Line) {
+  if (!EmitDebugInfo && !JITDump)
+    return nullptr;
+  DIFile *Unit = TheCU->getFile();
+  DISubprogram *SP = DBuilder->createFunction(
+      Unit, F->getName(), StringRef(), Unit, Line,
+      CreateFunctionType(F->arg_size(), Unit), Line, DINode::FlagPrototyped,
+      DISubprogram::SPFlagDefinition);
+  F->setSubprogram(SP);
+  LexicalBlocks.push_back(SP);
+  Builder->SetCurrentDebugLocation(
+      DILocation::get(SP->getContext(), Line, 0, SP));
+  return SP;
+}
+
+/// endFunction - finish the subprogram beginFunction began, if any.
+void DebugInfo::endFunction(DISubprogram *SP) {
+  if (!SP)
+    return;
+  LexicalBlocks.pop_back();
+  DBuilder->finalizeSubprogram(SP);
+  Builder->SetCurrentDebugLocation(DebugLoc());
+}
+
 static DISubroutineType *CreateFunctionType(unsigned NumArgs, DIFile *Unit) {
   SmallVector<Metadata *, 8> EltTys;
   DIType *DblTy = KSDbgInfo.getDoubleTy();
@@ -826,6 +2534,379 @@ static DISubroutineType *CreateFunctionType(unsigned NumArgs, DIFile *Unit) {
   return DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(EltTys));
 }
 
+// =========================== //
+// Profile-guided optimization //
+// =========================== //
+
+// A profile is a text file of "<counter> <count>" lines. Counters are named
+// after the function they live in: "fib" counts entries to fib, and
+// "fib:if0:then"/"fib:if0:else" count the arms of its first if expression.
+// Loops count iterations of their body ("fib:for1:body") and loop exits
+// ("fib:for1:exit").
+
+static std::vector<std::pair<std::string, GlobalVariable *>> ProfileCounters;
+static StringMap<uint64_t> ProfileCounts;
+static unsigned NextProfileSite; // Reset at the start of each function.
+
+static bool isProfileGenerate() {
+  return ProfileGenerate.getNumOccurrences() > 0;
+}
+
+/// ProfileSiteKey - allocate the name of the next branch site in the current
+/// function, e.g. "fib:if0".
+static std::string ProfileSiteKey(const char *Kind) {
+  std::string Key(Builder->GetInsertBlock()->getParent()->getName());
+  return Key + ":" + Kind + std::to_string(NextProfileSite++);
+}
+
+/// EmitProfileCounter - In -profile-generate mode, increment the counter
+/// named Key at the current insertion point.
+static void EmitProfileCounter(const std::string &Key) {
+  if (!isProfileGenerate())
+    return;
+
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  auto *Counter = new GlobalVariable(*TheModule, Int64Ty, false,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantInt::get(Int64Ty, 0), "prof.ctr");
+  ProfileCounters.emplace_back(Key, Counter);
+
+  Value *Count = Builder->CreateLoad(Int64Ty, Counter, "prof.count");
+  Builder->CreateStore(Builder->CreateAdd(Count, ConstantInt::get(Int64Ty, 1)),
+                       Counter);
+}
+
+static uint64_t getProfileCount(const std::string &Key) {
+  auto I = ProfileCounts.find(Key);
+  return I == ProfileCounts.end() ? 0 : I->second;
+}
+
+/// getProfileBranchWeights - branch_weights metadata for a two-way branch
+/// from -profile-use counts, or null if the branch was never reached.
+static MDNode *getProfileBranchWeights(uint64_t Taken, uint64_t NotTaken) {
+  if (ProfileCounts.empty() || Taken + NotTaken == 0)
+    return nullptr;
+
+  // Weights are 32 bits; scale both counts down to fit.
+  uint64_t Scale = std::max(Taken, NotTaken) / UINT32_MAX + 1;
+  return MDBuilder(*TheContext)
+      .createBranchWeights(uint32_t(Taken / Scale), uint32_t(NotTaken / Scale));
+}
+
+/// LoadProfile - Read a profile written by a -profile-generate build.
+static bool LoadProfile(const std::string &Path) {
+  std::ifstream In(Path);
+  if (!In) {
+    errs() << "Could not open profile: " << Path << "\n";
+    return false;
+  }
+
+  std::string Line;
+  while (std::getline(In, Line)) {
+    if (Line.empty() || Line[0] == '#')
+      continue;
+    size_t Space = Line.rfind(' ');
+    uint64_t Count;
+    if (Space == std::string::npos ||
+        StringRef(Line).substr(Space + 1).getAsInteger(10, Count)) {
+      errs() << "Malformed profile line: " << Line << "\n";
+      return false;
+    }
+    ProfileCounts[Line.substr(0, Space)] += Count;
+  }
+  return true;
+}
+
+/// EmitProfileRegistration - In -profile-generate mode, emit a constructor
+/// which hands libmeow the name and address of every counter, so it can write
+/// them out when the program exits.
+static void EmitProfileRegistration() {
+  if (!isProfileGenerate())
+    return;
+
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  Type *Int8PtrTy = Type::getInt8PtrTy(*TheContext);
+  Type *Int64PtrTy = Int64Ty->getPointerTo();
+
+  std::vector<Constant *> Names, Counters;
+  IRBuilder<> B(*TheContext);
+  Function *Init = Function::Create(
+      FunctionType::get(Type::getVoidTy(*TheContext), false),
+      Function::InternalLinkage, "meow.prof.init", TheModule.get());
+  B.SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Init));
+
+  for (auto &[Key, Counter] : ProfileCounters) {
+    Names.push_back(B.CreateGlobalStringPtr(Key, "prof.name"));
+    Counters.push_back(Counter);
+  }
+
+  auto *NamesTy = ArrayType::get(Int8PtrTy, Names.size());
+  auto *CountersTy = ArrayType::get(Int64PtrTy, Counters.size());
+  auto *NamesGV = new GlobalVariable(
+      *TheModule, NamesTy, true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(NamesTy, Names), "prof.names");
+  auto *CountersGV = new GlobalVariable(
+      *TheModule, CountersTy, true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(CountersTy, Counters), "prof.counters");
+
+  std::string Path =
+      ProfileGenerate.empty() ? "meow.profdata" : std::string(ProfileGenerate);
+  FunctionCallee Register = TheModule->getOrInsertFunction(
+      "meow_prof_register",
+      FunctionType::get(Type::getVoidTy(*TheContext),
+                        {Int8PtrTy->getPointerTo(), Int64PtrTy->getPointerTo(),
+                         Int64Ty, Int8PtrTy},
+                        false));
+  B.CreateCall(Register,
+               {B.CreateConstInBoundsGEP2_64(NamesTy, NamesGV, 0, 0),
+                B.CreateConstInBoundsGEP2_64(CountersTy, CountersGV, 0, 0),
+                ConstantInt::get(Int64Ty, Names.size()),
+                B.CreateGlobalStringPtr(Path, "prof.path")});
+  B.CreateRetVoid();
+
+  appendToGlobalCtors(*TheModule, Init, 0);
+}
+
+// =============== //
+// Instrumentation //
+// =============== //
+
+// With --instrument, compiled code counts function entries, calls at each call
+// site, and the trip counts of for loops. The counters live in arrays libmeow
+// keeps for each thread, so counting needs no read-modify-write atomics, only
+// relaxed loads and stores, as the writer thread may read them at any time. A
+// function fetches its thread's array once, on entry, from
+// meow_inst_counters; that is declared to only read memory the program can't
+// see, so once a function is inlined into a loop the fetch is merged with its
+// caller's rather than made on every trip. The module's descriptor tells
+// libmeow what the counters are; libmeow registers it the first time any
+// thread asks, so JIT-compiled code needs no constructor.
+//
+// Sites are named like profile counters: "fib" is fib's entry count,
+// "fib:call0" its first call site and "fib:for1" the for loop that is its
+// second branch site.
+
+namespace {
+  enum InstSiteKind { IS_Entry, IS_Call, IS_Loop };
+
+  /// InstSite - a counted site: the number of its counters and the offset of
+  /// the first in the module's array. A call site's detail is its callee.
+  struct InstSite {
+    std::string Name, Detail;
+    InstSiteKind Kind;
+    unsigned Offset;
+  };
+} // end namespace
+
+/// InstLoopBuckets - a loop's runs are counted in a histogram of their trip
+/// counts: bucket 0 for no trips, bucket k for [2^(k-1), 2^k) trips and the
+/// last for anything more. Its counters are its runs, its total trips and
+/// then the buckets. libmeow has the same layout.
+static const unsigned InstLoopBuckets = 33;
+
+static std::vector<InstSite> InstSites;
+static std::map<std::string, unsigned> InstSiteOffsets;
+static unsigned NumInstCounters;
+static GlobalVariable *InstDescriptor;
+
+/// InstCallSites - the number of each call site in the current function. A
+/// loop that is versioned generates its body twice, but each call in it is
+/// still one site.
+static std::map<const ExprAST *, unsigned> InstCallSites;
+
+/// CurInstCounters - the current function's counter array, or null to fetch
+/// it at each site. Generators fetch it at each site, as they may be resumed
+/// on another thread.
+static Value *CurInstCounters;
+
+static bool isInstrumenting() { return Instrument.getNumOccurrences() > 0; }
+
+/// getInstSiteType - { i8* name, i8* detail, i64 kind, i64 offset }.
+static StructType *getInstSiteType() {
+  Type *Int8PtrTy = Type::getInt8PtrTy(*TheContext);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  return StructType::get(*TheContext, {Int8PtrTy, Int8PtrTy, Int64Ty, Int64Ty});
+}
+
+/// getInstDescriptorType - { i64 id, i64 counters, i64 sites, site* sites,
+/// i8* path }. libmeow sets the id, -1 until then, when it registers the
+/// module.
+static StructType *getInstDescriptorType() {
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  return StructType::get(*TheContext,
+                         {Int64Ty, Int64Ty, Int64Ty,
+                          getInstSiteType()->getPointerTo(),
+                          Type::getInt8PtrTy(*TheContext)});
+}
+
+/// EmitInstCounters - fetch this thread's counter array for the module.
+static Value *EmitInstCounters() {
+  if (!InstDescriptor)
+    InstDescriptor = new GlobalVariable(
+        *TheModule, getInstDescriptorType(), false,
+        GlobalValue::PrivateLinkage, nullptr, "meow.inst");
+  FunctionCallee Counters = TheModule->getOrInsertFunction(
+      "meow_inst_counters",
+      FunctionType::get(Type::getInt64PtrTy(*TheContext),
+                        {InstDescriptor->getType()}, false));
+  // It returns the same array each time a thread calls it; registering the
+  // module and making the array on the first call is invisible to the
+  // program. Calls to suspend or spawn may write anything, so a generator
+  // resumed on another thread still fetches its array anew.
+  if (auto *F = dyn_cast<Function>(Counters.getCallee())) {
+    F->setOnlyReadsMemory();
+    F->setOnlyAccessesInaccessibleMemory();
+    F->setDoesNotThrow();
+    F->setWillReturn();
+  }
+  return Builder->CreateCall(Counters, {InstDescriptor}, "inst.ctrs");
+}
+
+/// getInstSite - the offset of the counters of the site Name, allocating
+/// NumCounters of them the first time it is seen.
+static unsigned getInstSite(const std::string &Name, const std::string &Detail,
+                            InstSiteKind Kind, unsigned NumCounters) {
+  auto [I, Inserted] = InstSiteOffsets.try_emplace(Name, NumInstCounters);
+  if (Inserted) {
+    InstSites.push_back({Name, Detail, Kind, NumInstCounters});
+    NumInstCounters += NumCounters;
+  }
+  return I->second;
+}
+
+/// EmitInstIncrement - add V (one by default) to counter Offset + Index.
+static void EmitInstIncrement(unsigned Offset, Value *Index = nullptr,
+                              Value *V = nullptr) {
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  Value *Counters = CurInstCounters ? CurInstCounters : EmitInstCounters();
+  Value *Idx = ConstantInt::get(Int64Ty, Offset);
+  if (Index)
+    Idx = Builder->CreateAdd(Idx, Index);
+  Value *Ptr = Builder->CreateInBoundsGEP(Int64Ty, Counters, Idx, "inst.ptr");
+  // Only this thread writes the counter, so a relaxed load and store suffice.
+  LoadInst *Count = Builder->CreateLoad(Int64Ty, Ptr, "inst.count");
+  Count->setAtomic(AtomicOrdering::Monotonic);
+  Builder
+      ->CreateStore(
+          Builder->CreateAdd(Count, V ? V : ConstantInt::get(Int64Ty, 1)), Ptr)
+      ->setAtomic(AtomicOrdering::Monotonic);
+}
+
+/// EmitInstEntry - in --instrument mode, fetch the counters of the function
+/// being generated and count its entry.
+static void EmitInstEntry(Function *F, bool IsGenerator) {
+  CurInstCounters = nullptr;
+  InstCallSites.clear();
+  if (!isInstrumenting())
+    return;
+  CurInstCounters = EmitInstCounters();
+  EmitInstIncrement(getInstSite(std::string(F->getName()), "", IS_Entry, 1));
+  if (IsGenerator)
+    CurInstCounters = nullptr;
+}
+
+/// EmitInstCall - in --instrument mode, count the call Call to Callee.
+static void EmitInstCall(const ExprAST *Call, const std::string &Callee) {
+  if (!isInstrumenting())
+    return;
+  unsigned N = InstCallSites.try_emplace(Call, InstCallSites.size())
+                   .first->second;
+  std::string Site(Builder->GetInsertBlock()->getParent()->getName());
+  Site += ":call" + std::to_string(N);
+  EmitInstIncrement(getInstSite(Site, Callee, IS_Call, 1));
+}
+
+/// EmitInstLoopExit - in --instrument mode, count a run of the loop Site that
+/// made Trips trips.
+static void EmitInstLoopExit(const std::string &Site, Value *Trips) {
+  unsigned Offset = getInstSite(Site, "", IS_Loop, 2 + InstLoopBuckets);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  EmitInstIncrement(Offset);
+  EmitInstIncrement(Offset + 1, nullptr, Trips);
+  // The bucket is the bit width of Trips, capped at the last.
+  Value *Width = Builder->CreateSub(
+      ConstantInt::get(Int64Ty, 64),
+      Builder->CreateBinaryIntrinsic(Intrinsic::ctlz, Trips,
+                                     Builder->getFalse()));
+  Value *Bucket = Builder->CreateSelect(
+      Builder->CreateICmpULT(Width,
+                             ConstantInt::get(Int64Ty, InstLoopBuckets - 1)),
+      Width, ConstantInt::get(Int64Ty, InstLoopBuckets - 1), "inst.bucket");
+  EmitInstIncrement(Offset + 2, Bucket);
+}
+
+/// EmitInstDescriptor - in --instrument mode, describe the module's counter
+/// sites for libmeow.
+static void EmitInstDescriptor() {
+  if (!InstDescriptor)
+    return;
+
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  Type *Int8PtrTy = Type::getInt8PtrTy(*TheContext);
+  StructType *SiteTy = getInstSiteType();
+  IRBuilder<> B(*TheContext);
+  auto String = [&](const std::string &S) -> Constant * {
+    if (S.empty())
+      return ConstantPointerNull::get(cast<PointerType>(Int8PtrTy));
+    auto *GV = new GlobalVariable(
+        *TheModule, ArrayType::get(B.getInt8Ty(), S.size() + 1), true,
+        GlobalValue::PrivateLinkage,
+        ConstantDataArray::getString(*TheContext, S), "inst.name");
+    GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    return ConstantExpr::getBitCast(GV, Int8PtrTy);
+  };
+
+  std::vector<Constant *> Sites;
+  for (const InstSite &S : InstSites)
+    Sites.push_back(ConstantStruct::get(
+        SiteTy, {String(S.Name), String(S.Detail),
+                 ConstantInt::get(Int64Ty, S.Kind),
+                 ConstantInt::get(Int64Ty, S.Offset)}));
+  auto *SitesTy = ArrayType::get(SiteTy, Sites.size());
+  auto *SitesGV = new GlobalVariable(*TheModule, SitesTy, true,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(SitesTy, Sites),
+                                     "inst.sites");
+
+  std::string Path =
+      Instrument.empty() ? "meow-counters.json" : std::string(Instrument);
+  InstDescriptor->setInitializer(ConstantStruct::get(
+      getInstDescriptorType(),
+      {ConstantInt::get(Int64Ty, -1),
+       ConstantInt::get(Int64Ty, NumInstCounters),
+       ConstantInt::get(Int64Ty, Sites.size()),
+       ConstantExpr::getBitCast(SitesGV, SiteTy->getPointerTo()),
+       String(Path)}));
+}
+
+/// EmitProfileSummary - In -profile-use mode, attach a profile summary to the
+/// module so the optimizer can tell hot functions and call sites from cold.
+static void EmitProfileSummary() {
+  if (ProfileCounts.empty())
+    return;
+
+  // Group the counters by function, with the entry count first followed by
+  // the function's branch counts, as InstrProfRecord expects.
+  StringMap<std::vector<uint64_t>> CountsByFn;
+  for (auto &Entry : ProfileCounts) {
+    auto [Fn, Site] = Entry.getKey().split(':');
+    std::vector<uint64_t> &Counts = CountsByFn[Fn];
+    if (Counts.empty())
+      Counts.push_back(0);
+    if (Site.empty())
+      Counts[0] = Entry.getValue();
+    else
+      Counts.push_back(Entry.getValue());
+  }
+
+  InstrProfSummaryBuilder PSB(ProfileSummaryBuilder::DefaultCutoffs);
+  for (auto &R : CountsByFn)
+    PSB.addRecord(InstrProfRecord(std::move(R.getValue())));
+
+  TheModule->setProfileSummary(PSB.getSummary()->getMD(*TheContext),
+                               ProfileSummary::PSK_Instr);
+}
+
 /// =============== //
 /// Code Generation //
 /// =============== //
@@ -850,53 +2931,1409 @@ Function *getFunction(std::string Name) {
   return nullptr;
 }
 
-/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
-/// the function.  This is used for mutable variables etc.
-static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                          StringRef VarName) {
-  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
-                   TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, VarName);
+/// CheckPureCall - A pure function may only call other pure functions. Returns
+/// false (after logging an error) if the call to Callee would violate this.
+static bool CheckPureCall(Function *CalleeF) {
+  if (!CurFunction || !CurFunction->isPure())
+    return true;
+
+  std::string Callee = std::string(CalleeF->getName());
+  auto FI = FunctionProtos.find(Callee);
+  if (FI == FunctionProtos.end() || !FI->second->isPure()) {
+    std::string Msg = "pure function '" + CurFunction->getName() +
+                      "' calls impure function '" + Callee + "'";
+    LogError(Msg.c_str());
+    return false;
+  }
+
+  if (!CalleeF->doesNotAccessMemory() && Callee != CurFunction->getName()) {
+    if (CalleeF->onlyAccessesInaccessibleMemory())
+      CurFunctionTouchesMemory = true;
+    else
+      CurFunctionTouchesArrays = true;
+  }
+  return true;
+}
+
+/// CheckImpureBuiltin - Builtins with side effects can't be called from pure
+/// functions. Returns false (after logging an error) if the current function
+/// is pure.
+static bool CheckImpureBuiltin(const char *Builtin) {
+  if (!CurFunction || !CurFunction->isPure())
+    return true;
+  std::string Msg = "pure function '" + CurFunction->getName() +
+                    "' calls impure builtin '" + Builtin + "'";
+  LogError(Msg.c_str());
+  return false;
+}
+
+/// getArrayType - The type of a double[]: a pointer to the first element and
+/// the number of elements. Arrays are passed and returned by value, which
+/// externs see as a (double *, int64_t) pair.
+static StructType *getArrayType() {
+  return StructType::get(Type::getDoublePtrTy(*TheContext),
+                         Type::getInt64Ty(*TheContext));
+}
+
+/// getConstArrayType - The type of a const double[], laid out like a
+/// double[] but whose elements may not be assigned. A double[] converts to a
+/// const double[] implicitly.
+static StructType *getConstArrayType() {
+  if (StructType *Ty = StructType::getTypeByName(*TheContext, "const.array"))
+    return Ty;
+  return StructType::create(*TheContext,
+                            {Type::getDoublePtrTy(*TheContext),
+                             Type::getInt64Ty(*TheContext)},
+                            "const.array");
+}
+
+/// getTaskType - The type of a task: a handle on a spawned call, owned by the
+/// runtime.
+static PointerType *getTaskType() {
+  StructType *Ty = StructType::getTypeByName(*TheContext, "meow.task");
+  if (!Ty)
+    Ty = StructType::create(*TheContext, "meow.task");
+  return Ty->getPointerTo();
+}
+
+/// getRecordFieldType - The type field i of R is stored as.
+static Type *getRecordFieldType(const RecordAST &R, unsigned i) {
+  return R.isIntField(i) ? Type::getInt64Ty(*TheContext)
+                         : Type::getDoubleTy(*TheContext);
+}
+
+/// getRecordType - The type of a single R, as stored in an array of structs.
+static StructType *getRecordType(const RecordAST &R) {
+  if (StructType *Ty = StructType::getTypeByName(*TheContext, R.getName()))
+    return Ty;
+  std::vector<Type *> Fields;
+  for (unsigned i = 0, e = R.getNumFields(); i != e; ++i)
+    Fields.push_back(getRecordFieldType(R, i));
+  return StructType::create(*TheContext, Fields, R.getName());
+}
+
+/// getRecordArrayType - The type of an R[]. An array of structs is a pointer
+/// to the first record and the number of records; a struct of arrays is a
+/// pointer to each field's array, then the number of records. Like double[],
+/// the length is always the last member.
+static StructType *getRecordArrayType(const RecordAST &R) {
+  std::string Name = R.getName() + ".array";
+  if (StructType *Ty = StructType::getTypeByName(*TheContext, Name))
+    return Ty;
+  std::vector<Type *> Members;
+  if (R.isSoA())
+    for (unsigned i = 0, e = R.getNumFields(); i != e; ++i)
+      Members.push_back(getRecordFieldType(R, i)->getPointerTo());
+  else
+    Members.push_back(getRecordType(R)->getPointerTo());
+  Members.push_back(Type::getInt64Ty(*TheContext));
+  return StructType::create(*TheContext, Members, Name);
+}
+
+/// getRecordOf - The record Ty is an array of, or null.
+static RecordAST *getRecordOf(Type *Ty) {
+  auto *STy = dyn_cast<StructType>(Ty);
+  if (!STy || !STy->hasName() || !STy->getName().endswith(".array"))
+    return nullptr;
+  auto RI = Records.find(STy->getName().drop_back(6).str());
+  return RI == Records.end() ? nullptr : RI->second.get();
+}
+
+/// isArrayType - Whether Ty is a double[], a const double[] or an array of
+/// records.
+static bool isArrayType(Type *Ty) {
+  return Ty == getArrayType() || Ty == getConstArrayType() || getRecordOf(Ty);
+}
+
+/// getMeowType - The LLVM type for the meow type named Name, or null if there
+/// is no such type.
+static Type *getMeowType(const std::string &Name) {
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  if (Name == "double")
+    return DoubleTy;
+  if (Name == "vec4")
+    return FixedVectorType::get(DoubleTy, 4);
+  if (Name == "vec8")
+    return FixedVectorType::get(DoubleTy, 8);
+  if (Name == "double[]")
+    return getArrayType();
+  if (Name == "const double[]")
+    return getConstArrayType();
+  if (Name == "task")
+    return getTaskType();
+  if (StringRef(Name).endswith("[]")) {
+    auto RI = Records.find(Name.substr(0, Name.size() - 2));
+    if (RI != Records.end())
+      return getRecordArrayType(*RI->second);
+  }
+  return nullptr;
+}
+
+/// getMeowTypeName - The meow spelling of an LLVM type, for diagnostics.
+static std::string getMeowTypeName(Type *Ty) {
+  if (auto *VTy = dyn_cast<FixedVectorType>(Ty))
+    return "vec" + std::to_string(VTy->getNumElements());
+  if (Ty == getArrayType())
+    return "double[]";
+  if (Ty == getConstArrayType())
+    return "const double[]";
+  if (Ty == getTaskType())
+    return "task";
+  if (Ty->isPointerTy())
+    return "string";
+  if (RecordAST *R = getRecordOf(Ty))
+    return R->getName() + "[]";
+  return "double";
+}
+
+/// CoerceToType - Convert V to Ty for use as What, broadcasting a double into
+/// every lane if Ty is a vector. Logs an error and returns null if V can't be
+/// converted.
+static Value *CoerceToType(Value *V, Type *Ty, const std::string &What) {
+  if (V->getType() == Ty)
+    return V;
+  if (auto *VTy = dyn_cast<FixedVectorType>(Ty))
+    if (V->getType()->isDoubleTy())
+      return Builder->CreateVectorSplat(VTy->getNumElements(), V, "splat");
+  if (Ty == getConstArrayType() && V->getType() == getArrayType()) {
+    Value *C = Builder->CreateInsertValue(PoisonValue::get(Ty),
+                                          Builder->CreateExtractValue(V, 0), 0);
+    return Builder->CreateInsertValue(C, Builder->CreateExtractValue(V, 1), 1);
+  }
+
+  std::string Msg = What + ": expected " + getMeowTypeName(Ty) + " but got " +
+                    getMeowTypeName(V->getType());
+  LogError(Msg.c_str());
+  return nullptr;
+}
+
+/// UnifyOperands - Give L and R the same type for an elementwise operator,
+/// broadcasting a double operand if the other is a vector.
+static bool UnifyOperands(Value *&L, Value *&R) {
+  if (!L->getType()->isFPOrFPVectorTy() || !R->getType()->isFPOrFPVectorTy()) {
+    LogError("arithmetic operators apply only to doubles and vectors");
+    return false;
+  }
+  if (L->getType()->isVectorTy())
+    R = CoerceToType(R, L->getType(), "right operand");
+  else
+    L = CoerceToType(L, R->getType(), "left operand");
+  return L && R;
+}
+
+/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
+/// the function.  This is used for mutable variables etc.
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
+                                          StringRef VarName, Type *Ty) {
+  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                   TheFunction->getEntryBlock().begin());
+  return TmpB.CreateAlloca(Ty, nullptr, VarName);
+}
+
+Value *StringExprAST::codegen() {
+  return Builder->CreateGlobalStringPtr(Val, "str");
 }
 
 Value *VariableExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
   // Look this variable up in the function.
-  Value *V = NamedValues[Name];
+  AllocaInst *V = NamedValues[Name];
   if (!V)
     return LogErrorV("Unknown variable name");
 
   // Load the value.
-  return Builder->CreateLoad(Type::getDoubleTy(*TheContext), V, Name.c_str());
+  return Builder->CreateLoad(V->getAllocatedType(), V, Name.c_str());
 }
 
 Value *NumberExprAST::codegen() {
   return ConstantFP::get(*TheContext, APFloat(Val));
 }
 
+/// ======== //
+/// Builtins //
+/// ======== //
+
+// Builtins are lowered straight to IR rather than called. A function defined
+// or declared with the same name takes precedence.
+
+/// EmitToInt - Convert a double to IntTy, truncating toward zero. NaN becomes
+/// 0 and values out of range the nearest integer, where fptosi would give
+/// poison, so a bounds check on the result still sees them.
+static Value *EmitToInt(Value *V, Type *IntTy, const Twine &Name = "") {
+  return Builder->CreateIntrinsic(Intrinsic::fptosi_sat, {IntTy, V->getType()},
+                                  {V}, nullptr, Name);
+}
+
+/// EmitLaneIndex - Convert a double lane index into an i32 for Vec. Lane
+/// indices wrap around modulo the vector width.
+static Value *EmitLaneIndex(Value *Vec, Value *Idx) {
+  unsigned Width = cast<FixedVectorType>(Vec->getType())->getNumElements();
+  // Signed so that -1 wraps to the last lane; FPToUI of a negative is poison.
+  Value *I = Builder->CreateFPToSI(Idx, Builder->getInt64Ty(), "lane");
+  I = Builder->CreateAnd(I, Width - 1);
+  return Builder->CreateTrunc(I, Builder->getInt32Ty());
+}
+
+static bool CheckVector(Value *V, const char *Builtin) {
+  if (V->getType()->isVectorTy())
+    return true;
+  LogError((std::string(Builtin) + ": expected a vector").c_str());
+  return false;
+}
+
+static bool CheckDouble(Value *V, const char *Builtin) {
+  if (V->getType()->isDoubleTy())
+    return true;
+  LogError((std::string(Builtin) + ": expected a double").c_str());
+  return false;
+}
+
+/// vec4(x) / vec4(a, b, c, d) - broadcast a double or build a vector.
+static Value *EmitVectorBuild(std::vector<Value *> &Args, unsigned Width) {
+  const char *Name = Width == 4 ? "vec4" : "vec8";
+  for (Value *A : Args)
+    if (!CheckDouble(A, Name))
+      return nullptr;
+
+  if (Args.size() == 1)
+    return Builder->CreateVectorSplat(Width, Args[0], "splat");
+  if (Args.size() != Width)
+    return LogErrorV((std::string(Name) + ": expected 1 or " +
+                      std::to_string(Width) + " arguments")
+                         .c_str());
+
+  Value *V = PoisonValue::get(
+      FixedVectorType::get(Type::getDoubleTy(*TheContext), Width));
+  for (unsigned i = 0; i != Width; ++i)
+    V = Builder->CreateInsertElement(V, Args[i], i, "vecinit");
+  return V;
+}
+
+/// shuffle(v, i0, ..., iN) / shuffle(a, b, i0, ..., iN) - pick lanes of one
+/// or two vectors by constant index; lanes of b are numbered after a's.
+static Value *EmitShuffle(std::vector<Value *> &Args) {
+  if (Args.empty() || !CheckVector(Args[0], "shuffle"))
+    return nullptr;
+
+  Value *A = Args[0];
+  Value *B = nullptr;
+  unsigned FirstIdx = 1;
+  if (Args.size() > 1 && Args[1]->getType()->isVectorTy()) {
+    if (Args[1]->getType() != A->getType())
+      return LogErrorV("shuffle: vectors must have the same width");
+    B = Args[1];
+    FirstIdx = 2;
+  }
+
+  unsigned Width = cast<FixedVectorType>(A->getType())->getNumElements();
+  unsigned NumLanes = B ? Width * 2 : Width;
+  std::vector<int> Mask;
+  for (unsigned i = FirstIdx, e = Args.size(); i != e; ++i) {
+    auto *C = dyn_cast<ConstantFP>(Args[i]);
+    if (!C)
+      return LogErrorV("shuffle: lane indices must be constants");
+    double Idx = C->getValueAPF().convertToDouble();
+    if (Idx < 0 || Idx >= NumLanes || Idx != (int)Idx)
+      return LogErrorV("shuffle: lane index out of range");
+    Mask.push_back((int)Idx);
+  }
+  if (Mask.size() != 4 && Mask.size() != 8)
+    return LogErrorV("shuffle: expected 4 or 8 lane indices");
+
+  if (!B)
+    B = PoisonValue::get(A->getType());
+  return Builder->CreateShuffleVector(A, B, Mask, "shuffle");
+}
+
+/// hsum(v) etc. - horizontal reductions. These are evaluated in lane order
+/// unless fast-math allows reassociation.
+static Value *EmitReduction(std::vector<Value *> &Args, char Op) {
+  if (Args.size() != 1)
+    return LogErrorV("reduction: expected one argument");
+  Value *V = Args[0];
+  if (!CheckVector(V, "reduction"))
+    return nullptr;
+
+  Value *R;
+  switch (Op) {
+  case '+':
+    R = Builder->CreateFAddReduce(ConstantFP::getNegativeZero(Builder->getDoubleTy()), V);
+    break;
+  case '*':
+    R = Builder->CreateFMulReduce(ConstantFP::get(Builder->getDoubleTy(), 1.0),
+                                  V);
+    break;
+  case '<':
+    R = Builder->CreateFPMinReduce(V);
+    break;
+  default:
+    R = Builder->CreateFPMaxReduce(V);
+    break;
+  }
+  cast<Instruction>(R)->setFastMathFlags(Builder->getFastMathFlags());
+  return R;
+}
+
+/// printv(v) - print a vector through libmeow, returning 0.
+static Value *EmitPrintVector(std::vector<Value *> &Args) {
+  if (Args.size() != 1 || !CheckVector(Args[0], "printv"))
+    return nullptr;
+
+  Type *DoubleTy = Builder->getDoubleTy();
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionCallee PrintV = TheModule->getOrInsertFunction(
+      "meow_printv", FunctionType::get(DoubleTy,
+                                       {DoubleTy->getPointerTo(), Int64Ty},
+                                       false));
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  AllocaInst *Tmp =
+      CreateEntryBlockAlloca(TheFunction, "printv.tmp", Args[0]->getType());
+  Builder->CreateStore(Args[0], Tmp);
+  unsigned Width = cast<FixedVectorType>(Args[0]->getType())->getNumElements();
+  return Builder->CreateCall(
+      PrintV,
+      {Builder->CreateBitCast(Tmp, DoubleTy->getPointerTo()),
+       ConstantInt::get(Int64Ty, Width)},
+      "calltmp");
+}
+
+/// array(n) - a new zeroed array of n doubles.
+static Value *EmitArrayAlloc(std::vector<Value *> &Args) {
+  if (Args.size() != 1 || !CheckDouble(Args[0], "array"))
+    return LogErrorV("array: expected a length");
+
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionCallee Alloc = TheModule->getOrInsertFunction(
+      "meow_array_alloc",
+      FunctionType::get(Type::getDoublePtrTy(*TheContext), {Int64Ty}, false));
+  Value *Len = EmitToInt(Args[0], Int64Ty, "len");
+  Value *Data = Builder->CreateCall(Alloc, {Len}, "data");
+  CurFunctionTouchesArrays = true;
+
+  Value *A = PoisonValue::get(getArrayType());
+  A = Builder->CreateInsertValue(A, Data, 0);
+  return Builder->CreateInsertValue(A, Len, 1, "array");
+}
+
+/// EmitArrayLength - the number of elements in the array A, as an i64.
+static Value *EmitArrayLength(Value *A) {
+  unsigned LenIdx = cast<StructType>(A->getType())->getNumElements() - 1;
+  return Builder->CreateExtractValue(A, LenIdx, "len");
+}
+
+/// len(a) - the number of elements in an array.
+static Value *EmitArrayLen(std::vector<Value *> &Args) {
+  if (Args.size() != 1 || !isArrayType(Args[0]->getType()))
+    return LogErrorV("len: expected an array");
+  return Builder->CreateSIToFP(EmitArrayLength(Args[0]),
+                               Builder->getDoubleTy(), "len");
+}
+
+/// readv(a) - fill a with numbers read from input, returning how many were
+/// read; fewer than len(a) only at end of input. See libmeow for the format.
+static Value *EmitReadVector(std::vector<Value *> &Args) {
+  if (Args.size() != 1 || Args[0]->getType() != getArrayType())
+    return LogErrorV("readv: expected a double[]");
+
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionCallee Read = TheModule->getOrInsertFunction(
+      "meow_readv",
+      FunctionType::get(Int64Ty, {Type::getDoublePtrTy(*TheContext), Int64Ty},
+                        false));
+  Value *Data = Builder->CreateExtractValue(Args[0], 0, "data");
+  Value *N = Builder->CreateCall(Read, {Data, EmitArrayLength(Args[0])}, "n");
+  CurFunctionTouchesArrays = true;
+  return Builder->CreateSIToFP(N, Builder->getDoubleTy(), "n");
+}
+
+static void EmitBoundsCheck(Value *InBounds, Value *Index, Value *Len);
+
+/// CheckDoubleArray - whether V is a double[] or, unless Mutable is set, a
+/// const double[].
+static bool CheckDoubleArray(Value *V, const char *Builtin,
+                             bool Mutable = false) {
+  if (V->getType() == getArrayType() ||
+      (!Mutable && V->getType() == getConstArrayType()))
+    return true;
+  LogError((std::string(Builtin) + (Mutable ? ": expected a double[]"
+                                            : ": expected a double array"))
+               .c_str());
+  return false;
+}
+
+/// EmitArrayKernelCall - call the libmeow kernel Name over the first N
+/// elements of some arrays, after checking each array In has at least N.
+/// Arguments are passed in order, arrays as their data pointers, with N
+/// last.
+static Value *EmitArrayKernelCall(const char *Name, Type *RetTy,
+                                  ArrayRef<Value *> Args, Value *N,
+                                  ArrayRef<Value *> In) {
+  for (Value *A : In) {
+    Value *Len = EmitArrayLength(A);
+    EmitBoundsCheck(Builder->CreateICmpSGE(Len, N, "inbounds"),
+                    Builder->CreateSub(N, Builder->getInt64(1)), Len);
+  }
+
+  std::vector<Value *> CallArgs;
+  for (Value *A : Args)
+    CallArgs.push_back(isa<StructType>(A->getType())
+                           ? Builder->CreateExtractValue(A, 0, "data")
+                           : A);
+  CallArgs.push_back(N);
+  std::vector<Type *> ArgTys;
+  for (Value *A : CallArgs)
+    ArgTys.push_back(A->getType());
+  FunctionCallee Kernel = TheModule->getOrInsertFunction(
+      Name, FunctionType::get(RetTy, ArgTys, false));
+  CurFunctionTouchesArrays = true;
+  return Builder->CreateCall(Kernel, CallArgs);
+}
+
+/// vsin(a, out), vcos(a, out), vsqrt(a, out) - apply the function to each
+/// element of a, writing out, which is returned. a may be out, and must be at
+/// least as long.
+static Value *EmitArrayMap(std::vector<Value *> &Args, const char *Builtin) {
+  if (Args.size() != 2 || !CheckDoubleArray(Args[0], Builtin) ||
+      !CheckDoubleArray(Args[1], Builtin, /*Mutable=*/true))
+    return LogErrorV((std::string(Builtin) + ": expected (array, out)").c_str());
+  EmitArrayKernelCall((std::string("meow_") + Builtin).c_str(),
+                      Builder->getVoidTy(), Args, EmitArrayLength(Args[1]),
+                      Args[0]);
+  return Args[1];
+}
+
+/// vpow(a, p, out) - raise each element of a to the power p, writing out,
+/// which is returned.
+static Value *EmitArrayPow(std::vector<Value *> &Args) {
+  if (Args.size() != 3 || !CheckDoubleArray(Args[0], "vpow") ||
+      !CheckDouble(Args[1], "vpow") ||
+      !CheckDoubleArray(Args[2], "vpow", /*Mutable=*/true))
+    return LogErrorV("vpow: expected (array, power, out)");
+  EmitArrayKernelCall("meow_vpow", Builder->getVoidTy(), Args,
+                      EmitArrayLength(Args[2]), Args[0]);
+  return Args[2];
+}
+
+/// axpy(alpha, x, y) - add alpha * x to y in place, returning y.
+static Value *EmitAxpy(std::vector<Value *> &Args) {
+  if (Args.size() != 3 || !CheckDouble(Args[0], "axpy") ||
+      !CheckDoubleArray(Args[1], "axpy") ||
+      !CheckDoubleArray(Args[2], "axpy", /*Mutable=*/true))
+    return LogErrorV("axpy: expected (alpha, x, y)");
+  EmitArrayKernelCall("meow_axpy", Builder->getVoidTy(), Args,
+                      EmitArrayLength(Args[2]), Args[1]);
+  return Args[2];
+}
+
+/// dot(x, y) - the dot product of x and the first len(x) elements of y.
+static Value *EmitDot(std::vector<Value *> &Args) {
+  if (Args.size() != 2 || !CheckDoubleArray(Args[0], "dot") ||
+      !CheckDoubleArray(Args[1], "dot"))
+    return LogErrorV("dot: expected two arrays");
+  return EmitArrayKernelCall("meow_dot", Builder->getDoubleTy(), Args,
+                             EmitArrayLength(Args[0]), Args[1]);
+}
+
+/// sum(x) - the sum of the elements of x. Sums and dot products are the same
+/// whatever vector instructions the machine has.
+static Value *EmitSum(std::vector<Value *> &Args) {
+  if (Args.size() != 1 || !CheckDoubleArray(Args[0], "sum"))
+    return LogErrorV("sum: expected an array");
+  return EmitArrayKernelCall("meow_sum", Builder->getDoubleTy(), Args,
+                             EmitArrayLength(Args[0]), {});
+}
+
+/// rand() - a uniform double in [0, 1) from this thread's xoshiro256++
+/// generator. The generator is inlined, so a loop drawing numbers keeps its
+/// state in registers; it must match RNG::next in libmeow.
+static Value *EmitRandom(std::vector<Value *> &Args) {
+  if (!Args.empty())
+    return LogErrorV("rand: expected no arguments");
+
+  Type *Int64Ty = Builder->getInt64Ty();
+  Type *DoubleTy = Builder->getDoubleTy();
+  // The state's address never changes for a thread, so calls to find it can
+  // be merged and hoisted out of loops.
+  FunctionCallee GetState = TheModule->getOrInsertFunction(
+      "meow_rng_state", FunctionType::get(Int64Ty->getPointerTo(), false));
+  if (auto *F = dyn_cast<Function>(GetState.getCallee())) {
+    F->setDoesNotAccessMemory();
+    F->setDoesNotThrow();
+    F->setWillReturn();
+  }
+  Value *State = Builder->CreateCall(GetState, {}, "rng");
+
+  Value *S[4], *Slots[4];
+  for (unsigned i = 0; i != 4; ++i) {
+    Slots[i] = Builder->CreateConstInBoundsGEP1_64(Int64Ty, State, i);
+    S[i] = Builder->CreateLoad(Int64Ty, Slots[i], "s");
+  }
+  Function *FShl =
+      Intrinsic::getDeclaration(TheModule.get(), Intrinsic::fshl, {Int64Ty});
+  auto RotL = [&](Value *X, uint64_t K) {
+    return Builder->CreateCall(FShl, {X, X, ConstantInt::get(Int64Ty, K)});
+  };
+
+  Value *Result = Builder->CreateAdd(RotL(Builder->CreateAdd(S[0], S[3]), 23),
+                                     S[0]);
+  Value *T = Builder->CreateShl(S[1], 17);
+  S[2] = Builder->CreateXor(S[2], S[0]);
+  S[3] = Builder->CreateXor(S[3], S[1]);
+  S[1] = Builder->CreateXor(S[1], S[2]);
+  S[0] = Builder->CreateXor(S[0], S[3]);
+  S[2] = Builder->CreateXor(S[2], T);
+  S[3] = RotL(S[3], 45);
+  for (unsigned i = 0; i != 4; ++i)
+    Builder->CreateStore(S[i], Slots[i]);
+
+  Value *Bits = Builder->CreateLShr(Result, 11);
+  return Builder->CreateFMul(Builder->CreateUIToFP(Bits, DoubleTy),
+                             ConstantFP::get(DoubleTy, 0x1p-53), "rand");
+}
+
+/// randn() - a standard normal from this thread's generator.
+static Value *EmitRandomNormal(std::vector<Value *> &Args) {
+  if (!Args.empty())
+    return LogErrorV("randn: expected no arguments");
+  FunctionCallee RandN = TheModule->getOrInsertFunction(
+      "meow_randn", FunctionType::get(Builder->getDoubleTy(), false));
+  return Builder->CreateCall(RandN, {}, "randn");
+}
+
+/// seed(s), seed(s, k) - restart this thread's generator on stream k (by
+/// default 0) of the seed s. Different streams of one seed don't overlap, so
+/// parallel workers each seeded with their own k draw independent numbers.
+static Value *EmitSeed(std::vector<Value *> &Args) {
+  if (Args.empty() || Args.size() > 2 || !CheckDouble(Args[0], "seed") ||
+      (Args.size() == 2 && !CheckDouble(Args[1], "seed")))
+    return LogErrorV("seed: expected (seed) or (seed, stream)");
+
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionCallee Seed = TheModule->getOrInsertFunction(
+      "meow_rng_seed",
+      FunctionType::get(Builder->getVoidTy(), {Int64Ty, Int64Ty}, false));
+  // The stream is a count of jumps, so a negative one is taken as 0.
+  Value *Stream = Builder->getInt64(0);
+  if (Args.size() == 2)
+    Stream = Builder->CreateIntrinsic(Intrinsic::fptoui_sat,
+                                      {Int64Ty, Args[1]->getType()}, {Args[1]});
+  Builder->CreateCall(Seed, {EmitToInt(Args[0], Int64Ty), Stream});
+  return ConstantFP::get(*TheContext, APFloat(0.0));
+}
+
+/// jump() - move this thread's generator on to the start of its next stream.
+static Value *EmitJump(std::vector<Value *> &Args) {
+  if (!Args.empty())
+    return LogErrorV("jump: expected no arguments");
+  FunctionCallee Jump = TheModule->getOrInsertFunction(
+      "meow_rng_jump", FunctionType::get(Builder->getVoidTy(), false));
+  Builder->CreateCall(Jump);
+  return ConstantFP::get(*TheContext, APFloat(0.0));
+}
+
+/// randfill(a), randnfill(a) - fill a with uniform or standard normal random
+/// numbers, returning a.
+static Value *EmitRandomFill(std::vector<Value *> &Args, const char *Builtin,
+                             const char *Kernel) {
+  if (Args.size() != 1 || !CheckDoubleArray(Args[0], Builtin, /*Mutable=*/true))
+    return LogErrorV((std::string(Builtin) + ": expected an array").c_str());
+  EmitArrayKernelCall(Kernel, Builder->getVoidTy(), Args,
+                      EmitArrayLength(Args[0]), {});
+  return Args[0];
+}
+
+/// array:R(n) - a new zeroed array of n records. An array of structs is one
+/// allocation; a struct of arrays allocates each field's array separately.
+static Value *EmitRecordArrayAlloc(const RecordAST &R,
+                                   std::vector<Value *> &Args) {
+  if (Args.size() != 1 || !CheckDouble(Args[0], "array"))
+    return LogErrorV("array: expected a length");
+
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionCallee Alloc = TheModule->getOrInsertFunction(
+      "meow_alloc", FunctionType::get(Builder->getInt8PtrTy(), {Int64Ty},
+                                      false));
+  Value *Len = EmitToInt(Args[0], Int64Ty, "len");
+  CurFunctionTouchesArrays = true;
+
+  StructType *ArrayTy = getRecordArrayType(R);
+  Value *A = PoisonValue::get(ArrayTy);
+  for (unsigned i = 0, e = ArrayTy->getNumElements() - 1; i != e; ++i) {
+    // Every field is 8 bytes, so a record is 8 bytes per field. A size that
+    // overflows is passed on as -1, for meow_alloc to reject.
+    uint64_t ElementSize = R.isSoA() ? 8 : 8 * R.getNumFields();
+    Value *Mul = Builder->CreateBinaryIntrinsic(
+        Intrinsic::smul_with_overflow, Len,
+        ConstantInt::get(Int64Ty, ElementSize));
+    Value *Bytes = Builder->CreateSelect(
+        Builder->CreateExtractValue(Mul, 1), ConstantInt::get(Int64Ty, -1),
+        Builder->CreateExtractValue(Mul, 0), "bytes");
+    Value *Data = Builder->CreateCall(Alloc, {Bytes}, "data");
+    A = Builder->CreateInsertValue(
+        A, Builder->CreateBitCast(Data, ArrayTy->getElementType(i)), i);
+  }
+  return Builder->CreateInsertValue(A, Len, ArrayTy->getNumElements() - 1,
+                                    "array");
+}
+
+static bool CheckString(Value *V, const char *Builtin) {
+  if (V->getType()->isPointerTy())
+    return true;
+  LogError((std::string(Builtin) + ": expected a string").c_str());
+  return false;
+}
+
+/// map("file") - map a file of doubles into memory as a const double[]. A
+/// file may start with a header giving its shape; see libmeow. The mapping
+/// lives until the program exits.
+static Value *EmitMapFile(std::vector<Value *> &Args) {
+  if (Args.size() != 1 || !CheckString(Args[0], "map"))
+    return LogErrorV("map: expected a file name");
+
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionCallee Map = TheModule->getOrInsertFunction(
+      "meow_map", FunctionType::get(Type::getDoublePtrTy(*TheContext),
+                                    {Builder->getInt8PtrTy(),
+                                     Int64Ty->getPointerTo()},
+                                    false));
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  AllocaInst *LenSlot = CreateEntryBlockAlloca(TheFunction, "map.len", Int64Ty);
+  Value *Data = Builder->CreateCall(Map, {Args[0], LenSlot}, "data");
+  CurFunctionTouchesArrays = true;
+
+  Value *A = PoisonValue::get(getConstArrayType());
+  A = Builder->CreateInsertValue(A, Data, 0);
+  return Builder->CreateInsertValue(
+      A, Builder->CreateLoad(Int64Ty, LenSlot, "len"), 1, "map");
+}
+
+/// mapdim("file", k) - extent k of a mapped file's shape: its length for k = 0
+/// if the file has no header, and 0 for k past its rank.
+static Value *EmitMapDim(std::vector<Value *> &Args) {
+  if (Args.size() != 2 || !CheckString(Args[0], "mapdim") ||
+      !CheckDouble(Args[1], "mapdim"))
+    return LogErrorV("mapdim: expected a file name and a dimension");
+
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionCallee MapDim = TheModule->getOrInsertFunction(
+      "meow_map_dim",
+      FunctionType::get(Int64Ty, {Builder->getInt8PtrTy(), Int64Ty}, false));
+  Value *Dim = Builder->CreateCall(
+      MapDim, {Args[0], Builder->CreateFPToSI(Args[1], Int64Ty)}, "dim");
+  return Builder->CreateSIToFP(Dim, Builder->getDoubleTy(), "dim");
+}
+
+using BuiltinFn = Value *(*)(std::vector<Value *> &Args);
+
+/// BuiltinInfo - how to emit a builtin, and whether it has side effects, so
+/// pure functions can't call it.
+struct BuiltinInfo {
+  BuiltinFn Emit;
+  bool Impure;
+
+  template <typename FnT>
+  BuiltinInfo(FnT EmitFn, bool HasSideEffects = false)
+      : Emit(EmitFn), Impure(HasSideEffects) {}
+};
+static const std::map<std::string, BuiltinInfo> Builtins = {
+    {"vec4", [](std::vector<Value *> &A) { return EmitVectorBuild(A, 4); }},
+    {"vec8", [](std::vector<Value *> &A) { return EmitVectorBuild(A, 8); }},
+    {"lane",
+     [](std::vector<Value *> &A) -> Value * {
+       if (A.size() != 2 || !CheckVector(A[0], "lane") ||
+           !CheckDouble(A[1], "lane"))
+         return LogErrorV("lane: expected (vector, index)");
+       return Builder->CreateExtractElement(A[0], EmitLaneIndex(A[0], A[1]),
+                                            "lane");
+     }},
+    {"setlane",
+     [](std::vector<Value *> &A) -> Value * {
+       if (A.size() != 3 || !CheckVector(A[0], "setlane") ||
+           !CheckDouble(A[1], "setlane") || !CheckDouble(A[2], "setlane"))
+         return LogErrorV("setlane: expected (vector, index, value)");
+       return Builder->CreateInsertElement(
+           A[0], A[2], EmitLaneIndex(A[0], A[1]), "setlane");
+     }},
+    {"shuffle", EmitShuffle},
+    {"hsum", [](std::vector<Value *> &A) { return EmitReduction(A, '+'); }},
+    {"hprod", [](std::vector<Value *> &A) { return EmitReduction(A, '*'); }},
+    {"hmin", [](std::vector<Value *> &A) { return EmitReduction(A, '<'); }},
+    {"hmax", [](std::vector<Value *> &A) { return EmitReduction(A, '>'); }},
+    {"printv", {EmitPrintVector, /*Impure=*/true}},
+    {"array", EmitArrayAlloc},
+    {"len", EmitArrayLen},
+    {"readv", {EmitReadVector, /*Impure=*/true}},
+    {"vsin", [](std::vector<Value *> &A) { return EmitArrayMap(A, "vsin"); }},
+    {"vcos", [](std::vector<Value *> &A) { return EmitArrayMap(A, "vcos"); }},
+    {"vsqrt", [](std::vector<Value *> &A) { return EmitArrayMap(A, "vsqrt"); }},
+    {"vpow", EmitArrayPow},
+    {"axpy", EmitAxpy},
+    {"dot", EmitDot},
+    {"sum", EmitSum},
+    {"rand", {EmitRandom, /*Impure=*/true}},
+    {"randn", {EmitRandomNormal, /*Impure=*/true}},
+    {"seed", {EmitSeed, /*Impure=*/true}},
+    {"jump", {EmitJump, /*Impure=*/true}},
+    {"randfill",
+     {[](std::vector<Value *> &A) {
+        return EmitRandomFill(A, "randfill", "meow_rand_fill");
+      },
+      /*Impure=*/true}},
+    {"randnfill",
+     {[](std::vector<Value *> &A) {
+        return EmitRandomFill(A, "randnfill", "meow_randn_fill");
+      },
+      /*Impure=*/true}},
+    {"map", EmitMapFile},
+    {"mapdim", EmitMapDim},
+};
+
+/// EmitCallArgs - generate the arguments of a call to CalleeF, converted to
+/// its parameter types, into ArgsV. Returns false after logging an error.
+static bool EmitCallArgs(Function *CalleeF, const std::string &Callee,
+                         ArrayRef<std::unique_ptr<ExprAST>> Args,
+                         std::vector<Value *> &ArgsV) {
+  if (CalleeF->arg_size() != Args.size()) {
+    LogError("Incorrect number of arguments passed");
+    return false;
+  }
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    Value *ArgV = Args[i]->codegen();
+    if (!ArgV)
+      return false;
+    ArgV = CoerceToType(ArgV, CalleeF->getArg(i)->getType(),
+                        "argument " + std::to_string(i + 1) + " of '" +
+                            Callee + "'");
+    if (!ArgV)
+      return false;
+    ArgsV.push_back(ArgV);
+  }
+  return true;
+}
+
 Value *CallExprAST::codegen() {
-  // Look up the name in the global module table
-  Function *CalleeF = TheModule->getFunction(Callee);
+  KSDbgInfo.emitLocation(this);
+  // Look up the name in the module, or declare a function defined in another.
+  Function *CalleeF = getFunction(Callee);
+  if (!CalleeF) {
+    auto BI = Builtins.find(Callee);
+    const RecordAST *R = nullptr;
+    if (StringRef(Callee).startswith("array:")) {
+      auto RI = Records.find(Callee.substr(6));
+      if (RI == Records.end())
+        return LogErrorV(("Unknown record '" + Callee.substr(6) + "'").c_str());
+      R = RI->second.get();
+    } else if (BI == Builtins.end()) {
+      return LogErrorV("Unknown function referenced");
+    } else if (BI->second.Impure && !CheckImpureBuiltin(Callee.c_str())) {
+      return nullptr;
+    }
+
+    std::vector<Value *> ArgsV;
+    for (auto &Arg : Args) {
+      ArgsV.push_back(Arg->codegen());
+      if (!ArgsV.back())
+        return nullptr;
+    }
+    return R ? EmitRecordArrayAlloc(*R, ArgsV) : BI->second.Emit(ArgsV);
+  }
+
+  auto FI = FunctionProtos.find(Callee);
+  if (FI != FunctionProtos.end() && FI->second->isGenerator())
+    return LogErrorV(("'" + Callee +
+                      "' is a gen function; loop over it with for/in")
+                         .c_str());
+
+  if (!CheckPureCall(CalleeF))
+    return nullptr;
+
+  std::vector<Value *> ArgsV;
+  if (!EmitCallArgs(CalleeF, Callee, Args, ArgsV))
+    return nullptr;
+  EmitInstCall(this, Callee);
+  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+}
+
+/// ===== //
+/// Tasks //
+/// ===== //
+
+/// getSpawnWrapper - the function the runtime calls to run a spawned call to
+/// F, which unpacks F's arguments from the struct EnvTy:
+///
+/// define internal double @f.task(i8* env) {
+///   ret double f(env->0, env->1, ...)
+/// }
+static Function *getSpawnWrapper(Function *F, StructType *EnvTy) {
+  std::string Name = (F->getName() + ".task").str();
+  if (Function *W = TheModule->getFunction(Name))
+    return W;
+
+  Function *W = Function::Create(
+      FunctionType::get(Builder->getDoubleTy(), {Builder->getInt8PtrTy()},
+                        false),
+      Function::InternalLinkage, Name, TheModule.get());
+  IRBuilderBase::InsertPointGuard Guard(*Builder);
+  Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", W));
+  Builder->SetCurrentDebugLocation(DebugLoc());
+  Value *Env = Builder->CreateBitCast(W->getArg(0), EnvTy->getPointerTo());
+  std::vector<Value *> Args;
+  for (unsigned i = 0, e = F->arg_size(); i != e; ++i)
+    Args.push_back(Builder->CreateLoad(
+        EnvTy->getElementType(i), Builder->CreateStructGEP(EnvTy, Env, i)));
+  Builder->CreateRet(Builder->CreateCall(F, Args));
+  verifyFunction(*W);
+  return W;
+}
+
+// Output spawn f(args) as:
+//   env = { args... }
+//   meow_spawn(f.task, &env, sizeof(env))
+//
+// The runtime copies the arguments, so env can live on the caller's stack.
+// Arrays are passed as they are to any call, and must outlive the task: the
+// scopes around a spawn like this do not free their arrays (see
+// spawnsWithArrays).
+Value *SpawnExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  Function *CalleeF = getFunction(Call->getCallee());
   if (!CalleeF)
-    return LogErrorV("Unknown function referenced");
+    return LogErrorV(("spawn: unknown function '" + Call->getCallee() + "'")
+                         .c_str());
+  if (!CalleeF->getReturnType()->isDoubleTy())
+    return LogErrorV(
+        ("spawn: '" + Call->getCallee() + "' must return a double").c_str());
+  if (!CheckPureCall(CalleeF))
+    return nullptr;
+
+  std::vector<Value *> ArgsV;
+  if (!EmitCallArgs(CalleeF, Call->getCallee(), Call->getArgs(), ArgsV))
+    return nullptr;
+  std::vector<Type *> EnvTys;
+  for (Value *ArgV : ArgsV)
+    EnvTys.push_back(ArgV->getType());
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  StructType *EnvTy = StructType::get(*TheContext, EnvTys);
+  AllocaInst *Env = CreateEntryBlockAlloca(TheFunction, "spawn.env", EnvTy);
+  for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+    Builder->CreateStore(ArgsV[i], Builder->CreateStructGEP(EnvTy, Env, i));
+
+  Function *Wrapper = getSpawnWrapper(CalleeF, EnvTy);
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionCallee Spawn = TheModule->getOrInsertFunction(
+      "meow_spawn",
+      FunctionType::get(getTaskType(),
+                        {Wrapper->getType(), Builder->getInt8PtrTy(), Int64Ty},
+                        false));
+  // The runtime's task state is the only memory a spawn touches itself.
+  CurFunctionTouchesMemory = true;
+  return Builder->CreateCall(
+      Spawn,
+      {Wrapper, Builder->CreateBitCast(Env, Builder->getInt8PtrTy()),
+       ConstantExpr::getSizeOf(EnvTy)},
+      "task");
+}
+
+Value *AwaitExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  Value *H = Handle->codegen();
+  if (!H)
+    return nullptr;
+  if (H->getType() != getTaskType())
+    return LogErrorV(("await: expected a task but got " +
+                      getMeowTypeName(H->getType()))
+                         .c_str());
+
+  FunctionCallee Await = TheModule->getOrInsertFunction(
+      "meow_await",
+      FunctionType::get(Builder->getDoubleTy(), {getTaskType()}, false));
+  CurFunctionTouchesMemory = true;
+  return Builder->CreateCall(Await, {H}, "await");
+}
+
+/// ========== //
+/// Generators //
+/// ========== //
+
+// A gen function is a switched-resume LLVM coroutine. Calling it allocates
+// its frame and returns the handle without running the body; each resume runs
+// the body to its next yield, which stores the value in the promise, and the
+// consuming for/in loop reads it from there. When the consumer can see the
+// gen function, the coroutine passes inline it and move the frame onto the
+// consumer's stack.
+
+/// GeneratorState - the coroutine a gen function is being generated as: its
+/// coro.id token and handle, the promise its yields store to, and the blocks
+/// that free the frame and return to the caller.
+struct GeneratorState {
+  Function *F;
+  Value *Id, *Handle;
+  AllocaInst *Promise;
+  BasicBlock *Cleanup, *Suspend;
+};
+static GeneratorState *CurGenerator = nullptr;
+
+/// containsYield - whether E yields, so a scope around it stays open while
+/// the consumer runs.
+static bool containsYield(ExprAST &E) {
+  if (isa<YieldExprAST>(E))
+    return true;
+  bool Result = false;
+  E.forEachChild([&](ExprAST &Child) { Result = Result || containsYield(Child); });
+  return Result;
+}
+
+static Function *getCoroIntrinsic(Intrinsic::ID ID, ArrayRef<Type *> Tys = {}) {
+  return Intrinsic::getDeclaration(TheModule.get(), ID, Tys);
+}
+
+/// EmitGeneratorSuspend - suspend the generator, returning to the consumer.
+/// The final suspend marks it done; a done generator is only destroyed.
+static void EmitGeneratorSuspend(bool Final) {
+  Value *S = Builder->CreateCall(
+      getCoroIntrinsic(Intrinsic::coro_suspend),
+      {ConstantTokenNone::get(*TheContext), Builder->getInt1(Final)},
+      "suspend");
+  BasicBlock *ResumeBB = BasicBlock::Create(
+      *TheContext, Final ? "gen.final" : "gen.resume", CurGenerator->F);
+  SwitchInst *SI = Builder->CreateSwitch(S, CurGenerator->Suspend, 2);
+  SI->addCase(Builder->getInt8(0), ResumeBB);
+  SI->addCase(Builder->getInt8(1), CurGenerator->Cleanup);
+  Builder->SetInsertPoint(ResumeBB);
+  if (Final)
+    Builder->CreateUnreachable();
+}
+
+/// EmitGeneratorBegin - set up F as a coroutine and suspend before its body,
+/// so a call just creates the generator.
+static void EmitGeneratorBegin(Function *F, GeneratorState &Gen) {
+  F->addFnAttr("coroutine.presplit", "0");
+  Type *Int8PtrTy = Builder->getInt8PtrTy();
+  Value *Null = ConstantPointerNull::get(Builder->getInt8PtrTy());
+
+  Gen.F = F;
+  Gen.Promise = CreateEntryBlockAlloca(F, "gen.value", Builder->getDoubleTy());
+  Gen.Id = Builder->CreateCall(
+      getCoroIntrinsic(Intrinsic::coro_id),
+      {Builder->getInt32(8), Builder->CreateBitCast(Gen.Promise, Int8PtrTy),
+       Null, Null},
+      "id");
+  Value *NeedAlloc = Builder->CreateCall(
+      getCoroIntrinsic(Intrinsic::coro_alloc), {Gen.Id}, "need.alloc");
+  BasicBlock *EntryBB = Builder->GetInsertBlock();
+  BasicBlock *AllocBB = BasicBlock::Create(*TheContext, "gen.alloc", F);
+  BasicBlock *BeginBB = BasicBlock::Create(*TheContext, "gen.begin", F);
+  Builder->CreateCondBr(NeedAlloc, AllocBB, BeginBB);
+
+  Builder->SetInsertPoint(AllocBB);
+  FunctionCallee Malloc = TheModule->getOrInsertFunction(
+      "malloc", FunctionType::get(Int8PtrTy, {Builder->getInt64Ty()}, false));
+  Value *Size = Builder->CreateCall(
+      getCoroIntrinsic(Intrinsic::coro_size, {Builder->getInt64Ty()}), {},
+      "size");
+  Value *Mem = Builder->CreateCall(Malloc, {Size}, "mem");
+  Builder->CreateBr(BeginBB);
+
+  Builder->SetInsertPoint(BeginBB);
+  PHINode *Frame = Builder->CreatePHI(Int8PtrTy, 2, "frame");
+  Frame->addIncoming(Null, EntryBB);
+  Frame->addIncoming(Mem, AllocBB);
+  Gen.Handle = Builder->CreateCall(getCoroIntrinsic(Intrinsic::coro_begin),
+                                   {Gen.Id, Frame}, "handle");
+  Gen.Cleanup = BasicBlock::Create(*TheContext, "gen.cleanup", F);
+  Gen.Suspend = BasicBlock::Create(*TheContext, "gen.suspend", F);
+
+  CurGenerator = &Gen;
+  EmitGeneratorSuspend(false);
+}
+
+/// EmitGeneratorEnd - finish the body with the final suspend, and emit the
+/// blocks that free the frame and return to the caller. Returns the handle,
+/// which the caller returns from the suspend block it leaves the builder in.
+static Value *EmitGeneratorEnd() {
+  GeneratorState &Gen = *CurGenerator;
+  EmitGeneratorSuspend(true);
+
+  Builder->SetInsertPoint(Gen.Cleanup);
+  Value *Mem = Builder->CreateCall(getCoroIntrinsic(Intrinsic::coro_free),
+                                   {Gen.Id, Gen.Handle}, "mem");
+  BasicBlock *FreeBB = BasicBlock::Create(*TheContext, "gen.free", Gen.F);
+  Builder->CreateCondBr(Builder->CreateIsNotNull(Mem), FreeBB, Gen.Suspend);
+  Builder->SetInsertPoint(FreeBB);
+  FunctionCallee Free = TheModule->getOrInsertFunction(
+      "free", FunctionType::get(Builder->getVoidTy(),
+                                {Builder->getInt8PtrTy()}, false));
+  Builder->CreateCall(Free, {Mem});
+  Builder->CreateBr(Gen.Suspend);
+
+  Builder->SetInsertPoint(Gen.Suspend);
+  Builder->CreateCall(getCoroIntrinsic(Intrinsic::coro_end),
+                      {Gen.Handle, Builder->getFalse()});
+  return Gen.Handle;
+}
+
+Value *YieldExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  if (!CurGenerator)
+    return LogErrorV("yield outside a gen function");
+  if (Builder->GetInsertBlock()->getParent() != CurGenerator->F)
+    return LogErrorV("yield inside a parfor body");
+
+  Value *V = Val->codegen();
+  if (!V || !CheckDouble(V, "yield"))
+    return nullptr;
+  Builder->CreateStore(V, CurGenerator->Promise);
+  EmitGeneratorSuspend(false);
+
+  // yield expr always returns 0.0.
+  return Constant::getNullValue(Builder->getDoubleTy());
+}
 
-  // If argument mismatch error
-  if (CalleeF->arg_size() != Args.size())
-    return LogErrorV("Incorrect number of arguments passed");
+// Output for x in g(args) in body as:
+//   handle = g(args)
+// loop:
+//   coro.resume(handle)
+//   br coro.done(handle), after, body
+// body:
+//   x = *coro.promise(handle)
+//   bodyexpr
+//   br loop
+// after:
+//   coro.destroy(handle)
+Value *ForInExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  Function *GenF = getFunction(Gen->getCallee());
+  auto FI = FunctionProtos.find(Gen->getCallee());
+  if (!GenF || FI == FunctionProtos.end() || !FI->second->isGenerator())
+    return LogErrorV(("for/in: '" + Gen->getCallee() +
+                      "' is not a gen function")
+                         .c_str());
+  if (!CheckPureCall(GenF))
+    return nullptr;
 
   std::vector<Value *> ArgsV;
-  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen());
-    if (!ArgsV.back())
+  if (!EmitCallArgs(GenF, Gen->getCallee(), Gen->getArgs(), ArgsV))
+    return nullptr;
+  Value *Handle = Builder->CreateCall(GenF, ArgsV, "gen");
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Type *DoubleTy = Builder->getDoubleTy();
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, DoubleTy);
+  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "gen.loop", TheFunction);
+  BasicBlock *BodyBB = BasicBlock::Create(*TheContext, "gen.body", TheFunction);
+  BasicBlock *AfterBB =
+      BasicBlock::Create(*TheContext, "gen.after", TheFunction);
+  Builder->CreateBr(LoopBB);
+
+  Builder->SetInsertPoint(LoopBB);
+  Builder->CreateCall(getCoroIntrinsic(Intrinsic::coro_resume), {Handle});
+  Builder->CreateCondBr(
+      Builder->CreateCall(getCoroIntrinsic(Intrinsic::coro_done), {Handle},
+                          "done"),
+      AfterBB, BodyBB);
+
+  Builder->SetInsertPoint(BodyBB);
+  Value *Promise = Builder->CreateCall(
+      getCoroIntrinsic(Intrinsic::coro_promise),
+      {Handle, Builder->getInt32(8), Builder->getFalse()}, "promise");
+  Builder->CreateStore(
+      Builder->CreateLoad(DoubleTy,
+                          Builder->CreateBitCast(Promise,
+                                                 DoubleTy->getPointerTo())),
+      Alloca);
+
+  // Within the loop, the variable is defined equal to the yielded value. If
+  // it shadows an existing variable, we have to restore it, so save it now.
+  AllocaInst *OldVal = NamedValues[VarName];
+  NamedValues[VarName] = Alloca;
+  Value *BodyVal = Body->codegen();
+  if (OldVal)
+    NamedValues[VarName] = OldVal;
+  else
+    NamedValues.erase(VarName);
+  if (!BodyVal)
+    return nullptr;
+  Builder->CreateBr(LoopBB);
+
+  Builder->SetInsertPoint(AfterBB);
+  Builder->CreateCall(getCoroIntrinsic(Intrinsic::coro_destroy), {Handle});
+
+  // for expr always returns 0.0.
+  return Constant::getNullValue(DoubleTy);
+}
+
+/// ====== //
+/// Arrays //
+/// ====== //
+
+/// UncheckedIndexes - subscripts which ForExprAST has proven in bounds for the
+/// loop version currently being generated, mapped to the loop's integer
+/// counter.
+static std::map<const IndexExprAST *, AllocaInst *> UncheckedIndexes;
+
+/// EmitBoundsCheck - branch to a call to meow_bounds_fail(Index, Len) unless
+/// InBounds holds.
+static void EmitBoundsCheck(Value *InBounds, Value *Index, Value *Len) {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *FailBB =
+      BasicBlock::Create(*TheContext, "bounds.fail", TheFunction);
+  BasicBlock *OkBB = BasicBlock::Create(*TheContext, "bounds.ok", TheFunction);
+  Builder->CreateCondBr(InBounds, OkBB, FailBB,
+                        MDBuilder(*TheContext).createBranchWeights(2000, 1));
+
+  Builder->SetInsertPoint(FailBB);
+  Type *Int64Ty = Builder->getInt64Ty();
+  FunctionCallee Fail = TheModule->getOrInsertFunction(
+      "meow_bounds_fail",
+      FunctionType::get(Builder->getVoidTy(), {Int64Ty, Int64Ty}, false));
+  if (auto *F = dyn_cast<Function>(Fail.getCallee())) {
+    F->setDoesNotReturn();
+    F->addFnAttr(Attribute::Cold);
+  }
+  Builder->CreateCall(Fail, {Index, Len});
+  Builder->CreateUnreachable();
+
+  Builder->SetInsertPoint(OkBB);
+}
+
+/// codegenArray - emit E, which must produce an array.
+static Value *codegenArray(ExprAST *E) {
+  Value *A = E->codegen();
+  if (A && !isArrayType(A->getType()))
+    return LogErrorV("subscripted value is not an array");
+  return A;
+}
+
+/// getArrayMemberElementType - The type of the elements that member i of an
+/// array of type Ty points to.
+static Type *getArrayMemberElementType(Type *Ty, unsigned i) {
+  if (RecordAST *R = getRecordOf(Ty))
+    return R->isSoA() ? getRecordFieldType(*R, i) : getRecordType(*R);
+  return Type::getDoubleTy(*TheContext);
+}
+
+bool IndexExprAST::codegenElement(Value *&A, Value *&I) {
+  KSDbgInfo.emitLocation(this);
+
+  A = codegenArray(Array.get());
+  if (!A)
+    return false;
+
+  auto Unchecked = UncheckedIndexes.find(this);
+  if (Unchecked != UncheckedIndexes.end()) {
+    I = Builder->CreateLoad(Builder->getInt64Ty(), Unchecked->second, "idx");
+  } else {
+    Value *IndexV = Index->codegen();
+    if (!IndexV || !CheckDouble(IndexV, "array index"))
+      return false;
+
+    // A negative index compares as a huge unsigned value, and NaN, which
+    // converts to 0, fails on its own.
+    I = EmitToInt(IndexV, Builder->getInt64Ty(), "idx");
+    Value *Len = EmitArrayLength(A);
+    EmitBoundsCheck(Builder->CreateAnd(Builder->CreateICmpULT(I, Len),
+                                       Builder->CreateFCmpORD(IndexV, IndexV),
+                                       "inbounds"),
+                    I, Len);
+  }
+
+  CurFunctionTouchesArrays = true;
+  return true;
+}
+
+Value *IndexExprAST::codegenAddress(bool ForStore) {
+  Value *A, *I;
+  if (!codegenElement(A, I))
+    return nullptr;
+  if (getRecordOf(A->getType()))
+    return LogErrorV("elements of record arrays are accessed by field");
+  if (ForStore && A->getType() == getConstArrayType())
+    return LogErrorV("cannot assign to an element of a const double[]");
+
+  Value *Data = Builder->CreateExtractValue(A, 0, "data");
+  return Builder->CreateInBoundsGEP(Builder->getDoubleTy(), Data, I, "elt");
+}
+
+Value *IndexExprAST::codegen() {
+  Value *Addr = codegenAddress();
+  if (!Addr)
+    return nullptr;
+  return Builder->CreateLoad(Builder->getDoubleTy(), Addr, "elt");
+}
+
+Value *SliceExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+
+  Value *A = codegenArray(Array.get());
+  if (!A)
+    return nullptr;
+  Type *Int64Ty = Builder->getInt64Ty();
+  Value *Len = EmitArrayLength(A);
+
+  Value *LoV = ConstantInt::get(Int64Ty, 0);
+  if (Lo) {
+    Value *V = Lo->codegen();
+    if (!V || !CheckDouble(V, "slice bound"))
       return nullptr;
+    LoV = EmitToInt(V, Int64Ty, "lo");
   }
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  Value *HiV = Len;
+  if (Hi) {
+    Value *V = Hi->codegen();
+    if (!V || !CheckDouble(V, "slice bound"))
+      return nullptr;
+    HiV = EmitToInt(V, Int64Ty, "hi");
+  }
+
+  // 0 <= lo <= hi <= len, with negative bounds comparing as huge values.
+  if (Lo || Hi) {
+    Value *HiOk = Builder->CreateICmpULE(HiV, Len);
+    Value *LoOk = Builder->CreateICmpULE(LoV, HiV);
+    EmitBoundsCheck(Builder->CreateAnd(HiOk, LoOk, "inbounds"),
+                    Builder->CreateSelect(HiOk, LoV, HiV), Len);
+  }
+
+  // Offset the data pointer, or each field's for a struct of arrays.
+  unsigned LenIdx = cast<StructType>(A->getType())->getNumElements() - 1;
+  Value *S = A;
+  for (unsigned i = 0; i != LenIdx; ++i) {
+    Value *Data = Builder->CreateExtractValue(A, i, "data");
+    Data = Builder->CreateInBoundsGEP(
+        getArrayMemberElementType(A->getType(), i), Data, LoV, "data");
+    S = Builder->CreateInsertValue(S, Data, i);
+  }
+  return Builder->CreateInsertValue(S, Builder->CreateSub(HiV, LoV), LenIdx,
+                                    "slice");
+}
+
+Value *FieldExprAST::codegenAddress(Type *&FieldTy) {
+  Value *A, *I;
+  if (!Element->codegenElement(A, I))
+    return nullptr;
+  RecordAST *R = getRecordOf(A->getType());
+  if (!R)
+    return LogErrorV("'.' applies only to arrays of records");
+  int Field = R->getFieldIndex(FieldName);
+  if (Field < 0)
+    return LogErrorV(("record '" + R->getName() + "' has no field '" +
+                      FieldName + "'")
+                         .c_str());
+
+  FieldTy = getRecordFieldType(*R, Field);
+  if (R->isSoA()) {
+    Value *Data = Builder->CreateExtractValue(A, Field, FieldName + ".data");
+    return Builder->CreateInBoundsGEP(FieldTy, Data, I, FieldName);
+  }
+  Value *Data = Builder->CreateExtractValue(A, 0, "data");
+  return Builder->CreateInBoundsGEP(getRecordType(*R), Data,
+                                    {I, Builder->getInt32(Field)}, FieldName);
+}
+
+Value *FieldExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  Type *FieldTy;
+  Value *Addr = codegenAddress(FieldTy);
+  if (!Addr)
+    return nullptr;
+  Value *V = Builder->CreateLoad(FieldTy, Addr, FieldName);
+  if (FieldTy->isIntegerTy())
+    V = Builder->CreateSIToFP(V, Builder->getDoubleTy(), FieldName);
+  return V;
+}
+
+/// mayAllocate - whether evaluating E may allocate arrays in this function's
+/// arena scope: it calls array() or a function returning an array.
+static bool mayAllocate(ExprAST &E) {
+  if (auto *C = dyn_cast<CallExprAST>(&E)) {
+    auto FI = FunctionProtos.find(C->getCallee());
+    if (FI != FunctionProtos.end()
+            ? StringRef(FI->second->getRetType()).endswith("[]")
+            : C->getCallee() == "array" ||
+                  StringRef(C->getCallee()).startswith("array:"))
+      return true;
+  }
+  bool Result = false;
+  E.forEachChild([&](ExprAST &Child) { Result = Result || mayAllocate(Child); });
+  return Result;
+}
+
+/// spawnsWithArrays - whether E spawns a call that is passed arrays, or calls
+/// a function returning a task that may have been. The task may still be
+/// reading them after a scope around E exits.
+static bool spawnsWithArrays(ExprAST &E) {
+  if (auto *S = dyn_cast<SpawnExprAST>(&E)) {
+    auto FI = FunctionProtos.find(S->getCall().getCallee());
+    if (FI != FunctionProtos.end())
+      for (unsigned i = 0, e = FI->second->getNumArgs(); i != e; ++i)
+        if (StringRef(FI->second->getArgType(i)).endswith("[]"))
+          return true;
+  } else if (auto *C = dyn_cast<CallExprAST>(&E)) {
+    auto FI = FunctionProtos.find(C->getCallee());
+    if (FI != FunctionProtos.end() && FI->second->getRetType() == "task")
+      return true;
+  }
+  bool Result = false;
+  E.forEachChild(
+      [&](ExprAST &Child) { Result = Result || spawnsWithArrays(Child); });
+  return Result;
+}
+
+/// EmitArenaMark - record the position of this thread's arena, to free the
+/// arrays allocated after it with EmitArenaRelease.
+static Value *EmitArenaMark() {
+  FunctionCallee Mark = TheModule->getOrInsertFunction(
+      "meow_arena_mark", FunctionType::get(Builder->getInt8PtrTy(), false));
+  return Builder->CreateCall(Mark, {}, "arena.mark");
+}
+
+static void EmitArenaRelease(Value *Mark) {
+  FunctionCallee Release = TheModule->getOrInsertFunction(
+      "meow_arena_release",
+      FunctionType::get(Builder->getVoidTy(), {Builder->getInt8PtrTy()},
+                        false));
+  Builder->CreateCall(Release, {Mark});
+}
+
+/// storesOuterArray - whether the body of a var block assigns to an array
+/// variable from an enclosing scope, letting arrays it allocates escape.
+static bool storesOuterArray(VarExprAST &E) {
+  std::set<std::string> Own;
+  for (auto &Var : E.getVarNames())
+    Own.insert(Var.first);
+
+  std::function<bool(ExprAST &)> Stores = [&](ExprAST &Sub) {
+    if (auto *B = dyn_cast<BinaryExprAST>(&Sub))
+      if (auto *LHSE = dyn_cast<VariableExprAST>(B->getLHS())) {
+        auto V = NamedValues.find(LHSE->getName());
+        if (B->getOp() == '=' && !Own.count(LHSE->getName()) &&
+            V != NamedValues.end() && V->second &&
+            isArrayType(V->second->getAllocatedType()))
+          return true;
+      }
+    bool Result = false;
+    Sub.forEachChild([&](ExprAST &Child) { Result = Result || Stores(Child); });
+    return Result;
+  };
+  return Stores(E);
 }
 
 Value *VarExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
   std::vector<AllocaInst *> OldBindings;
 
   Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
+  // Arrays allocated in the block are freed when it exits, unless they
+  // escape through its value or an assignment to an enclosing variable, the
+  // block yields and so may outlive arrays its consumer allocates, or it
+  // hands arrays to a task that may outlive it.
+  Value *ArenaMark = nullptr;
+  if (ArenaScopes && mayAllocate(*this) && !storesOuterArray(*this) &&
+      !containsYield(*this) && !spawnsWithArrays(*this))
+    ArenaMark = EmitArenaMark();
+
   // Register all variables and emit their initializer.
   for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
     const std::string &VarName = VarNames[i].first;
@@ -907,16 +4344,26 @@ Value *VarExprAST::codegen() {
     // like this:
     //  var a = 1 in
     //    var a = a in ...   # refers to outer 'a'.
+    Type *VarTy = nullptr;
+    if (!VarTypes[i].empty() && !(VarTy = getMeowType(VarTypes[i])))
+      return LogErrorV(("Unknown type '" + VarTypes[i] + "'").c_str());
+
     Value *InitVal;
     if (Init) {
       InitVal = Init->codegen();
       if (!InitVal)
         return nullptr;
+      if (VarTy &&
+          !(InitVal = CoerceToType(InitVal, VarTy, "initializer of '" +
+                                                       VarName + "'")))
+        return nullptr;
     } else { // If not specified, use 0.0.
-      InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
+      InitVal = Constant::getNullValue(VarTy ? VarTy
+                                             : Type::getDoubleTy(*TheContext));
     }
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    AllocaInst *Alloca =
+        CreateEntryBlockAlloca(TheFunction, VarName, InitVal->getType());
     Builder->CreateStore(InitVal, Alloca);
 
     // Remember the old variable binding so that we can restore the binding when
@@ -932,6 +4379,9 @@ Value *VarExprAST::codegen() {
   if (!BodyVal)
     return nullptr;
 
+  if (ArenaMark && !isArrayType(BodyVal->getType()))
+    EmitArenaRelease(ArenaMark);
+
   // Pop all our variables from scope.
   for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
     NamedValues[VarNames[i].first] = OldBindings[i];
@@ -942,9 +4392,22 @@ Value *VarExprAST::codegen() {
 
 Function *PrototypeAST::codegen() {
   // Make the function type:  double(double,double) etc.
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-  FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+  std::vector<Type *> ArgTys;
+  for (const std::string &ArgType : ArgTypes) {
+    ArgTys.push_back(getMeowType(ArgType));
+    if (!ArgTys.back()) {
+      LogError(("Unknown type '" + ArgType + "'").c_str());
+      return nullptr;
+    }
+  }
+  // A gen function returns the handle of its coroutine.
+  Type *RetTy = IsGenerator ? Type::getInt8PtrTy(*TheContext)
+                            : getMeowType(RetType);
+  if (!RetTy) {
+    LogError(("Unknown type '" + RetType + "'").c_str());
+    return nullptr;
+  }
+  FunctionType *FT = FunctionType::get(RetTy, ArgTys, false);
 
   Function *F =
       Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
@@ -957,6 +4420,111 @@ Function *PrototypeAST::codegen() {
   return F;
 }
 
+/// getFastMathFlags - The fast-math flags for code in function P: those given
+/// on the command line, or all of them if P is declared 'fastmath'.
+static FastMathFlags getFastMathFlags(const PrototypeAST &P) {
+  FastMathFlags FMF;
+  if (*FastMath || P.isFastMath()) {
+    FMF.setFast();
+    return FMF;
+  }
+  FMF.setNoNaNs(NoHonorNaNs);
+  FMF.setNoInfs(NoHonorInfinities);
+  FMF.setNoSignedZeros(NoSignedZeros);
+  FMF.setAllowReassoc(AssociativeMath);
+  FMF.setAllowContract(FPContract == FPC_Fast);
+  return FMF;
+}
+
+/// setFPFunctionAttributes - Mirror the fast-math flags of F's code in its
+/// function attributes, which is where the backend looks for them.
+static void setFPFunctionAttributes(Function *F, FastMathFlags FMF) {
+  if (FMF.noNaNs())
+    F->addFnAttr("no-nans-fp-math", "true");
+  if (FMF.noInfs())
+    F->addFnAttr("no-infs-fp-math", "true");
+  if (FMF.noSignedZeros())
+    F->addFnAttr("no-signed-zeros-fp-math", "true");
+  if (FMF.isFast())
+    F->addFnAttr("unsafe-fp-math", "true");
+}
+
+/// EmitMemoWrapper - Fill in the body of a 'memo' function F, which looks its
+/// arguments up in a libmeow memo table and only calls Body on a miss:
+///   table = load atomic @F.memo.table  ; created on first use, once
+///   if (meow_memo_get(table, args, &result)) return result
+///   result = Body(args...)
+///   meow_memo_put(table, args, result)
+static void EmitMemoWrapper(Function *F, Function *Body) {
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *Int8PtrTy = Type::getInt8PtrTy(*TheContext);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  Type *Int32Ty = Type::getInt32Ty(*TheContext);
+  Type *DoublePtrTy = DoubleTy->getPointerTo();
+
+  FunctionCallee MemoInit = TheModule->getOrInsertFunction(
+      "meow_memo_init",
+      FunctionType::get(Int8PtrTy, {Int8PtrTy->getPointerTo(), Int64Ty},
+                        false));
+  FunctionCallee MemoGet = TheModule->getOrInsertFunction(
+      "meow_memo_get",
+      FunctionType::get(Int32Ty, {Int8PtrTy, DoublePtrTy, DoublePtrTy}, false));
+  FunctionCallee MemoPut = TheModule->getOrInsertFunction(
+      "meow_memo_put",
+      FunctionType::get(Type::getVoidTy(*TheContext),
+                        {Int8PtrTy, DoublePtrTy, DoubleTy}, false));
+
+  auto *Table = new GlobalVariable(
+      *TheModule, Int8PtrTy, false, GlobalValue::InternalLinkage,
+      ConstantPointerNull::get(cast<PointerType>(Int8PtrTy)),
+      F->getName() + ".memo.table");
+
+  BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", F);
+  BasicBlock *InitBB = BasicBlock::Create(*TheContext, "memo.init", F);
+  BasicBlock *LookupBB = BasicBlock::Create(*TheContext, "memo.lookup", F);
+  BasicBlock *HitBB = BasicBlock::Create(*TheContext, "memo.hit", F);
+  BasicBlock *MissBB = BasicBlock::Create(*TheContext, "memo.miss", F);
+
+  // Spill the arguments into a contiguous key for the runtime to hash.
+  Builder->SetInsertPoint(EntryBB);
+  unsigned NumArgs = F->arg_size();
+  Value *Key = Builder->CreateAlloca(
+      DoubleTy, ConstantInt::get(Int64Ty, std::max(NumArgs, 1u)), "memo.key");
+  Value *Result = Builder->CreateAlloca(DoubleTy, nullptr, "memo.result");
+  std::vector<Value *> ArgsV;
+  for (auto &Arg : F->args()) {
+    Value *Slot =
+        Builder->CreateConstInBoundsGEP1_64(DoubleTy, Key, Arg.getArgNo());
+    Builder->CreateStore(&Arg, Slot);
+    ArgsV.push_back(&Arg);
+  }
+  // Tasks may call F concurrently, so the table is read with acquire and
+  // created by the runtime, which settles any race to do so.
+  LoadInst *Tbl = Builder->CreateLoad(Int8PtrTy, Table, "memo.tbl");
+  Tbl->setAtomic(AtomicOrdering::Acquire);
+  Builder->CreateCondBr(Builder->CreateIsNull(Tbl), InitBB, LookupBB);
+
+  Builder->SetInsertPoint(InitBB);
+  Value *NewTbl = Builder->CreateCall(
+      MemoInit, {Table, ConstantInt::get(Int64Ty, NumArgs)}, "memo.new");
+  Builder->CreateBr(LookupBB);
+
+  Builder->SetInsertPoint(LookupBB);
+  PHINode *T = Builder->CreatePHI(Int8PtrTy, 2, "memo.t");
+  T->addIncoming(Tbl, EntryBB);
+  T->addIncoming(NewTbl, InitBB);
+  Value *Hit = Builder->CreateCall(MemoGet, {T, Key, Result}, "memo.found");
+  Builder->CreateCondBr(Builder->CreateIsNotNull(Hit), HitBB, MissBB);
+
+  Builder->SetInsertPoint(HitBB);
+  Builder->CreateRet(Builder->CreateLoad(DoubleTy, Result, "memo.cached"));
+
+  Builder->SetInsertPoint(MissBB);
+  Value *V = Builder->CreateCall(Body, ArgsV, "memo.val");
+  Builder->CreateCall(MemoPut, {T, Key, V});
+  Builder->CreateRet(V);
+}
+
 Function *FunctionAST::codegen() {
   // Transfer ownership of the prototype to the FunctionProtos map, but keep a
   // reference to it for use below.
@@ -970,15 +4538,42 @@ Function *FunctionAST::codegen() {
   if (P.isBinaryOp())
     BinOpPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
 
+  // A memoized function's body is generated into a private function, and the
+  // public symbol becomes a wrapper that consults the cache first. Recursive
+  // calls go through the wrapper, so they're memoized too.
+  Function *BodyFunction = TheFunction;
+  if (P.isMemo()) {
+    BodyFunction = Function::Create(TheFunction->getFunctionType(),
+                                    Function::InternalLinkage,
+                                    P.getName() + ".memo.body", TheModule.get());
+    for (unsigned i = 0, e = TheFunction->arg_size(); i != e; ++i)
+      BodyFunction->getArg(i)->setName(TheFunction->getArg(i)->getName());
+  }
+
   // Create a new basic block to start insertion into.
-  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", BodyFunction);
   Builder->SetInsertPoint(BB);
+  DISubprogram *SP = KSDbgInfo.beginFunction(BodyFunction, P.getLine());
+
+  NextProfileSite = 0;
+  std::string EntryKey(BodyFunction->getName());
+  EmitProfileCounter(EntryKey);
+  EmitInstEntry(BodyFunction, P.isGenerator());
+  if (uint64_t Count = getProfileCount(EntryKey))
+    BodyFunction->setEntryCount(Count);
+
+  // The body of a gen function starts running on the first resume, after the
+  // arguments are saved in its frame.
+  GeneratorState Gen;
+  if (P.isGenerator())
+    EmitGeneratorBegin(BodyFunction, Gen);
 
   // Record the function arguments in the NamedValues map.
   NamedValues.clear();
-  for (auto &Arg : TheFunction->args()) {
+  for (auto &Arg : BodyFunction->args()) {
     // Create an alloca for this variable.
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+    AllocaInst *Alloca =
+        CreateEntryBlockAlloca(BodyFunction, Arg.getName(), Arg.getType());
 
     // Store the initial value into the alloca.
     Builder->CreateStore(&Arg, Alloca);
@@ -987,17 +4582,69 @@ Function *FunctionAST::codegen() {
     NamedValues[std::string(Arg.getName())] = Alloca;
   }
 
-  if (Value *RetVal = Body->codegen()) {
+  FastMathFlags FMF = getFastMathFlags(P);
+  setFPFunctionAttributes(BodyFunction, FMF);
+  Builder->setFastMathFlags(FMF);
+
+  // Free the arrays the call allocates when it returns, unless it returns
+  // one; then they belong to the caller's scope. A generator's arrays belong
+  // to its consumer's, as the consumer allocates while it is suspended, and
+  // those of a call that spawns tasks with arrays to its caller's.
+  Value *ArenaMark = nullptr;
+  if (ArenaScopes && !isArrayType(BodyFunction->getReturnType()) &&
+      !P.isGenerator() && mayAllocate(*Body) && !spawnsWithArrays(*Body))
+    ArenaMark = EmitArenaMark();
+
+  CurFunction = &P;
+  CurFunctionTouchesMemory = false;
+  CurFunctionTouchesArrays = false;
+  Value *RetVal = Body->codegen();
+  CurFunction = nullptr;
+  Builder->clearFastMathFlags();
+  if (RetVal && P.isGenerator())
+    RetVal = EmitGeneratorEnd();
+  else if (RetVal)
+    RetVal = CoerceToType(RetVal, BodyFunction->getReturnType(),
+                          "result of '" + P.getName() + "'");
+  CurGenerator = nullptr;
+
+  if (RetVal) {
     // Finish off the function.
+    if (ArenaMark)
+      EmitArenaRelease(ArenaMark);
     Builder->CreateRet(RetVal);
 
+    if (P.isMemo()) {
+      DISubprogram *WrapperSP =
+          KSDbgInfo.beginFunction(TheFunction, P.getLine());
+      EmitMemoWrapper(TheFunction, BodyFunction);
+      KSDbgInfo.endFunction(WrapperSP);
+    }
+    KSDbgInfo.endFunction(SP);
+
+    // Pure functions don't read or write memory their callers can see. Those
+    // that are (or call) memoized functions only touch the runtime's caches.
+    // Those that use arrays may touch memory reachable from their arguments.
+    if (P.isPure()) {
+      TheFunction->setDoesNotThrow();
+      if (P.isMemo() || (CurFunctionTouchesMemory && !CurFunctionTouchesArrays))
+        TheFunction->setOnlyAccessesInaccessibleMemory();
+      else if (!CurFunctionTouchesArrays)
+        TheFunction->setDoesNotAccessMemory();
+    }
+
     // Validate the generated code, checking for consistency.
+    TimeRegion Verify(TP_Verify);
+    verifyFunction(*BodyFunction);
     verifyFunction(*TheFunction);
 
     return TheFunction;
   }
 
   // Error reading body, remove function.
+  KSDbgInfo.endFunction(SP);
+  if (BodyFunction != TheFunction)
+    BodyFunction->eraseFromParent();
   TheFunction->eraseFromParent();
 
   if (P.isBinaryOp())
@@ -1024,93 +4671,654 @@ Function *FunctionAST::codegen() {
 //   store nextvar -> var
 //   br endcond, loop, endloop
 // outloop:
+/// findUncheckedIndexes - find the subscripts a[i] in the body of an innermost
+/// counted loop 'for i = start, i < end, step' which the bounds of the loop
+/// can prove in bounds: a, i and end must not change in the body, and step
+/// must be a positive integer constant.
+bool ForExprAST::findUncheckedIndexes(std::vector<IndexExprAST *> &Indexes) {
+  auto *Cond = dyn_cast<BinaryExprAST>(End.get());
+  if (!Cond || Cond->getOp() != '<')
+    return false;
+  auto *CondVar = dyn_cast<VariableExprAST>(Cond->getLHS());
+  if (!CondVar || CondVar->getName() != VarName)
+    return false;
+  if (Step) {
+    auto *StepC = dyn_cast<NumberExprAST>(Step.get());
+    if (!StepC || StepC->getValue() < 1 || StepC->getValue() > 0x1p52 ||
+        StepC->getValue() != std::floor(StepC->getValue()))
+      return false;
+  }
+
+  // Collect the variables the body assigns or rebinds, and its subscripts.
+  std::set<std::string> Written;
+  std::vector<IndexExprAST *> Candidates;
+  bool HasInnerLoop = false;
+  std::function<void(ExprAST &)> Scan = [&](ExprAST &E) {
+    if (isa<ForExprAST>(E)) {
+      HasInnerLoop = true;
+    } else if (auto *V = dyn_cast<VarExprAST>(&E)) {
+      for (auto &Var : V->getVarNames())
+        Written.insert(Var.first);
+    } else if (auto *B = dyn_cast<BinaryExprAST>(&E)) {
+      if (auto *LHSE = dyn_cast<VariableExprAST>(B->getLHS()))
+        if (B->getOp() == '=')
+          Written.insert(LHSE->getName());
+    } else if (auto *I = dyn_cast<IndexExprAST>(&E)) {
+      auto *IndexVar = dyn_cast<VariableExprAST>(I->getIndex());
+      if (isa<VariableExprAST>(I->getArray()) && IndexVar &&
+          IndexVar->getName() == VarName)
+        Candidates.push_back(I);
+    }
+    E.forEachChild(Scan);
+  };
+  Scan(*Body);
+  if (HasInnerLoop || Written.count(VarName))
+    return false;
+
+  // The end bound is evaluated once up front, so it must be a side-effect
+  // free expression of variables the loop leaves alone.
+  std::function<bool(ExprAST &)> IsInvariant = [&](ExprAST &E) {
+    if (isa<NumberExprAST>(E))
+      return true;
+    if (auto *V = dyn_cast<VariableExprAST>(&E))
+      return V->getName() != VarName && !Written.count(V->getName());
+    if (auto *B = dyn_cast<BinaryExprAST>(&E))
+      return (B->getOp() == '+' || B->getOp() == '-' || B->getOp() == '*') &&
+             IsInvariant(*B->getLHS()) && IsInvariant(*B->getRHS());
+    if (auto *C = dyn_cast<CallExprAST>(&E))
+      return C->getCallee() == "len" && !getFunction("len") &&
+             C->getArgs().size() == 1 && IsInvariant(*C->getArgs()[0]);
+    return false;
+  };
+  if (!IsInvariant(*Cond->getRHS()))
+    return false;
+
+  for (IndexExprAST *I : Candidates)
+    if (!Written.count(cast<VariableExprAST>(I->getArray())->getName()))
+      Indexes.push_back(I);
+  return !Indexes.empty();
+}
+
 Value *ForExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
   Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
   // Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName,
+                                              Type::getDoubleTy(*TheContext));
 
   // Emit the start code first, without 'variable' in scope.
   Value *StartVal = Start->codegen();
-  if (!StartVal)
+  if (!StartVal || !(StartVal = CoerceToType(StartVal, Alloca->getAllocatedType(),
+                                             "start of for loop")))
     return nullptr;
 
   // Store the value into the alloca.
   Builder->CreateStore(StartVal, Alloca);
 
+  std::string Site = ProfileSiteKey("for");
+
+  // If some subscripts can be proven in bounds, version the loop: guard once
+  // on the loop bounds, then run a copy of the loop without their checks. The
+  // copy counts with an integer, so its trip count and subscripts are plain
+  // affine integer expressions that the loop vectorizer understands.
+  std::vector<IndexExprAST *> Unchecked;
+  if (!findUncheckedIndexes(Unchecked))
+    return codegenLoop(Alloca, Site);
+
+  // The body runs for i = start and for each i with i - step < end. With an
+  // integral start and step, every i is an integer and the loop continues
+  // while i < ceil(end), so i <= ceil(end) + step - 1. So each a[i] is in
+  // bounds if start is nonnegative and below len(a), and ceil(end) + step <=
+  // len(a). NaNs fail every test.
+  Type *DoubleTy = Builder->getDoubleTy();
+  double StepC = Step ? cast<NumberExprAST>(Step.get())->getValue() : 1.0;
+  Value *EndV = cast<BinaryExprAST>(End.get())->getRHS()->codegen();
+  if (!EndV || !CheckDouble(EndV, "for loop condition"))
+    return nullptr;
+  Value *CeilEnd = Builder->CreateUnaryIntrinsic(Intrinsic::ceil, EndV);
+  Value *Limit = Builder->CreateFAdd(CeilEnd, ConstantFP::get(DoubleTy, StepC),
+                                     "limit");
+  Value *InBounds = Builder->CreateAnd(
+      Builder->CreateFCmpOEQ(
+          Builder->CreateUnaryIntrinsic(Intrinsic::floor, StartVal), StartVal),
+      Builder->CreateFCmpOGE(StartVal, ConstantFP::get(DoubleTy, 0.0)));
+  std::set<std::string> Arrays;
+  for (IndexExprAST *I : Unchecked) {
+    if (!Arrays.insert(cast<VariableExprAST>(I->getArray())->getName()).second)
+      continue;
+    Value *A = I->getArray()->codegen();
+    if (!A || !isArrayType(A->getType()))
+      return LogErrorV("subscripted value is not an array");
+    Value *Len = Builder->CreateSIToFP(EmitArrayLength(A), DoubleTy);
+    InBounds = Builder->CreateAnd(InBounds,
+                                  Builder->CreateFCmpOLT(StartVal, Len));
+    InBounds = Builder->CreateAnd(InBounds, Builder->CreateFCmpOLE(Limit, Len),
+                                  "inbounds");
+  }
+
+  BasicBlock *UncheckedBB =
+      BasicBlock::Create(*TheContext, "loop.unchecked", TheFunction);
+  BasicBlock *CheckedBB = BasicBlock::Create(*TheContext, "loop.checked");
+  BasicBlock *DoneBB = BasicBlock::Create(*TheContext, "loop.done");
+  Builder->CreateCondBr(InBounds, UncheckedBB, CheckedBB);
+
+  // As i >= 0, a negative end may be clamped to 0 to keep it in range.
+  Builder->SetInsertPoint(UncheckedBB);
+  Type *Int64Ty = Builder->getInt64Ty();
+  AllocaInst *Counter =
+      CreateEntryBlockAlloca(TheFunction, VarName + ".idx", Int64Ty);
+  Builder->CreateStore(Builder->CreateFPToSI(StartVal, Int64Ty), Counter);
+  Value *CounterEnd = Builder->CreateFPToSI(
+      Builder->CreateMaxNum(CeilEnd, ConstantFP::get(DoubleTy, 0.0)), Int64Ty,
+      "end.idx");
+  for (IndexExprAST *I : Unchecked)
+    UncheckedIndexes[I] = Counter;
+  Value *Result = codegenLoop(Alloca, Site, Counter, CounterEnd);
+  for (IndexExprAST *I : Unchecked)
+    UncheckedIndexes.erase(I);
+  if (!Result)
+    return nullptr;
+  Builder->CreateBr(DoneBB);
+
+  TheFunction->getBasicBlockList().push_back(CheckedBB);
+  Builder->SetInsertPoint(CheckedBB);
+  if (!codegenLoop(Alloca, Site))
+    return nullptr;
+  Builder->CreateBr(DoneBB);
+
+  TheFunction->getBasicBlockList().push_back(DoneBB);
+  Builder->SetInsertPoint(DoneBB);
+  return Result;
+}
+
+/// codegenLoop - emit the loop itself, once the induction variable has been
+/// initialized. If Counter is given, the loop is driven by that integer copy
+/// of the variable instead, running while it is below CounterEnd.
+Value *ForExprAST::codegenLoop(AllocaInst *Alloca, const std::string &Site,
+                               AllocaInst *Counter, Value *CounterEnd) {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  AllocaInst *Trips = nullptr;
+  if (isInstrumenting()) {
+    Trips = CreateEntryBlockAlloca(TheFunction, "inst.trips", Int64Ty);
+    Builder->CreateStore(ConstantInt::get(Int64Ty, 0), Trips);
+  }
+
   // Make the new basic block for the loop header, inserting after current
   // block.
   BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
 
-  // Insert an explicit fall through from the current block to the LoopBB.
-  Builder->CreateBr(LoopBB);
+  // Insert an explicit fall through from the current block to the LoopBB.
+  Builder->CreateBr(LoopBB);
+
+  // Start insertion in LoopBB.
+  Builder->SetInsertPoint(LoopBB);
+
+  EmitProfileCounter(Site + ":body");
+  if (Trips)
+    Builder->CreateStore(
+        Builder->CreateAdd(Builder->CreateLoad(Int64Ty, Trips, "trips"),
+                           ConstantInt::get(Int64Ty, 1)),
+        Trips);
+
+  if (Counter)
+    Builder->CreateStore(
+        Builder->CreateSIToFP(Builder->CreateLoad(Int64Ty, Counter, "idx"),
+                              Type::getDoubleTy(*TheContext)),
+        Alloca);
+
+  // Within the loop, the variable is defined equal to the PHI node.  If it
+  // shadows an existing variable, we have to restore it, so save it now.
+  AllocaInst *OldVal = NamedValues[VarName];
+  NamedValues[VarName] = Alloca;
+
+  // Emit the body of the loop.  This, like any other expr, can change the
+  // current BB.  Note that we ignore the value computed by the body, but don't
+  // allow an error.
+  if (!Body->codegen())
+    return nullptr;
+
+  Value *EndCond;
+  if (Counter) {
+    // The step and end are constant and invariant here; see codegen().
+    Value *CurIdx = Builder->CreateLoad(Int64Ty, Counter, "idx");
+    EndCond = Builder->CreateICmpSLT(CurIdx, CounterEnd, "loopcond");
+    double StepC = Step ? cast<NumberExprAST>(Step.get())->getValue() : 1.0;
+    Builder->CreateStore(
+        Builder->CreateNSWAdd(CurIdx, ConstantInt::get(Int64Ty, StepC),
+                              "nextidx"),
+        Counter);
+  } else {
+    // Emit the step value.
+    Value *StepVal = nullptr;
+    if (Step) {
+      StepVal = Step->codegen();
+      if (!StepVal || !CheckDouble(StepVal, "step of for loop"))
+        return nullptr;
+    } else {
+      // If not specified, use 1.0.
+      StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+    }
+
+    // Compute the end condition.
+    EndCond = End->codegen();
+    if (!EndCond || !CheckDouble(EndCond, "for loop condition"))
+      return nullptr;
+
+    // Reload, increment, and restore the alloca.  This handles the case where
+    // the body of the loop mutates the variable.
+    Value *CurVar = Builder->CreateLoad(Type::getDoubleTy(*TheContext), Alloca,
+                                        VarName.c_str());
+    Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+    Builder->CreateStore(NextVar, Alloca);
+
+    // Convert condition to a bool by comparing non-equal to 0.0.
+    EndCond = Builder->CreateFCmpONE(
+        EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+  }
+
+  // Create the "after loop" block and insert it.
+  BasicBlock *AfterBB =
+      BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+
+  // Insert the conditional branch into the end of LoopEndBB. The loop is
+  // entered once per exit, so the backedge is taken (body - exit) times.
+  uint64_t BodyCount = getProfileCount(Site + ":body");
+  uint64_t ExitCount = getProfileCount(Site + ":exit");
+  Builder->CreateCondBr(
+      EndCond, LoopBB, AfterBB,
+      getProfileBranchWeights(BodyCount - std::min(BodyCount, ExitCount),
+                              ExitCount));
+
+  // Any new code will be inserted in AfterBB.
+  Builder->SetInsertPoint(AfterBB);
+  EmitProfileCounter(Site + ":exit");
+  if (Trips)
+    EmitInstLoopExit(Site, Builder->CreateLoad(Int64Ty, Trips, "trips"));
+
+  // Restore the unshadowed variable.
+  if (OldVal)
+    NamedValues[VarName] = OldVal;
+  else
+    NamedValues.erase(VarName);
+
+  // for expr always returns 0.0.
+  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+}
+
+/// findCaptures - collect the enclosing variables the body of the loop uses,
+/// which are copied into the outlined loop. Iterations may run at the same
+/// time, so the body may not assign the loop variable or a captured variable,
+/// though it may assign the elements of a captured array.
+bool ParForExprAST::findCaptures(std::vector<std::string> &Captures) {
+  // The variables bound inside the body, innermost last; the loop variable is
+  // first.
+  std::vector<std::string> Bound = {Loop->getVarName()};
+  std::set<std::string> Seen;
+
+  std::function<bool(ExprAST &)> Walk = [&](ExprAST &E) {
+    if (auto *V = dyn_cast<VariableExprAST>(&E)) {
+      const std::string &Name = V->getName();
+      auto NI = NamedValues.find(Name);
+      if (NI != NamedValues.end() && NI->second && Name != LoName &&
+          Name != LastName &&
+          std::find(Bound.begin(), Bound.end(), Name) == Bound.end() &&
+          Seen.insert(Name).second)
+        Captures.push_back(Name);
+      return true;
+    }
+
+    if (auto *B = dyn_cast<BinaryExprAST>(&E)) {
+      auto *LHSE = dyn_cast<VariableExprAST>(B->getLHS());
+      if (B->getOp() == '=' && LHSE) {
+        auto BI = std::find(Bound.rbegin(), Bound.rend(), LHSE->getName());
+        if (BI == Bound.rend()) {
+          LogError(("parfor body assigns to '" + LHSE->getName() +
+                    "' from the enclosing scope")
+                       .c_str());
+          return false;
+        }
+        if (BI == Bound.rend() - 1) {
+          LogError(("parfor body assigns to its loop variable '" +
+                    LHSE->getName() + "'")
+                       .c_str());
+          return false;
+        }
+      }
+    }
+
+    if (auto *V = dyn_cast<VarExprAST>(&E)) {
+      size_t Depth = Bound.size();
+      for (auto &Var : V->getVarNames()) {
+        if (Var.second && !Walk(*Var.second))
+          return false;
+        Bound.push_back(Var.first);
+      }
+      bool OK = Walk(*V->getBody());
+      Bound.resize(Depth);
+      return OK;
+    }
+
+    if (auto *F = dyn_cast<ForInExprAST>(&E)) {
+      if (!Walk(*F->getGen()))
+        return false;
+      Bound.push_back(F->getVarName());
+      bool OK = Walk(*F->getBody());
+      Bound.pop_back();
+      return OK;
+    }
+
+    if (auto *F = dyn_cast<ForExprAST>(&E)) {
+      if (!Walk(*F->getStart()))
+        return false;
+      Bound.push_back(F->getVarName());
+      bool OK = Walk(*F->getEnd()) && (!F->getStep() || Walk(*F->getStep())) &&
+                Walk(*F->getBody());
+      Bound.pop_back();
+      return OK;
+    }
+
+    bool OK = true;
+    E.forEachChild([&](ExprAST &Child) { OK = OK && Walk(Child); });
+    return OK;
+  };
+  return Walk(*Loop->getBody());
+}
+
+/// isBuiltinReduction - whether Op is one of the reduction operators parfor
+/// knows the identity of.
+static bool isBuiltinReduction(const std::string &Op) {
+  return Op == "+" || Op == "*" || Op == "min" || Op == "max";
+}
+
+/// EmitReduceCombine - combine two partial results of a parfor reduction.
+static Value *EmitReduceCombine(const std::string &Op, Value *L, Value *R) {
+  if (Op == "+")
+    return Builder->CreateFAdd(L, R, "reduce.add");
+  if (Op == "*")
+    return Builder->CreateFMul(L, R, "reduce.mul");
+  if (Op == "min")
+    return Builder->CreateBinaryIntrinsic(Intrinsic::minnum, L, R, nullptr,
+                                          "reduce.min");
+  if (Op == "max")
+    return Builder->CreateBinaryIntrinsic(Intrinsic::maxnum, L, R, nullptr,
+                                          "reduce.max");
+
+  Function *F = getFunction("binary" + Op);
+  if (!CheckPureCall(F))
+    return nullptr;
+  return Builder->CreateCall(F, {L, R}, "reduce.op");
+}
 
-  // Start insertion in LoopBB.
-  Builder->SetInsertPoint(LoopBB);
+/// getReduceCombineFunction - the function the runtime calls to combine the
+/// partial results of a parfor reduction: the operator itself if the user
+/// defined it, or an internal wrapper around a builtin one.
+static Function *getReduceCombineFunction(const std::string &Op) {
+  if (!isBuiltinReduction(Op))
+    return getFunction("binary" + Op);
+
+  std::string Name = "reduce." + std::string(Op == "+"   ? "add"
+                                             : Op == "*" ? "mul"
+                                                         : Op);
+  if (Function *F = TheModule->getFunction(Name))
+    return F;
 
-  // Within the loop, the variable is defined equal to the PHI node.  If it
-  // shadows an existing variable, we have to restore it, so save it now.
-  AllocaInst *OldVal = NamedValues[VarName];
-  NamedValues[VarName] = Alloca;
+  Type *DoubleTy = Builder->getDoubleTy();
+  Function *F = Function::Create(
+      FunctionType::get(DoubleTy, {DoubleTy, DoubleTy}, false),
+      Function::InternalLinkage, Name, TheModule.get());
+  IRBuilderBase::InsertPointGuard Guard(*Builder);
+  IRBuilderBase::FastMathFlagGuard FMFGuard(*Builder);
+  Builder->clearFastMathFlags();
+  Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", F));
+  Builder->SetCurrentDebugLocation(DebugLoc());
+  Builder->CreateRet(EmitReduceCombine(Op, F->getArg(0), F->getArg(1)));
+  verifyFunction(*F);
+  return F;
+}
 
-  // Emit the body of the loop.  This, like any other expr, can change the
-  // current BB.  Note that we ignore the value computed by the body, but don't
-  // allow an error.
-  if (!Body->codegen())
+Value *ReduceStepExprAST::codegen() {
+  Value *V = Operand->codegen();
+  if (!V || !CheckDouble(V, "parfor reduction"))
     return nullptr;
 
-  // Emit the step value.
-  Value *StepVal = nullptr;
-  if (Step) {
-    StepVal = Step->codegen();
-    if (!StepVal)
+  Type *DoubleTy = Builder->getDoubleTy();
+  AllocaInst *Acc = NamedValues[ParForExprAST::AccName];
+  auto FI = NamedValues.find(ParForExprAST::FirstName);
+  if (FI == NamedValues.end()) {
+    Value *R =
+        EmitReduceCombine(Op, Builder->CreateLoad(DoubleTy, Acc, "acc"), V);
+    if (!R)
       return nullptr;
-  } else {
-    // If not specified, use 1.0.
-    StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+    Builder->CreateStore(R, Acc);
+    return Constant::getNullValue(DoubleTy);
   }
 
-  // Compute the end condition.
-  Value *EndCond = End->codegen();
-  if (!EndCond)
+  // The operator has no identity, so the first value starts the accumulator.
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *FirstBB = BasicBlock::Create(*TheContext, "reduce.first",
+                                           TheFunction);
+  BasicBlock *StepBB = BasicBlock::Create(*TheContext, "reduce.step",
+                                          TheFunction);
+  BasicBlock *ContBB = BasicBlock::Create(*TheContext, "reduce.cont",
+                                          TheFunction);
+  Builder->CreateCondBr(
+      Builder->CreateLoad(Builder->getInt1Ty(), FI->second, "first"), FirstBB,
+      StepBB);
+
+  Builder->SetInsertPoint(FirstBB);
+  Builder->CreateStore(V, Acc);
+  Builder->CreateStore(Builder->getFalse(), FI->second);
+  Builder->CreateBr(ContBB);
+
+  Builder->SetInsertPoint(StepBB);
+  Value *R =
+      EmitReduceCombine(Op, Builder->CreateLoad(DoubleTy, Acc, "acc"), V);
+  if (!R)
     return nullptr;
+  Builder->CreateStore(R, Acc);
+  Builder->CreateBr(ContBB);
 
-  // Reload, increment, and restore the alloca.  This handles the case where
-  // the body of the loop mutates the variable.
-  Value *CurVar = Builder->CreateLoad(Type::getDoubleTy(*TheContext), Alloca,
-                                      VarName.c_str());
-  Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
-  Builder->CreateStore(NextVar, Alloca);
+  Builder->SetInsertPoint(ContBB);
+  return Constant::getNullValue(DoubleTy);
+}
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  EndCond = Builder->CreateFCmpONE(
-      EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+// Output parfor i = start, end in body as:
+//   env = { captured variables... }
+//   meow_parfor(ceil(start), ceil(end), f.parfor, &env)
+//
+// define internal void @f.parfor(i64 lo, i64 hi, i8* env) {
+//   load the captured variables from env
+//   for i = lo, i < hi - 1 in body
+// }
+//
+// and parfor i = start, end reduce op in body as:
+//   meow_parfor_reduce(ceil(start), ceil(end), f.parfor, &env, combine, empty)
+//
+// define internal double @f.parfor(i64 lo, i64 hi, i8* env) {
+//   load the captured variables from env
+//   acc = identity
+//   for i = lo, i < hi - 1 in acc = acc op body
+//   ret acc
+// }
+//
+// The runtime cuts the range into blocks that depend only on its length and
+// combines their results in a fixed order, so the result does not depend on
+// the number of threads.
+Value *ParForExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  if (!Reduce.empty() && !isBuiltinReduction(Reduce)) {
+    auto PI = FunctionProtos.find("binary" + Reduce);
+    if (PI == FunctionProtos.end() || !PI->second->isAssociative())
+      return LogErrorV(("parfor cannot reduce with '" + Reduce +
+                        "', which is not an 'assoc' binary operator")
+                           .c_str());
+  }
 
-  // Create the "after loop" block and insert it.
-  BasicBlock *AfterBB =
-      BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+  Value *StartVal = Start->codegen();
+  if (!StartVal || !CheckDouble(StartVal, "start of parfor loop"))
+    return nullptr;
+  Value *EndVal = End->codegen();
+  if (!EndVal || !CheckDouble(EndVal, "end of parfor loop"))
+    return nullptr;
 
-  // Insert the conditional branch into the end of LoopEndBB.
-  Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+  std::vector<std::string> Captures;
+  if (!findCaptures(Captures))
+    return nullptr;
 
-  // Any new code will be inserted in AfterBB.
-  Builder->SetInsertPoint(AfterBB);
+  // Copy the captured variables into a struct for the outlined loop. The
+  // runtime returns only once every iteration is done, so it can live on
+  // this function's stack.
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  std::vector<Type *> EnvTys;
+  for (const std::string &Name : Captures)
+    EnvTys.push_back(NamedValues[Name]->getAllocatedType());
+  StructType *EnvTy = StructType::get(*TheContext, EnvTys);
+  AllocaInst *Env = CreateEntryBlockAlloca(TheFunction, "parfor.env", EnvTy);
+  for (unsigned i = 0, e = Captures.size(); i != e; ++i)
+    Builder->CreateStore(
+        Builder->CreateLoad(EnvTys[i], NamedValues[Captures[i]], Captures[i]),
+        Builder->CreateStructGEP(EnvTy, Env, i));
+
+  Type *Int64Ty = Builder->getInt64Ty();
+  Type *DoubleTy = Builder->getDoubleTy();
+  Type *RetTy = Reduce.empty() ? Builder->getVoidTy() : DoubleTy;
+  FunctionType *BodyTy = FunctionType::get(
+      RetTy, {Int64Ty, Int64Ty, Builder->getInt8PtrTy()}, false);
+  Function *BodyF =
+      Function::Create(BodyTy, Function::InternalLinkage,
+                       TheFunction->getName() + ".parfor", TheModule.get());
+  setFPFunctionAttributes(BodyF, Builder->getFastMathFlags());
+
+  {
+    IRBuilderBase::InsertPointGuard Guard(*Builder);
+    std::map<std::string, AllocaInst *> OuterValues;
+    std::swap(OuterValues, NamedValues);
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", BodyF));
+    DISubprogram *SP = KSDbgInfo.beginFunction(BodyF, getLine());
+    SaveAndRestore<Value *> OuterCounters(CurInstCounters);
+    SaveAndRestore<std::map<const ExprAST *, unsigned>> OuterCallSites(
+        InstCallSites);
+    EmitInstEntry(BodyF, false);
+
+    Value *Lo = BodyF->getArg(0), *Hi = BodyF->getArg(1);
+    Lo->setName("lo");
+    Hi->setName("hi");
+    BodyF->getArg(2)->setName("env");
+    Value *EnvPtr =
+        Builder->CreateBitCast(BodyF->getArg(2), EnvTy->getPointerTo());
+    for (unsigned i = 0, e = Captures.size(); i != e; ++i) {
+      AllocaInst *Alloca =
+          CreateEntryBlockAlloca(BodyF, Captures[i], EnvTys[i]);
+      Builder->CreateStore(
+          Builder->CreateLoad(EnvTys[i],
+                              Builder->CreateStructGEP(EnvTy, EnvPtr, i)),
+          Alloca);
+      NamedValues[Captures[i]] = Alloca;
+    }
+    AllocaInst *LoVar = CreateEntryBlockAlloca(BodyF, LoName, DoubleTy);
+    Builder->CreateStore(Builder->CreateSIToFP(Lo, DoubleTy), LoVar);
+    NamedValues[LoName] = LoVar;
+    AllocaInst *LastVar = CreateEntryBlockAlloca(BodyF, LastName, DoubleTy);
+    Builder->CreateStore(
+        Builder->CreateSIToFP(Builder->CreateSub(Hi, Builder->getInt64(1)),
+                              DoubleTy),
+        LastVar);
+    NamedValues[LastName] = LastVar;
+
+    AllocaInst *AccVar = nullptr;
+    if (!Reduce.empty()) {
+      AccVar = CreateEntryBlockAlloca(BodyF, AccName, DoubleTy);
+      NamedValues[AccName] = AccVar;
+      if (Reduce == "+")
+        Builder->CreateStore(ConstantFP::getNegativeZero(DoubleTy), AccVar);
+      else if (Reduce == "*")
+        Builder->CreateStore(ConstantFP::get(DoubleTy, 1.0), AccVar);
+      else if (Reduce == "min" || Reduce == "max")
+        Builder->CreateStore(ConstantFP::getInfinity(DoubleTy, Reduce == "max"),
+                             AccVar);
+      else {
+        AllocaInst *FirstVar =
+            CreateEntryBlockAlloca(BodyF, FirstName, Builder->getInt1Ty());
+        Builder->CreateStore(Builder->getTrue(), FirstVar);
+        NamedValues[FirstName] = FirstVar;
+      }
+    }
 
-  // Restore the unshadowed variable.
-  if (OldVal)
-    NamedValues[VarName] = OldVal;
-  else
-    NamedValues.erase(VarName);
+    // Each chunk frees the arrays it allocates, unless it hands them to tasks.
+    Value *ArenaMark = nullptr;
+    if (ArenaScopes && mayAllocate(*Loop) && !spawnsWithArrays(*Loop))
+      ArenaMark = EmitArenaMark();
+    Value *LoopVal = Loop->codegen();
+    if (LoopVal) {
+      if (ArenaMark)
+        EmitArenaRelease(ArenaMark);
+      if (AccVar)
+        Builder->CreateRet(Builder->CreateLoad(DoubleTy, AccVar, AccName));
+      else
+        Builder->CreateRetVoid();
+    }
 
-  // for expr always returns 0.0.
-  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+    std::swap(OuterValues, NamedValues);
+    KSDbgInfo.endFunction(SP);
+    if (!LoopVal) {
+      BodyF->eraseFromParent();
+      return nullptr;
+    }
+  }
+  verifyFunction(*BodyF);
+
+  auto Ceil = [&](Value *V) {
+    return EmitToInt(Builder->CreateUnaryIntrinsic(Intrinsic::ceil, V),
+                     Int64Ty);
+  };
+  CurFunctionTouchesArrays = true;
+
+  if (!Reduce.empty()) {
+    // Reduce the integers in [start, end); an empty range gives the identity
+    // of the operator, or 0 if it has none.
+    Function *Combine = getReduceCombineFunction(Reduce);
+    double Empty = Reduce == "*"     ? 1.0
+                   : Reduce == "min" ? HUGE_VAL
+                   : Reduce == "max" ? -HUGE_VAL
+                                     : 0.0;
+    FunctionCallee ParForReduce = TheModule->getOrInsertFunction(
+        "meow_parfor_reduce",
+        FunctionType::get(DoubleTy,
+                          {Int64Ty, Int64Ty, BodyTy->getPointerTo(),
+                           Builder->getInt8PtrTy(),
+                           Combine->getType(), DoubleTy},
+                          false));
+    return Builder->CreateCall(
+        ParForReduce,
+        {Ceil(StartVal), Ceil(EndVal), BodyF,
+         Builder->CreateBitCast(Env, Builder->getInt8PtrTy()), Combine,
+         ConstantFP::get(DoubleTy, Empty)},
+        "parfor.reduce");
+  }
+
+  // Run the integers in [start, end).
+  FunctionCallee ParFor = TheModule->getOrInsertFunction(
+      "meow_parfor",
+      FunctionType::get(Builder->getVoidTy(),
+                        {Int64Ty, Int64Ty, BodyTy->getPointerTo(),
+                         Builder->getInt8PtrTy()},
+                        false));
+  Builder->CreateCall(ParFor,
+                      {Ceil(StartVal), Ceil(EndVal), BodyF,
+                       Builder->CreateBitCast(Env, Builder->getInt8PtrTy())});
+
+  // parfor expr always returns 0.0.
+  return Constant::getNullValue(DoubleTy);
 }
 
 Value *IfExprAST::codegen() {
   KSDbgInfo.emitLocation(this);
 
   Value *CondV = Cond->codegen();
-  if (!CondV)
+  if (!CondV || !CheckDouble(CondV, "if condition"))
     return nullptr;
 
   // Convert condition to a bool by comparing non-equal to 0.0.
@@ -1125,10 +5333,15 @@ Value *IfExprAST::codegen() {
   BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
   BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-  Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+  std::string Site = ProfileSiteKey("if");
+  Builder->CreateCondBr(
+      CondV, ThenBB, ElseBB,
+      getProfileBranchWeights(getProfileCount(Site + ":then"),
+                              getProfileCount(Site + ":else")));
 
   // Emit then value.
   Builder->SetInsertPoint(ThenBB);
+  EmitProfileCounter(Site + ":then");
 
   Value *ThenV = Then->codegen();
   if (!ThenV)
@@ -1141,6 +5354,7 @@ Value *IfExprAST::codegen() {
   // Emit else block.
   TheFunction->getBasicBlockList().push_back(ElseBB);
   Builder->SetInsertPoint(ElseBB);
+  EmitProfileCounter(Site + ":else");
 
   Value *ElseV = Else->codegen();
   if (!ElseV)
@@ -1150,24 +5364,99 @@ Value *IfExprAST::codegen() {
   // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
   ElseBB = Builder->GetInsertBlock();
 
+  // If one arm is a vector and the other a double, broadcast the double at
+  // the end of its arm.
+  if (ThenV->getType() != ElseV->getType()) {
+    bool SplatThen = ThenV->getType()->isDoubleTy();
+    Builder->SetInsertPoint(SplatThen ? ThenBB->getTerminator()
+                                      : ElseBB->getTerminator());
+    if (SplatThen)
+      ThenV = CoerceToType(ThenV, ElseV->getType(), "then arm");
+    else
+      ElseV = CoerceToType(ElseV, ThenV->getType(), "else arm");
+    if (!ThenV || !ElseV)
+      return nullptr;
+  }
+
   // Emit merge block.
   TheFunction->getBasicBlockList().push_back(MergeBB);
   Builder->SetInsertPoint(MergeBB);
-  PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+  PHINode *PN = Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
 
   PN->addIncoming(ThenV, ThenBB);
   PN->addIncoming(ElseV, ElseBB);
   return PN;
 }
 
+/// EmitFMulAdd - Under -ffp-contract=on, fuse a multiply that directly feeds
+/// this add or subtract into an llvm.fmuladd, which becomes an FMA on targets
+/// that have one. Returns null if neither operand is such a multiply.
+static Value *EmitFMulAdd(Value *L, Value *R, bool IsSub) {
+  // With 'contract' set the backend is free to fuse anything anyway.
+  if (FPContract != FPC_On || Builder->getFastMathFlags().allowContract())
+    return nullptr;
+
+  // Only fuse a multiply we just emitted for this expression.
+  auto IsFusibleMul = [](Value *V) {
+    auto *I = dyn_cast<BinaryOperator>(V);
+    return I && I->getOpcode() == Instruction::FMul && I->use_empty();
+  };
+
+  BinaryOperator *Mul;
+  Value *Addend;
+  bool NegateMul = false;
+  if (IsFusibleMul(L)) {
+    Mul = cast<BinaryOperator>(L);
+    Addend = IsSub ? Builder->CreateFNeg(R, "negtmp") : R;
+  } else if (IsFusibleMul(R)) {
+    Mul = cast<BinaryOperator>(R);
+    Addend = L;
+    NegateMul = IsSub;
+  } else
+    return nullptr;
+
+  Value *A = Mul->getOperand(0);
+  if (NegateMul)
+    A = Builder->CreateFNeg(A, "negtmp");
+  Value *FMA = Builder->CreateIntrinsic(Intrinsic::fmuladd, {Mul->getType()},
+                                        {A, Mul->getOperand(1), Addend},
+                                        nullptr, "fmatmp");
+  Mul->eraseFromParent();
+  return FMA;
+}
+
 Value *BinaryExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
   // Special case '=' because we don't want to emit the LHS as an expression.
   if (Op == '=') {
-    // Assignment requires the LHS to be an identifier.
-    // This assume we're building without RTTI because LLVM builds that way by
-    // default.  If you build LLVM with RTTI this can be changed to a
-    // dynamic_cast for automatic error checking.
-    VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
+    // Assignment to an array element stores through its address.
+    if (auto *LHSI = dyn_cast<IndexExprAST>(LHS.get())) {
+      Value *Addr = LHSI->codegenAddress(/*ForStore=*/true);
+      if (!Addr)
+        return nullptr;
+      Value *Val = RHS->codegen();
+      if (!Val || !CheckDouble(Val, "array element assignment"))
+        return nullptr;
+      Builder->CreateStore(Val, Addr);
+      return Val;
+    }
+
+    // Int fields are stored truncated toward zero, and saturated.
+    if (auto *LHSF = dyn_cast<FieldExprAST>(LHS.get())) {
+      Type *FieldTy;
+      Value *Addr = LHSF->codegenAddress(FieldTy);
+      if (!Addr)
+        return nullptr;
+      Value *Val = RHS->codegen();
+      if (!Val || !CheckDouble(Val, "field assignment"))
+        return nullptr;
+      Builder->CreateStore(
+          FieldTy->isIntegerTy() ? EmitToInt(Val, FieldTy) : Val, Addr);
+      return Val;
+    }
+
+    // Otherwise assignment requires the LHS to be an identifier.
+    auto *LHSE = dyn_cast<VariableExprAST>(LHS.get());
     if (!LHSE)
       return LogErrorV("destination of '=' must be a variable");
     // Codegen the RHS.
@@ -1176,10 +5465,15 @@ Value *BinaryExprAST::codegen() {
       return nullptr;
 
     // Look up the name.
-    Value *Variable = NamedValues[LHSE->getName()];
+    AllocaInst *Variable = NamedValues[LHSE->getName()];
     if (!Variable)
       return LogErrorV("Unknown variable name");
 
+    Val = CoerceToType(Val, Variable->getAllocatedType(),
+                       "assignment to '" + LHSE->getName() + "'");
+    if (!Val)
+      return nullptr;
+
     Builder->CreateStore(Val, Variable);
     return Val;
   }
@@ -1189,17 +5483,26 @@ Value *BinaryExprAST::codegen() {
   if (!L || !R)
     return nullptr;
 
+  // The builtin operators work elementwise on vectors.
+  if (Op == '+' || Op == '-' || Op == '*' || Op == '<')
+    if (!UnifyOperands(L, R))
+      return nullptr;
+
   switch (Op) {
   case '+':
+    if (Value *FMA = EmitFMulAdd(L, R, false))
+      return FMA;
     return Builder->CreateFAdd(L, R, "addtmp");
   case '-':
+    if (Value *FMA = EmitFMulAdd(L, R, true))
+      return FMA;
     return Builder->CreateFSub(L, R, "subtmp");
   case '*':
     return Builder->CreateFMul(L, R, "multmp");
   case '<':
     L = Builder->CreateFCmpULT(L, R, "cmptmp");
     // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+    return Builder->CreateUIToFP(L, R->getType(), "booltmp");
   default:
     break;
   }
@@ -1208,38 +5511,1069 @@ Value *BinaryExprAST::codegen() {
   // a call to it.
   Function *F = getFunction(std::string("binary") + Op);
   assert(F && "binary operator not found!");
+  if (!CheckPureCall(F))
+    return nullptr;
+
+  L = CoerceToType(L, F->getArg(0)->getType(), "left operand");
+  R = CoerceToType(R, F->getArg(1)->getType(), "right operand");
+  if (!L || !R)
+    return nullptr;
 
   Value *Ops[] = {L, R};
   return Builder->CreateCall(F, Ops, "binop");
 }
 
-Value *UnaryExprAST::codegen() {
-  Value *OperandV = Operand->codegen();
-  if (!OperandV)
-    return nullptr;
+Value *UnaryExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  Value *OperandV = Operand->codegen();
+  if (!OperandV)
+    return nullptr;
+
+  Function *F = getFunction(std::string("unary") + Opcode);
+  if (!F)
+    return LogErrorV("Unknown unary operator");
+  if (!CheckPureCall(F))
+    return nullptr;
+
+  OperandV = CoerceToType(OperandV, F->getArg(0)->getType(), "operand");
+  if (!OperandV)
+    return nullptr;
+
+  return Builder->CreateCall(F, OperandV, "unop");
+}
+
+// ============ //
+// Optimization //
+// ============ //
+
+namespace {
+  /// SpecializeConstantArgsPass - Clone functions for constant argument
+  /// patterns that recur across call sites, fold the constants into the
+  /// clone, and redirect those call sites to it. e.g. with two calls to
+  /// `pow(x, 3)` we emit `pow.spec.0(x)` with the exponent folded in. The
+  /// total size of the clones is bounded by -specialize-budget.
+  struct SpecializeConstantArgsPass
+      : PassInfoMixin<SpecializeConstantArgsPass> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+  };
+} // end namespace
+
+static unsigned countInstructions(const Function &F) {
+  unsigned Count = 0;
+  for (const BasicBlock &BB : F)
+    Count += BB.size();
+  return Count;
+}
+
+PreservedAnalyses SpecializeConstantArgsPass::run(Module &M,
+                                                  ModuleAnalysisManager &MAM) {
+  // A pattern is a callee plus the (argument index, bit pattern) of each of
+  // its constant arguments.
+  using Pattern =
+      std::pair<Function *, std::vector<std::pair<unsigned, uint64_t>>>;
+  std::map<Pattern, std::vector<CallInst *>> Sites;
+
+  for (Function &Caller : M)
+    for (BasicBlock &BB : Caller)
+      for (Instruction &I : BB) {
+        auto *CI = dyn_cast<CallInst>(&I);
+        if (!CI)
+          continue;
+        Function *Callee = CI->getCalledFunction();
+        if (!Callee || Callee->isDeclaration() || Callee->isVarArg())
+          continue;
+
+        Pattern P{Callee, {}};
+        for (unsigned i = 0, e = CI->arg_size(); i != e; ++i)
+          if (auto *C = dyn_cast<ConstantFP>(CI->getArgOperand(i)))
+            if (C->getType()->isDoubleTy())
+              P.second.emplace_back(
+                  i, C->getValueAPF().bitcastToAPInt().getZExtValue());
+        if (!P.second.empty())
+          Sites[P].push_back(CI);
+      }
+
+  // Specialize the most frequent patterns first, while the budget lasts.
+  std::vector<std::pair<const Pattern *, std::vector<CallInst *> *>> Candidates;
+  for (auto &S : Sites)
+    if (S.second.size() >= SpecializeMinCalls)
+      Candidates.emplace_back(&S.first, &S.second);
+  std::stable_sort(Candidates.begin(), Candidates.end(),
+                   [](const auto &A, const auto &B) {
+                     return A.second->size() > B.second->size();
+                   });
+
+  FunctionAnalysisManager &FAM =
+      MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  FunctionPassManager Simplify;
+  Simplify.addPass(PromotePass());
+  Simplify.addPass(SCCPPass());
+  Simplify.addPass(InstCombinePass());
+  Simplify.addPass(SimplifyCFGPass());
+
+  unsigned Budget = SpecializeBudget;
+  unsigned NumClones = 0;
+  bool Changed = false;
+  for (auto &[P, Calls] : Candidates) {
+    Function *Callee = P->first;
+    if (countInstructions(*Callee) > Budget)
+      continue;
+
+    // Map the constant arguments to their values; CloneFunction drops them
+    // from the clone's signature.
+    ValueToValueMapTy VMap;
+    std::vector<bool> IsConst(Callee->arg_size());
+    for (auto &[Idx, Bits] : P->second) {
+      VMap[Callee->getArg(Idx)] = ConstantFP::get(
+          *TheContext, APFloat(APFloat::IEEEdouble(), APInt(64, Bits)));
+      IsConst[Idx] = true;
+    }
+    Function *Clone = CloneFunction(Callee, VMap);
+    Clone->setName(Callee->getName() + ".spec." + Twine(NumClones++));
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+
+    Simplify.run(*Clone, FAM);
+    unsigned Size = countInstructions(*Clone);
+    if (Size > Budget) {
+      FAM.clear(*Clone, Clone->getName());
+      Clone->eraseFromParent();
+      continue;
+    }
+    Budget -= Size;
+
+    for (CallInst *CI : *Calls) {
+      std::vector<Value *> Args;
+      for (unsigned i = 0, e = CI->arg_size(); i != e; ++i)
+        if (!IsConst[i])
+          Args.push_back(CI->getArgOperand(i));
+      CallInst *NewCI = CallInst::Create(Clone, Args, "", CI);
+      NewCI->takeName(CI);
+      NewCI->setDebugLoc(CI->getDebugLoc());
+      NewCI->setTailCallKind(CI->getTailCallKind());
+      CI->replaceAllUsesWith(NewCI);
+      CI->eraseFromParent();
+    }
+    Changed = true;
+  }
+
+  return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
+
+/// OptimizeModule - Run the standard LLVM pipeline for -O<n> over the module,
+/// with meow's own passes hooked in at the appropriate extension points.
+static void OptimizeModule(Module &M, TargetMachine *TM) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  PassInstrumentationCallbacks PIC;
+  RegisterTimeReportCallbacks(PIC);
+  PassBuilder PB(TM, PipelineTuningOptions(), None, &PIC);
+
+  // Specialize before the inliner gets a chance to consume the call sites.
+  if (SpecializeBudget)
+    PB.registerPipelineStartEPCallback(
+        [](ModulePassManager &MPM, OptimizationLevel) {
+          MPM.addPass(SpecializeConstantArgsPass());
+        });
+
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  switch (OptLevel) {
+  case '0':
+    MPM = PB.buildO0DefaultPipeline(OptimizationLevel::O0);
+    break;
+  case '1':
+    MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O1);
+    break;
+  case '2':
+    MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+    break;
+  case '3':
+    MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+    break;
+  }
+  MPM.run(M, MAM);
+}
+
+/// =========== //
+/// Interpreter //
+/// =========== //
+
+// A short script spends far longer in LLVM than running, so -run walks small
+// programs instead of compiling them. Each function body is lowered once to a
+// tree of closures, with its variables resolved to slots in a frame, and
+// builtins bound to their libmeow kernels through a dispatch table. Only
+// doubles, arrays and scalar control flow are covered; a program using
+// anything else is compiled and run in the JIT.
+
+// meowc links libmeow, so the interpreter calls the same runtime entry points
+// compiled programs do.
+extern "C" {
+double flushd();
+double *meow_array_alloc(int64_t N);
+void meow_bounds_fail(int64_t Index, int64_t Len);
+void *meow_arena_mark();
+void meow_arena_release(void *Mark);
+void *meow_memo_init(void **Table, int64_t NumArgs);
+void meow_memo_free(void *Table);
+int32_t meow_memo_get(void *Table, const double *Args, double *Result);
+void meow_memo_put(void *Table, const double *Args, double Result);
+int64_t meow_readv(double *Out, int64_t N);
+void meow_vsin(const double *X, double *Y, int64_t N);
+void meow_vcos(const double *X, double *Y, int64_t N);
+void meow_vsqrt(const double *X, double *Y, int64_t N);
+void meow_vpow(const double *X, double P, double *Y, int64_t N);
+void meow_axpy(double A, const double *X, double *Y, int64_t N);
+double meow_dot(const double *X, const double *Y, int64_t N);
+double meow_sum(const double *X, int64_t N);
+void meow_rng_seed(int64_t Seed, int64_t Stream);
+void meow_rng_jump();
+double meow_randn();
+void meow_rand_fill(double *X, int64_t N);
+void meow_randn_fill(double *X, int64_t N);
+void meow_inst_write();
+}
+
+namespace {
+  /// IType - the static type of an interpreted value.
+  enum IType { IT_Double, IT_Array, IT_ConstArray };
+
+  /// IValue - an interpreted value: a double, or an array's data and length.
+  struct IValue {
+    double D = 0;
+    double *Data = nullptr;
+    int64_t Len = 0;
+  };
+
+  /// ICode - a lowered expression, evaluated against its function's frame.
+  using ICode = std::function<IValue(IValue *Frame)>;
+
+  /// IFunction - a function the interpreter can call: either a lowered
+  /// definition, or an extern bound to a native double(double, ...).
+  struct IFunction {
+    static constexpr unsigned MaxNativeArgs = 6;
+
+    const PrototypeAST *Proto = nullptr;
+    std::vector<IType> ArgTys;
+    IType RetTy = IT_Double;
+    unsigned NumSlots = 0;
+    ICode Body;
+    void *Native = nullptr;
+    /// Whether to free the arrays a call allocates when it returns, as the
+    /// compiled function would.
+    bool ScopesArena = false;
+    /// The libmeow cache of a memo function, which takes only doubles.
+    void *MemoTable = nullptr;
+
+    IValue call(const IValue *Args) const;
+    double callNative(const IValue *Args) const;
+  };
+
+  /// IVar - the frame slot and type of a variable in scope.
+  struct IVar {
+    unsigned Slot;
+    IType Ty;
+  };
+
+  /// ILowering - the state of lowering one function body.
+  struct ILowering {
+    IFunction &Fn;
+    std::map<std::string, IVar> Scope;
+    bool Allocates = false;
+
+    explicit ILowering(IFunction &Fn) : Fn(Fn) {}
+
+    unsigned newSlot() { return Fn.NumSlots++; }
+
+    /// bind - bring Name into scope, returning the variable it shadows.
+    Optional<IVar> bind(const std::string &Name, IVar V) {
+      Optional<IVar> Old;
+      auto I = Scope.find(Name);
+      if (I != Scope.end())
+        Old = I->second;
+      Scope[Name] = V;
+      return Old;
+    }
+
+    /// unbind - take Name out of scope, restoring the variable it shadowed.
+    void unbind(const std::string &Name, Optional<IVar> Old) {
+      if (Old)
+        Scope[Name] = *Old;
+      else
+        Scope.erase(Name);
+    }
+  };
+
+  /// IBuiltin - a builtin in the interpreter's dispatch table. The last
+  /// NumOptional arguments may be left out, and are passed as zero.
+  struct IBuiltin {
+    std::vector<IType> ArgTys;
+    IType RetTy;
+    bool Impure;
+    IValue (*Fn)(const IValue *Args);
+    unsigned NumOptional = 0;
+  };
+} // end namespace
+
+IValue IFunction::call(const IValue *Args) const {
+  if (Native)
+    return {callNative(Args)};
+
+  SmallVector<double, 8> Key;
+  if (MemoTable) {
+    double Cached;
+    for (unsigned i = 0, e = ArgTys.size(); i != e; ++i)
+      Key.push_back(Args[i].D);
+    if (meow_memo_get(MemoTable, Key.data(), &Cached))
+      return {Cached};
+  }
+
+  SmallVector<IValue, 16> Frame(NumSlots);
+  std::copy_n(Args, ArgTys.size(), Frame.begin());
+  void *Mark = ScopesArena ? meow_arena_mark() : nullptr;
+  IValue Result = Body(Frame.data());
+  if (ScopesArena)
+    meow_arena_release(Mark);
+  if (MemoTable)
+    meow_memo_put(MemoTable, Key.data(), Result.D);
+  return Result;
+}
+
+double IFunction::callNative(const IValue *A) const {
+  using D = double;
+  switch (ArgTys.size()) {
+  case 0:
+    return reinterpret_cast<D (*)()>(Native)();
+  case 1:
+    return reinterpret_cast<D (*)(D)>(Native)(A[0].D);
+  case 2:
+    return reinterpret_cast<D (*)(D, D)>(Native)(A[0].D, A[1].D);
+  case 3:
+    return reinterpret_cast<D (*)(D, D, D)>(Native)(A[0].D, A[1].D, A[2].D);
+  case 4:
+    return reinterpret_cast<D (*)(D, D, D, D)>(Native)(A[0].D, A[1].D, A[2].D,
+                                                       A[3].D);
+  case 5:
+    return reinterpret_cast<D (*)(D, D, D, D, D)>(Native)(
+        A[0].D, A[1].D, A[2].D, A[3].D, A[4].D);
+  case 6:
+    return reinterpret_cast<D (*)(D, D, D, D, D, D)>(Native)(
+        A[0].D, A[1].D, A[2].D, A[3].D, A[4].D, A[5].D);
+  }
+  llvm_unreachable("extern with too many arguments");
+}
+
+/// InterpError - why the interpreter declined the program.
+static std::string InterpError;
+
+/// InterpFunctions - the functions defined or declared so far, by name.
+static std::map<std::string, std::unique_ptr<IFunction>> InterpFunctions;
+
+/// Decline - record why the program can't be interpreted, and return false.
+static bool Decline(const std::string &Why) {
+  if (InterpError.empty())
+    InterpError = Why;
+  return false;
+}
+
+static IFunction *getInterpFunction(const std::string &Name) {
+  auto I = InterpFunctions.find(Name);
+  return I == InterpFunctions.end() ? nullptr : I->second.get();
+}
+
+/// parseIType - the interpreted type named Name.
+static bool parseIType(const std::string &Name, IType &Ty) {
+  if (Name == "double")
+    Ty = IT_Double;
+  else if (Name == "double[]")
+    Ty = IT_Array;
+  else if (Name == "const double[]")
+    Ty = IT_ConstArray;
+  else
+    return Decline("values of type '" + Name + "' need the compiler");
+  return true;
+}
+
+static const char *getITypeName(IType Ty) {
+  switch (Ty) {
+  case IT_Double:
+    return "double";
+  case IT_Array:
+    return "double[]";
+  case IT_ConstArray:
+    return "const double[]";
+  }
+  llvm_unreachable("unknown type");
+}
+
+/// CheckIType - whether a value of type Got may be used as What, of type Want.
+/// A double[] may be passed as a const double[].
+static bool CheckIType(IType Got, IType Want, const std::string &What) {
+  if (Got == Want || (Got == IT_Array && Want == IT_ConstArray))
+    return true;
+  return Decline(What + ": expected " + getITypeName(Want) + " but got " +
+                 getITypeName(Got));
+}
+
+/// elementIndex - the element of A that D subscripts, after the same bounds
+/// check compiled code makes.
+static int64_t elementIndex(const IValue &A, double D) {
+  double I = std::trunc(D);
+  if (I >= 0 && I < static_cast<double>(A.Len))
+    return static_cast<int64_t>(I);
+  meow_bounds_fail(std::fabs(I) < 0x1p63 ? static_cast<int64_t>(I) : -1, A.Len);
+  llvm_unreachable("meow_bounds_fail returned");
+}
+
+/// toInt64 - D truncated toward zero, saturating as compiled code converts
+/// lengths: NaN is 0 and values out of range the nearest int64_t.
+static int64_t toInt64(double D) {
+  if (D != D)
+    return 0;
+  if (D <= -0x1p63)
+    return INT64_MIN;
+  return D >= 0x1p63 ? INT64_MAX : static_cast<int64_t>(D);
+}
+
+/// checkLength - make the bounds check a compiled kernel call makes, that A
+/// has at least N elements.
+static void checkLength(const IValue &A, int64_t N) {
+  if (A.Len < N)
+    meow_bounds_fail(N - 1, A.Len);
+}
+
+/// InterpBuiltins - the builtins the interpreter supports, and the libmeow
+/// kernels that implement them.
+static const std::map<std::string, IBuiltin> InterpBuiltins = {
+    {"array",
+     {{IT_Double}, IT_Array, false,
+      [](const IValue *A) {
+        int64_t N = toInt64(A[0].D);
+        return IValue{0, meow_array_alloc(N), N};
+      }}},
+    {"len",
+     {{IT_ConstArray}, IT_Double, false,
+      [](const IValue *A) { return IValue{static_cast<double>(A[0].Len)}; }}},
+    {"readv",
+     {{IT_Array}, IT_Double, true,
+      [](const IValue *A) {
+        return IValue{static_cast<double>(meow_readv(A[0].Data, A[0].Len))};
+      }}},
+    {"vsin",
+     {{IT_ConstArray, IT_Array}, IT_Array, false,
+      [](const IValue *A) {
+        checkLength(A[0], A[1].Len);
+        meow_vsin(A[0].Data, A[1].Data, A[1].Len);
+        return A[1];
+      }}},
+    {"vcos",
+     {{IT_ConstArray, IT_Array}, IT_Array, false,
+      [](const IValue *A) {
+        checkLength(A[0], A[1].Len);
+        meow_vcos(A[0].Data, A[1].Data, A[1].Len);
+        return A[1];
+      }}},
+    {"vsqrt",
+     {{IT_ConstArray, IT_Array}, IT_Array, false,
+      [](const IValue *A) {
+        checkLength(A[0], A[1].Len);
+        meow_vsqrt(A[0].Data, A[1].Data, A[1].Len);
+        return A[1];
+      }}},
+    {"vpow",
+     {{IT_ConstArray, IT_Double, IT_Array}, IT_Array, false,
+      [](const IValue *A) {
+        checkLength(A[0], A[2].Len);
+        meow_vpow(A[0].Data, A[1].D, A[2].Data, A[2].Len);
+        return A[2];
+      }}},
+    {"axpy",
+     {{IT_Double, IT_ConstArray, IT_Array}, IT_Array, false,
+      [](const IValue *A) {
+        checkLength(A[1], A[2].Len);
+        meow_axpy(A[0].D, A[1].Data, A[2].Data, A[2].Len);
+        return A[2];
+      }}},
+    {"dot",
+     {{IT_ConstArray, IT_ConstArray}, IT_Double, false,
+      [](const IValue *A) {
+        checkLength(A[1], A[0].Len);
+        return IValue{meow_dot(A[0].Data, A[1].Data, A[0].Len)};
+      }}},
+    {"sum",
+     {{IT_ConstArray}, IT_Double, false,
+      [](const IValue *A) { return IValue{meow_sum(A[0].Data, A[0].Len)}; }}},
+    {"rand",
+     {{}, IT_Double, true,
+      [](const IValue *) {
+        double X;
+        meow_rand_fill(&X, 1);
+        return IValue{X};
+      }}},
+    {"randn",
+     {{}, IT_Double, true, [](const IValue *) { return IValue{meow_randn()}; }}},
+    {"seed",
+     {{IT_Double, IT_Double}, IT_Double, true,
+      [](const IValue *A) {
+        meow_rng_seed(toInt64(A[0].D), std::max<int64_t>(toInt64(A[1].D), 0));
+        return IValue{0};
+      },
+      1}},
+    {"jump",
+     {{}, IT_Double, true,
+      [](const IValue *) {
+        meow_rng_jump();
+        return IValue{0};
+      }}},
+    {"randfill",
+     {{IT_Array}, IT_Array, true,
+      [](const IValue *A) {
+        meow_rand_fill(A[0].Data, A[0].Len);
+        return A[0];
+      }}},
+    {"randnfill",
+     {{IT_Array}, IT_Array, true,
+      [](const IValue *A) {
+        meow_randn_fill(A[0].Data, A[0].Len);
+        return A[0];
+      }}},
+};
+
+static bool lowerExpr(ExprAST &E, ILowering &L, ICode &Code, IType &Ty);
+
+/// lowerDouble - lower E, which must produce a double, for use as What.
+static bool lowerDouble(ExprAST &E, ILowering &L, ICode &Code,
+                        const std::string &What) {
+  IType Ty;
+  return lowerExpr(E, L, Code, Ty) && CheckIType(Ty, IT_Double, What);
+}
+
+/// lowerCall - lower a call to Fn, with Args converted to its parameter types.
+static bool lowerCall(IFunction &Fn, const std::string &Callee,
+                      ArrayRef<ExprAST *> Args, ILowering &L, ICode &Code,
+                      IType &Ty) {
+  if (Fn.ArgTys.size() != Args.size())
+    return Decline("Incorrect number of arguments passed");
+  if (L.Fn.Proto->isPure() && !Fn.Proto->isPure())
+    return Decline("pure function '" + L.Fn.Proto->getName() +
+                   "' calls impure function '" + Callee + "'");
+
+  std::vector<ICode> ArgCode(Args.size());
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    IType ArgTy;
+    if (!lowerExpr(*Args[i], L, ArgCode[i], ArgTy) ||
+        !CheckIType(ArgTy, Fn.ArgTys[i],
+                    "argument " + std::to_string(i + 1) + " of '" + Callee +
+                        "'"))
+      return false;
+  }
+  if (Fn.RetTy != IT_Double)
+    L.Allocates = true;
+
+  Ty = Fn.RetTy;
+  IFunction *F = &Fn;
+  Code = [F, ArgCode = std::move(ArgCode)](IValue *Frame) {
+    SmallVector<IValue, 8> ArgVals;
+    for (const ICode &Arg : ArgCode)
+      ArgVals.push_back(Arg(Frame));
+    return F->call(ArgVals.data());
+  };
+  return true;
+}
+
+/// lowerBuiltinCall - lower a call to a builtin in the dispatch table.
+static bool lowerBuiltinCall(const IBuiltin &B, const std::string &Callee,
+                             ArrayRef<std::unique_ptr<ExprAST>> Args,
+                             ILowering &L, ICode &Code, IType &Ty) {
+  if (Args.size() > B.ArgTys.size() ||
+      Args.size() + B.NumOptional < B.ArgTys.size())
+    return Decline(Callee + ": wrong number of arguments");
+  if (B.Impure && L.Fn.Proto->isPure())
+    return Decline("pure function '" + L.Fn.Proto->getName() +
+                   "' calls impure builtin '" + Callee + "'");
+
+  std::vector<ICode> ArgCode(Args.size());
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    IType ArgTy;
+    if (!lowerExpr(*Args[i], L, ArgCode[i], ArgTy) ||
+        !CheckIType(ArgTy, B.ArgTys[i], Callee))
+      return false;
+  }
+  if (B.RetTy != IT_Double)
+    L.Allocates = true;
+
+  Ty = B.RetTy;
+  Code = [Fn = B.Fn, ArgCode = std::move(ArgCode)](IValue *Frame) {
+    IValue ArgVals[3];
+    for (unsigned i = 0, e = ArgCode.size(); i != e; ++i)
+      ArgVals[i] = ArgCode[i](Frame);
+    return Fn(ArgVals);
+  };
+  return true;
+}
+
+/// lowerElement - lower the array and index of a[i].
+static bool lowerElement(IndexExprAST &E, ILowering &L, ICode &Array,
+                         ICode &Index, bool ForStore) {
+  IType ArrayTy;
+  if (!lowerExpr(*E.getArray(), L, Array, ArrayTy))
+    return false;
+  if (ArrayTy == IT_Double)
+    return Decline("subscripted value is not an array");
+  if (ForStore && ArrayTy == IT_ConstArray)
+    return Decline("cannot assign to an element of a const double[]");
+  return lowerDouble(*E.getIndex(), L, Index, "array index");
+}
+
+static bool lowerBinary(BinaryExprAST &E, ILowering &L, ICode &Code,
+                        IType &Ty) {
+  char Op = E.getOp();
+  if (Op == '=') {
+    ICode Val;
+    if (auto *LHSI = dyn_cast<IndexExprAST>(E.getLHS())) {
+      ICode Array, Index;
+      if (!lowerElement(*LHSI, L, Array, Index, /*ForStore=*/true) ||
+          !lowerDouble(*E.getRHS(), L, Val, "array element assignment"))
+        return false;
+      Ty = IT_Double;
+      Code = [Array, Index, Val](IValue *Frame) {
+        IValue A = Array(Frame);
+        int64_t I = elementIndex(A, Index(Frame).D);
+        IValue V = Val(Frame);
+        A.Data[I] = V.D;
+        return V;
+      };
+      return true;
+    }
+
+    auto *LHSE = dyn_cast<VariableExprAST>(E.getLHS());
+    if (!LHSE)
+      return isa<FieldExprAST>(E.getLHS())
+                 ? Decline("records need the compiler")
+                 : Decline("destination of '=' must be a variable");
+    IType ValTy;
+    if (!lowerExpr(*E.getRHS(), L, Val, ValTy))
+      return false;
+    auto V = L.Scope.find(LHSE->getName());
+    if (V == L.Scope.end())
+      return Decline("Unknown variable name");
+    if (!CheckIType(ValTy, V->second.Ty,
+                    "assignment to '" + LHSE->getName() + "'"))
+      return false;
+    Ty = V->second.Ty;
+    unsigned Slot = V->second.Slot;
+    Code = [Slot, Val](IValue *Frame) { return Frame[Slot] = Val(Frame); };
+    return true;
+  }
+
+  // A user defined operator is a call to its function.
+  if (Op != '+' && Op != '-' && Op != '*' && Op != '<') {
+    std::string Name = std::string("binary") + Op;
+    IFunction *Fn = getInterpFunction(Name);
+    if (!Fn)
+      return Decline("Unknown binary operator");
+    return lowerCall(*Fn, Name, {E.getLHS(), E.getRHS()}, L, Code, Ty);
+  }
+
+  ICode LHS, RHS;
+  IType LTy, RTy;
+  if (!lowerExpr(*E.getLHS(), L, LHS, LTy) ||
+      !lowerExpr(*E.getRHS(), L, RHS, RTy))
+    return false;
+  if (LTy != IT_Double || RTy != IT_Double)
+    return Decline("arithmetic operators apply only to doubles and vectors");
+
+  // The left operand is evaluated first, as in compiled code.
+  Ty = IT_Double;
+  switch (Op) {
+  case '+':
+    Code = [LHS, RHS](IValue *Frame) {
+      double X = LHS(Frame).D;
+      return IValue{X + RHS(Frame).D};
+    };
+    break;
+  case '-':
+    Code = [LHS, RHS](IValue *Frame) {
+      double X = LHS(Frame).D;
+      return IValue{X - RHS(Frame).D};
+    };
+    break;
+  case '*':
+    Code = [LHS, RHS](IValue *Frame) {
+      double X = LHS(Frame).D;
+      return IValue{X * RHS(Frame).D};
+    };
+    break;
+  case '<':
+    // Unordered operands compare less, like the compiled fcmp ult.
+    Code = [LHS, RHS](IValue *Frame) {
+      double X = LHS(Frame).D;
+      return IValue{!(X >= RHS(Frame).D) ? 1.0 : 0.0};
+    };
+    break;
+  }
+  return true;
+}
+
+static bool lowerFor(ForExprAST &E, ILowering &L, ICode &Code, IType &Ty) {
+  ICode Start, Step, End, Body;
+  if (!lowerDouble(*E.getStart(), L, Start, "start of for loop"))
+    return false;
+
+  unsigned Slot = L.newSlot();
+  Optional<IVar> Old = L.bind(E.getVarName(), {Slot, IT_Double});
+  IType BodyTy;
+  bool OK = lowerExpr(*E.getBody(), L, Body, BodyTy) &&
+            (!E.getStep() ||
+             lowerDouble(*E.getStep(), L, Step, "step of for loop")) &&
+            lowerDouble(*E.getEnd(), L, End, "for loop condition");
+  L.unbind(E.getVarName(), Old);
+  if (!OK)
+    return false;
+
+  // As compiled, the body runs before the end condition is first tested.
+  Ty = IT_Double;
+  Code = [Slot, Start, Step, End, Body](IValue *Frame) {
+    Frame[Slot] = Start(Frame);
+    while (true) {
+      Body(Frame);
+      double StepV = Step ? Step(Frame).D : 1.0;
+      double Cond = End(Frame).D;
+      Frame[Slot].D += StepV;
+      if (!(Cond < 0 || Cond > 0))
+        break;
+    }
+    return IValue{0};
+  };
+  return true;
+}
+
+static bool lowerVar(VarExprAST &E, ILowering &L, ICode &Code, IType &Ty) {
+  std::vector<std::pair<unsigned, ICode>> Inits;
+  std::vector<std::pair<std::string, Optional<IVar>>> Shadowed;
+  bool OK = true;
+  for (unsigned i = 0, e = E.getVarNames().size(); OK && i != e; ++i) {
+    const std::string &VarName = E.getVarNames()[i].first;
+    ExprAST *Init = E.getVarNames()[i].second.get();
+    const std::string &VarType = E.getVarTypes()[i];
+
+    // The initializer is lowered before the variable is in scope.
+    IType VarTy = IT_Double;
+    ICode InitCode;
+    if (!VarType.empty() && !parseIType(VarType, VarTy)) {
+      OK = false;
+    } else if (Init) {
+      IType InitTy;
+      OK = lowerExpr(*Init, L, InitCode, InitTy) &&
+           (VarType.empty() ||
+            CheckIType(InitTy, VarTy, "initializer of '" + VarName + "'"));
+      if (VarType.empty())
+        VarTy = InitTy;
+    }
+    if (OK) {
+      unsigned Slot = L.newSlot();
+      Inits.emplace_back(Slot, std::move(InitCode));
+      Shadowed.emplace_back(VarName, L.bind(VarName, {Slot, VarTy}));
+    }
+  }
+
+  ICode Body;
+  OK = OK && lowerExpr(*E.getBody(), L, Body, Ty);
+  for (auto I = Shadowed.rbegin(), End = Shadowed.rend(); I != End; ++I)
+    L.unbind(I->first, I->second);
+  if (!OK)
+    return false;
+
+  // Variables without an initializer start as 0, or an empty array.
+  Code = [Inits = std::move(Inits), Body](IValue *Frame) {
+    for (auto &Init : Inits)
+      Frame[Init.first] = Init.second ? Init.second(Frame) : IValue{};
+    return Body(Frame);
+  };
+  return true;
+}
+
+/// lowerExpr - lower E to Code, setting Ty to the type it produces. Returns
+/// false, with the reason in InterpError, if it needs the compiler.
+static bool lowerExpr(ExprAST &E, ILowering &L, ICode &Code, IType &Ty) {
+  switch (E.getKind()) {
+  case ExprAST::EK_Number: {
+    double Val = cast<NumberExprAST>(E).getValue();
+    Ty = IT_Double;
+    Code = [Val](IValue *) { return IValue{Val}; };
+    return true;
+  }
+  case ExprAST::EK_Variable: {
+    auto V = L.Scope.find(cast<VariableExprAST>(E).getName());
+    if (V == L.Scope.end())
+      return Decline("Unknown variable name");
+    unsigned Slot = V->second.Slot;
+    Ty = V->second.Ty;
+    Code = [Slot](IValue *Frame) { return Frame[Slot]; };
+    return true;
+  }
+  case ExprAST::EK_Unary: {
+    auto &U = cast<UnaryExprAST>(E);
+    std::string Name = std::string("unary") + U.getOpcode();
+    IFunction *Fn = getInterpFunction(Name);
+    if (!Fn)
+      return Decline("Unknown unary operator");
+    return lowerCall(*Fn, Name, {U.getOperand()}, L, Code, Ty);
+  }
+  case ExprAST::EK_Binary:
+    return lowerBinary(cast<BinaryExprAST>(E), L, Code, Ty);
+  case ExprAST::EK_Call: {
+    auto &C = cast<CallExprAST>(E);
+    const std::string &Callee = C.getCallee();
+    if (IFunction *Fn = getInterpFunction(Callee)) {
+      std::vector<ExprAST *> Args;
+      for (auto &Arg : C.getArgs())
+        Args.push_back(Arg.get());
+      return lowerCall(*Fn, Callee, Args, L, Code, Ty);
+    }
+    auto BI = InterpBuiltins.find(Callee);
+    if (BI != InterpBuiltins.end())
+      return lowerBuiltinCall(BI->second, Callee, C.getArgs(), L, Code, Ty);
+    if (Builtins.count(Callee) || StringRef(Callee).startswith("array:"))
+      return Decline("'" + Callee + "' needs the compiler");
+    return Decline("Unknown function referenced");
+  }
+  case ExprAST::EK_If: {
+    auto &I = cast<IfExprAST>(E);
+    ICode Cond, Then, Else;
+    IType ElseTy;
+    if (!lowerDouble(*I.getCond(), L, Cond, "if condition") ||
+        !lowerExpr(*I.getThen(), L, Then, Ty) ||
+        !lowerExpr(*I.getElse(), L, Else, ElseTy) ||
+        !CheckIType(ElseTy, Ty, "else arm"))
+      return false;
+    // A NaN condition is false, like the compiled fcmp one.
+    Code = [Cond, Then, Else](IValue *Frame) {
+      double C = Cond(Frame).D;
+      return C < 0 || C > 0 ? Then(Frame) : Else(Frame);
+    };
+    return true;
+  }
+  case ExprAST::EK_For:
+    return lowerFor(cast<ForExprAST>(E), L, Code, Ty);
+  case ExprAST::EK_Var:
+    return lowerVar(cast<VarExprAST>(E), L, Code, Ty);
+  case ExprAST::EK_Index: {
+    ICode Array, Index;
+    if (!lowerElement(cast<IndexExprAST>(E), L, Array, Index,
+                      /*ForStore=*/false))
+      return false;
+    Ty = IT_Double;
+    Code = [Array, Index](IValue *Frame) {
+      IValue A = Array(Frame);
+      return IValue{A.Data[elementIndex(A, Index(Frame).D)]};
+    };
+    return true;
+  }
+  default:
+    return Decline("slices, records, strings, parallel loops, tasks and "
+                   "generators need the compiler");
+  }
+}
+
+/// lowerFunction - lower the definition F. Named functions are registered
+/// before their body is lowered, so they may call themselves.
+static IFunction *lowerFunction(const FunctionAST &F,
+                                std::unique_ptr<IFunction> &TopLevel) {
+  const PrototypeAST &P = F.getProto();
+  if (P.isGenerator()) {
+    Decline("gen functions need the compiler");
+    return nullptr;
+  }
+
+  auto Fn = std::make_unique<IFunction>();
+  Fn->Proto = &P;
+  for (unsigned i = 0, e = P.getNumArgs(); i != e; ++i) {
+    Fn->ArgTys.emplace_back();
+    if (!parseIType(P.getArgType(i), Fn->ArgTys.back()))
+      return nullptr;
+  }
+  if (!parseIType(P.getRetType(), Fn->RetTy))
+    return nullptr;
+  if (P.isMemo())
+    meow_memo_init(&Fn->MemoTable, P.getNumArgs());
+
+  ILowering L{*Fn};
+  for (unsigned i = 0, e = P.getNumArgs(); i != e; ++i)
+    L.bind(P.getArgName(i), {L.newSlot(), Fn->ArgTys[i]});
+
+  IFunction *Raw = Fn.get();
+  if (P.getName() == "main") {
+    TopLevel = std::move(Fn);
+  } else {
+    auto &Slot = InterpFunctions[P.getName()];
+    if (Slot && !Slot->Native) {
+      Decline("Function cannot be redefined");
+      return nullptr;
+    }
+    Slot = std::move(Fn);
+  }
+
+  IType RetTy;
+  if (!lowerExpr(F.getBody(), L, Raw->Body, RetTy) ||
+      !CheckIType(RetTy, Raw->RetTy, "result of '" + P.getName() + "'"))
+    return nullptr;
+  Raw->ScopesArena = ArenaScopes && Raw->RetTy == IT_Double && L.Allocates;
+  return Raw;
+}
+
+/// lowerExtern - bind the extern P to the runtime function of that name.
+/// Only externs of doubles are supported.
+static bool lowerExtern(const PrototypeAST &P) {
+  for (unsigned i = 0, e = P.getNumArgs(); i != e; ++i)
+    if (P.getArgType(i) != "double")
+      return Decline("extern '" + P.getName() + "' takes arrays");
+  if (P.getRetType() != "double")
+    return Decline("extern '" + P.getName() + "' returns an array");
+  if (P.getNumArgs() > IFunction::MaxNativeArgs)
+    return Decline("extern '" + P.getName() + "' has too many arguments");
+
+  void *Native = sys::DynamicLibrary::SearchForAddressOfSymbol(P.getName());
+  if (!Native)
+    return Decline("extern '" + P.getName() + "' was not found");
+
+  auto &Fn = InterpFunctions[P.getName()];
+  if (Fn && !Fn->Native)
+    return Decline("Function cannot be redefined");
+  Fn = std::make_unique<IFunction>();
+  Fn->Proto = &P;
+  Fn->ArgTys.assign(P.getNumArgs(), IT_Double);
+  Fn->Native = Native;
+  return true;
+}
+
+namespace {
+  /// InterpProgram - a program lowered for the interpreter. The lowered code
+  /// refers to the prototypes, so the program keeps its AST.
+  struct InterpProgram {
+    std::vector<std::unique_ptr<FunctionAST>> Definitions;
+    std::vector<std::unique_ptr<PrototypeAST>> Externs;
+    std::vector<std::unique_ptr<IFunction>> TopLevel;
+
+    /// run - evaluate the top-level expressions in order.
+    void run() const {
+      for (auto &Main : TopLevel)
+        Main->call(nullptr);
+    }
+  };
+} // end namespace
+
+/// LowerProgram - parse the whole program into Program, lowering it for the
+/// interpreter. Returns false, with the reason in InterpError, if it needs
+/// the compiler.
+static bool LowerProgram(InterpProgram &Program) {
+  sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
 
-  Function *F = getFunction(std::string("unary") + Opcode);
-  if (!F)
-    return LogErrorV("Unknown unary operator");
+  while (CurTok != tok_eof) {
+    switch (CurTok) {
+    case ';':
+      getNextToken();
+      continue;
+    case tok_record:
+      return Decline("records need the compiler");
+    case tok_extern: {
+      TimeRegion Parse(TP_Parse);
+      if (auto P = ParseExtern()) {
+        if (!lowerExtern(*P))
+          return false;
+        Program.Externs.push_back(std::move(P));
+      } else {
+        getNextToken();
+      }
+      continue;
+    }
+    default:
+      break;
+    }
 
-  return Builder->CreateCall(F, OperandV, "unop");
+    FunctionTimeScope Timing;
+    TimeRegion Parse(TP_Parse);
+    auto F = CurTok == tok_func ? ParseDefinition() : ParseTopLevelExpr();
+    if (!F) {
+      // Skip token for error recovery.
+      getNextToken();
+      continue;
+    }
+    // The compiler installs an operator when it generates its definition;
+    // later definitions and expressions are parsed with it.
+    const PrototypeAST &P = F->getProto();
+    if (P.isBinaryOp())
+      BinOpPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+
+    // Lowering is the interpreter's code generation.
+    Timing.setName(P.getName());
+    TimeRegion Lower(TP_Codegen);
+    std::unique_ptr<IFunction> Main;
+    if (!lowerFunction(*F, Main))
+      return false;
+    if (Main)
+      Program.TopLevel.push_back(std::move(Main));
+    Program.Definitions.push_back(std::move(F));
+  }
+  return true;
 }
 
 //================================= //
 // Top level parsing and JIT driver //
 //================================= //
 
+/// InitializeModule - open a new module, in a context of its own, with a
+/// compile unit for its debug info.
 static void InitializeModule() {
+  // Close the last module, if any, before the context it belongs to.
+  DBuilder.reset();
+  Builder.reset();
+  TheModule.reset();
+
   // Open a new module.
   TheContext = std::make_unique<LLVMContext>();
   TheModule = std::make_unique<Module>("MeowJIT", *TheContext);
   TheModule->setDataLayout(TheJIT->getDataLayout());
 
   Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+  // Add the current debug info version into the module.
+  TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
+                           DEBUG_METADATA_VERSION);
+
+  // Darwin only supports dwarf2.
+  if (Triple(sys::getProcessTriple()).isOSDarwin())
+    TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+
+  // Construct the DIBuilder, we do this here because we need the module.
+  DBuilder = std::make_unique<DIBuilder>(*TheModule);
+  KSDbgInfo.DblTy = nullptr;
+
+  // Create the compile unit for the module, in the source file.
+  DIFile *File = DBuilder->createFile("<stdin>", ".");
+  if (InputFilename != "-") {
+    SmallString<128> Path(InputFilename);
+    sys::fs::make_absolute(Path);
+    File = DBuilder->createFile(sys::path::filename(Path),
+                                sys::path::parent_path(Path));
+  }
+  KSDbgInfo.TheCU = DBuilder->createCompileUnit(
+      dwarf::DW_LANG_C, File, "Meowlang Compiler", OptLevel != '0', "", 0);
 }
 
 static void HandleDefinition() {
+  FunctionTimeScope Timing;
+  TimeRegion Parse(TP_Parse);
   if (auto FnAST = ParseDefinition()) {
+    Timing.setName(FnAST->getProto().getName());
+    TimeRegion Codegen(TP_Codegen);
     if (!FnAST->codegen())
       fprintf(stderr, "Error reading function definition:");
   } else {
@@ -1248,12 +6582,31 @@ static void HandleDefinition() {
   }
 }
 
+static void HandleRecord() {
+  TimeRegion Parse(TP_Parse);
+  if (auto RecAST = ParseRecord()) {
+    if (Records.count(RecAST->getName()))
+      fprintf(stderr, "Error: record '%s' is already declared\n",
+              RecAST->getName().c_str());
+    else
+      Records[RecAST->getName()] = std::move(RecAST);
+  } else {
+    // Skip token for error recovery.
+    getNextToken();
+  }
+}
+
 static void HandleExtern() {
+  TimeRegion Parse(TP_Parse);
   if (auto ProtoAST = ParseExtern()) {
-    if (!ProtoAST->codegen())
-      fprintf(stderr, "Error reading extern");
-    else
+    if (Function *F = ProtoAST->codegen()) {
+      if (ProtoAST->isPure()) {
+        F->setDoesNotAccessMemory();
+        F->setDoesNotThrow();
+      }
       FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+    } else
+      fprintf(stderr, "Error reading extern");
   } else {
     // Skip token for error recovery.
     getNextToken();
@@ -1262,7 +6615,11 @@ static void HandleExtern() {
 
 static void HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
+  FunctionTimeScope Timing;
+  TimeRegion Parse(TP_Parse);
   if (auto FnAST = ParseTopLevelExpr()) {
+    Timing.setName(FnAST->getProto().getName());
+    TimeRegion Codegen(TP_Codegen);
     if (!FnAST->codegen()) {
       fprintf(stderr, "Error generating code for top level expr");
     }
@@ -1272,7 +6629,7 @@ static void HandleTopLevelExpression() {
   }
 }
 
-/// top ::= definition | external | expression | ';'
+/// top ::= definition | external | record | expression | ';'
 static void MainLoop() {
   while (true) {
     switch (CurTok) {
@@ -1287,6 +6644,9 @@ static void MainLoop() {
     case tok_extern:
       HandleExtern();
       break;
+    case tok_record:
+      HandleRecord();
+      break;
     default:
       HandleTopLevelExpression();
       break;
@@ -1294,80 +6654,615 @@ static void MainLoop() {
   }
 }
 
-/// ================== //
-///  Main driver code. //
-/// ================== //
+/// ServerMode - whether meowc is serving requests with --server, so must
+/// outlive each program it compiles and runs.
+static bool ServerMode = false;
+
+/// RunUserCode - run the program itself, returning the exit status. A server
+/// runs it in a child process, so a crash or runtime abort can't take the
+/// server down and any threads libmeow starts end with the request.
+static int RunUserCode(function_ref<void()> Run) {
+  TimeRegion Running(TP_Run);
+  if (!ServerMode) {
+    Run();
+    return 0;
+  }
 
-int main() {
+  fflush(stdout);
+  outs().flush();
+  pid_t Pid = fork();
+  if (Pid < 0) {
+    errs() << "meowc: cannot fork: " << strerror(errno) << "\n";
+    return 1;
+  }
+  if (Pid == 0) {
+    if (ThePerfMap)
+      ThePerfMap->reopen();
+    Run();
+    flushd();
+    meow_inst_write();
+    fflush(stdout);
+    _exit(0);
+  }
+  int Status;
+  while (waitpid(Pid, &Status, 0) < 0)
+    if (errno != EINTR)
+      return 1;
+  return WIFEXITED(Status) ? WEXITSTATUS(Status) : 128 + WTERMSIG(Status);
+}
+
+/// InitializeLLVM - set up the native target and the JIT, once.
+static void InitializeLLVM() {
+  if (TheJIT)
+    return;
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
+  TheJIT = ExitOnErr(MeowJIT::Create());
+
+  // GDB finds JIT-compiled code through its registration interface.
+  TheJIT->addEventListener(*JITEventListener::createGDBRegistrationListener());
+}
+
+/// RegisterProfilerListeners - tell perf about the code the JIT loads, as
+/// asked. A server keeps a listener once a request has asked for it.
+static void RegisterProfilerListeners(const char *Argv0) {
+  if (PerfMap && !ThePerfMap) {
+    ThePerfMap = std::make_unique<PerfMapListener>();
+    TheJIT->addEventListener(*ThePerfMap);
+  }
+  static bool JITDumpRegistered = false;
+  if (JITDump && !JITDumpRegistered) {
+    if (JITEventListener *L = JITEventListener::createPerfJITEventListener()) {
+      TheJIT->addEventListener(*L);
+      JITDumpRegistered = true;
+    } else {
+      errs() << Argv0 << ": this LLVM was built without jitdump support\n";
+    }
+  }
+}
+
+/// getTargetMachine - a TargetMachine for the given target and options.
+/// Machines are kept, so a server creates each only once.
+static TargetMachine *getTargetMachine(const Target &T,
+                                       const std::string &TargetTriple,
+                                       const std::string &CPU,
+                                       const std::string &Features,
+                                       const TargetOptions &Opts) {
+  static StringMap<std::unique_ptr<TargetMachine>> Machines;
+  std::string Key = TargetTriple + "/" + CPU + "/" + Features + "/" +
+                    std::to_string(Opts.AllowFPOpFusion);
+  auto &TM = Machines[Key];
+  if (!TM)
+    TM.reset(T.createTargetMachine(TargetTriple, CPU, Features, Opts,
+                                   Optional<Reloc::Model>()));
+  return TM.get();
+}
+
+/// CreateTargetMachine - the machine to compile for: the host, as -mcpu,
+/// -mattr and the floating-point options refine it. Prints an error and
+/// returns null if there is none.
+static TargetMachine *CreateTargetMachine() {
+  auto TargetTriple = sys::getDefaultTargetTriple();
 
-  // Install standard binary operators.
+  std::string Error;
+  auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
+
+  // Print an error and exit if we couldn't find the requested target.
+  // This generally occurs if we've forgotten to initialise the
+  // TargetRegistry or we have a bogus target triple.
+  if (!Target) {
+    errs() << Error;
+    return nullptr;
+  }
+
+  std::string CPU = MCPU;
+  SubtargetFeatures Features;
+  if (CPU == "native") {
+    CPU = std::string(sys::getHostCPUName());
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures))
+      for (auto &F : HostFeatures)
+        Features.AddFeature(F.first(), F.second);
+  }
+  SmallVector<StringRef, 8> Attrs;
+  StringRef(MAttrs).split(Attrs, ',', -1, false);
+  for (StringRef Attr : Attrs)
+    Features.AddFeature(Attr);
+
+  TargetOptions opt;
+  if (*FastMath || FPContract == FPC_Fast)
+    opt.AllowFPOpFusion = FPOpFusion::Fast;
+  else if (FPContract == FPC_On)
+    opt.AllowFPOpFusion = FPOpFusion::Standard;
+  else
+    opt.AllowFPOpFusion = FPOpFusion::Strict;
+  return getTargetMachine(*Target, TargetTriple, CPU, Features.getString(),
+                          opt);
+}
+
+namespace {
+  /// CachedObject - an object file the server has compiled, with the IR it
+  /// printed while compiling it.
+  struct CachedObject {
+    std::string IR;
+    std::string Object;
+  };
+} // end namespace
+
+/// CompiledObjects - the objects a server has compiled, by a hash of their
+/// command line and source. RequestKey is the command line of the request
+/// being served.
+static StringMap<CachedObject> CompiledObjects;
+static std::string RequestKey;
+
+/// ResetCompilerState - forget everything about the last program compiled,
+/// before a server compiles the next.
+static void ResetCompilerState() {
+  DBuilder.reset();
+  Builder.reset();
+  TheModule.reset();
+  TheContext.reset();
+  FunctionProtos.clear();
+  Records.clear();
+  BinOpPrecedence.clear();
+  ProfileCounters.clear();
+  InstSites.clear();
+  InstSiteOffsets.clear();
+  NumInstCounters = 0;
+  InstDescriptor = nullptr;
+  CurInstCounters = nullptr;
+  InstCallSites.clear();
+  ProfileCounts.clear();
+  InterpFunctions.clear();
+  InterpError.clear();
+  KSDbgInfo.LexicalBlocks.clear();
+  KSDbgInfo.DblTy = nullptr;
+  SubscriptDepth = 0;
+  CurLoc = {};
+  LexLoc = {1, 0};
+}
+
+/// InstallStandardOperators - give the builtin binary operators their
+/// precedences.
+static void InstallStandardOperators() {
   // 1 is lowest precedence.
   BinOpPrecedence['='] = 2;
   BinOpPrecedence['<'] = 10;
   BinOpPrecedence['+'] = 20;
   BinOpPrecedence['-'] = 20;
   BinOpPrecedence['*'] = 40; // highest.
+}
 
-  // Prime the first token.
-  getNextToken();
+/// ======= //
+/// Session //
+/// ======= //
+
+// With -session, each definition and top-level expression is compiled and
+// run as it is read, rather than the whole program at once. A definition is
+// compiled into a module and LLVMContext of its own, under a ResourceTracker
+// of its own, as f.v1, f.v2 and so on, and everything calls f through a stub
+// that jumps to the current version. Redefining f compiles the new version,
+// points the stub at it and then removes the old version's tracker, freeing
+// its code. A function's calls to itself go straight to its own version.
+
+/// sameSignature - whether code compiled to call Old can call New: the same
+/// argument and result types, and the same kind of function.
+static bool sameSignature(const PrototypeAST &Old, const PrototypeAST &New) {
+  if (Old.getNumArgs() != New.getNumArgs() ||
+      Old.getRetType() != New.getRetType() ||
+      Old.isGenerator() != New.isGenerator() || Old.isPure() != New.isPure())
+    return false;
+  for (unsigned i = 0, e = Old.getNumArgs(); i != e; ++i)
+    if (Old.getArgType(i) != New.getArgType(i))
+      return false;
+  return true;
+}
+
+namespace {
+  /// JITSession - the definitions a -session run has compiled.
+  class JITSession {
+    struct Definition {
+      ResourceTrackerSP RT; ///< Tracks the current version's module.
+      unsigned Version = 0;
+      /// The current version's memo table pointer, if it is a memo function.
+      /// Removing RT frees the pointer but not the table.
+      void **MemoTable = nullptr;
+    };
+    StringMap<Definition> Definitions;
+    /// StubsRT - tracks the stubs' symbols, which go with the session.
+    ResourceTrackerSP StubsRT;
+    TargetMachine *TM;
+    const char *Argv0;
+    bool Failed = false;
+
+    void fail(Error Err) {
+      logAllUnhandledErrors(std::move(Err), errs(), std::string(Argv0) + ": ");
+      Failed = true;
+    }
+
+    Expected<JITTargetAddress> compile(ResourceTrackerSP RT, StringRef Name);
+    Error remove(Definition &D);
+
+  public:
+    JITSession(const char *ProgName, TargetMachine *Target)
+        : StubsRT(TheJIT->getMainJITDylib().createResourceTracker()),
+          TM(Target), Argv0(ProgName) {}
+    ~JITSession();
+
+    void define();
+    void evaluate();
+    bool failed() const { return Failed; }
+  };
+} // end namespace
+
+/// compile - optimize TheModule and compile it into RT, returning the address
+/// of Name. Compiling it now, rather than on the first call, frees the
+/// module and its context straight away.
+Expected<JITTargetAddress> JITSession::compile(ResourceTrackerSP RT,
+                                               StringRef Name) {
+  DBuilder->finalize();
+  DBuilder.reset();
+  Builder.reset();
+  TheModule->setTargetTriple(TM->getTargetTriple().str());
+  TheModule->setDataLayout(TM->createDataLayout());
+  {
+    TimeRegion Optimize(TP_Optimize);
+    OptimizeModule(*TheModule, TM);
+  }
+
+  TimeRegion Emit(TP_Emit);
+  if (auto Err = TheJIT->addModule(
+          ThreadSafeModule(std::move(TheModule), std::move(TheContext)), RT))
+    return Err;
+  auto Sym = TheJIT->lookup(Name);
+  if (!Sym)
+    return Sym.takeError();
+  return Sym->getAddress();
+}
 
-  TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+/// define - compile the definition at CurTok, as a new version if the
+/// function has one already.
+void JITSession::define() {
+  FunctionTimeScope Timing;
+  TimeRegion Parse(TP_Parse);
+  auto FnAST = ParseDefinition();
+  if (!FnAST) {
+    // Skip token for error recovery.
+    getNextToken();
+    Failed = true;
+    return;
+  }
+  const PrototypeAST &P = FnAST->getProto();
+  std::string Name = P.getName();
+  Timing.setName(Name);
+
+  // Code compiled against the old version calls the new one, so it must be
+  // called the same way.
+  Definition &D = Definitions[Name];
+  if (D.RT && !sameSignature(*FunctionProtos[Name], P)) {
+    fprintf(stderr, "Error: '%s' can only be redefined with the same "
+                    "arguments, result and qualifiers\n",
+            Name.c_str());
+    Failed = true;
+    return;
+  }
+  Optional<int> OldPrecedence;
+  if (D.RT && P.isBinaryOp())
+    OldPrecedence = BinOpPrecedence[P.getOperatorName()];
 
   InitializeModule();
+  Function *F;
+  {
+    TimeRegion Codegen(TP_Codegen);
+    F = FnAST->codegen();
+  }
+  if (!F) {
+    fprintf(stderr, "Error reading function definition:");
+    // The old version of an operator is still there to parse.
+    if (OldPrecedence)
+      BinOpPrecedence[Name.back()] = *OldPrecedence;
+    Failed = true;
+    return;
+  }
 
-  // Add the current debug info version into the module.
-  TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
-                           DEBUG_METADATA_VERSION);
+  // Each version has a name of its own, so the new one can be compiled
+  // while the stub still points at the old. A memo table is exported under
+  // it too, to be freed with the version.
+  std::string Version = Name + ".v" + std::to_string(D.Version + 1);
+  F->setName(Version);
+  GlobalVariable *Table = TheModule->getNamedGlobal(Name + ".memo.table");
+  if (Table) {
+    Table->setName(Version + ".memo.table");
+    Table->setLinkage(GlobalValue::ExternalLinkage);
+  }
+  Definition New{TheJIT->getMainJITDylib().createResourceTracker(),
+                 D.Version + 1};
+  auto Addr = compile(New.RT, Version);
+  if (Addr && Table) {
+    auto TableSym = TheJIT->lookup(Version + ".memo.table");
+    if (!TableSym)
+      Addr = TableSym.takeError();
+    else
+      New.MemoTable =
+          jitTargetAddressToPointer<void **>(TableSym->getAddress());
+  }
+  if (!Addr)
+    return fail(joinErrors(Addr.takeError(), New.RT->remove()));
+  if (auto Err = D.RT ? TheJIT->updateStub(Name, *Addr)
+                      : TheJIT->addStub(Name, *Addr, StubsRT))
+    return fail(joinErrors(std::move(Err), New.RT->remove()));
+
+  // Nothing calls the old version now, so it can go.
+  std::swap(D, New);
+  if (auto Err = remove(New))
+    fail(std::move(Err));
+}
 
-  // Darwin only supports dwarf2.
-  if (Triple(sys::getProcessTriple()).isOSDarwin())
-    TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+/// remove - free the code and memo table of a version, if it has any.
+Error JITSession::remove(Definition &D) {
+  if (!D.RT)
+    return Error::success();
+  if (D.MemoTable)
+    meow_memo_free(*D.MemoTable);
+  return D.RT->remove();
+}
 
-  // Construct the DIBuilder, we do this here because we need the module.
-  DBuilder = std::make_unique<DIBuilder>(*TheModule);
+/// evaluate - compile the top-level expression at CurTok, run it, and free
+/// its code.
+void JITSession::evaluate() {
+  FunctionTimeScope Timing;
+  TimeRegion Parse(TP_Parse);
+  auto FnAST = ParseTopLevelExpr();
+  if (!FnAST) {
+    // Skip token for error recovery.
+    getNextToken();
+    Failed = true;
+    return;
+  }
+  Timing.setName(FnAST->getProto().getName());
 
-  // Create the compile unit for the module.
-  // Currently down as "fib.ks" as a filename since we're redirecting stdin
-  // but we'd like actual source locations.
-  KSDbgInfo.TheCU = DBuilder->createCompileUnit(
-      dwarf::DW_LANG_C, DBuilder->createFile("fib.ks", "."),
-      "Meowlang Compiler", false, "", 0);
+  InitializeModule();
+  {
+    TimeRegion Codegen(TP_Codegen);
+    if (!FnAST->codegen()) {
+      fprintf(stderr, "Error generating code for top level expr");
+      Failed = true;
+      return;
+    }
+  }
+
+  ResourceTrackerSP RT = TheJIT->getMainJITDylib().createResourceTracker();
+  auto Addr = compile(RT, "main");
+  if (Addr) {
+    auto *Main = jitTargetAddressToPointer<double (*)()>(*Addr);
+    Failed |= RunUserCode([&] { Main(); }) != 0;
+    flushd();
+  }
+  if (auto Err = joinErrors(Addr.takeError(), RT->remove()))
+    fail(std::move(Err));
+}
+
+JITSession::~JITSession() {
+  Error Err = StubsRT->remove();
+  for (auto &D : Definitions)
+    Err = joinErrors(std::move(Err), remove(D.second));
+  if (Err)
+    fail(std::move(Err));
+}
+
+/// RunSession - run the program with -session. Returns the exit status, 1
+/// if any of it failed to compile or run.
+static int RunSession(const char *Argv0) {
+  if (isProfileGenerate() || isInstrumenting()) {
+    errs() << Argv0 << ": -session can't be used with -profile-generate or "
+                       "--instrument\n";
+    return 1;
+  }
+
+  // A file is read at once, and standard input as it arrives.
+  Source.reset();
+  StreamPtr = StreamEnd = StreamBuf;
+  LastChar = ' ';
+  LexLoc = {1, 0};
+  if (InputFilename != "-") {
+    auto Buffer = MemoryBuffer::getFile(InputFilename);
+    if (!Buffer) {
+      errs() << Argv0 << ": cannot read " << InputFilename << ": "
+             << Buffer.getError().message() << "\n";
+      return 1;
+    }
+    Source = std::move(*Buffer);
+    rewindSource();
+  }
+
+  InitializeLLVM();
+  RegisterProfilerListeners(Argv0);
+  if (!ProfileUse.empty() && !LoadProfile(ProfileUse))
+    return 1;
+  TargetMachine *TM = CreateTargetMachine();
+  if (!TM)
+    return 1;
+
+  InstallStandardOperators();
+  JITSession S(Argv0, TM);
+  getNextToken();
+  while (CurTok != tok_eof) {
+    switch (CurTok) {
+    case ';': // ignore top-level semicolons.
+      getNextToken();
+      break;
+    case tok_func:
+      S.define();
+      break;
+    case tok_extern:
+      // The declaration is checked in a module of its own. The modules that
+      // call it declare it again.
+      InitializeModule();
+      HandleExtern();
+      break;
+    case tok_record:
+      HandleRecord();
+      break;
+    default:
+      S.evaluate();
+      break;
+    }
+  }
+  return S.failed();
+}
+
+/// CompileProgram - compile the program named on the command line to
+/// output.o, or with -run run it. Returns the exit status.
+static int CompileProgram(const char *Argv0) {
+  if (OptLevel < '0' || OptLevel > '3') {
+    errs() << Argv0 << ": invalid optimization level -O" << OptLevel << "\n";
+    return 1;
+  }
+  if (Session)
+    return RunSession(Argv0);
+
+  auto Buffer = MemoryBuffer::getFileOrSTDIN(InputFilename);
+  if (!Buffer) {
+    errs() << Argv0 << ": cannot read " << InputFilename << ": "
+           << Buffer.getError().message() << "\n";
+    return 1;
+  }
+  Source = std::move(*Buffer);
+  rewindSource();
+
+  // A server that has compiled this program with these options before just
+  // writes out the object again. Profiles are read afresh each time.
+  std::string CacheKey;
+  if (ServerMode && !RunProgram && ProfileUse.empty()) {
+    MD5 Hash;
+    Hash.update(RequestKey);
+    Hash.update(Source->getBuffer());
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    CacheKey = std::string(Result.digest());
+  }
+  auto Cached = CompiledObjects.find(CacheKey);
+  if (!CacheKey.empty() && Cached != CompiledObjects.end()) {
+    errs() << Cached->second.IR;
+    std::error_code EC;
+    raw_fd_ostream Dest("output.o", EC, sys::fs::OF_None);
+    if (EC) {
+      errs() << "Could not open file: " << EC.message();
+      return 1;
+    }
+    Dest << Cached->second.Object;
+    outs() << "Wrote output.o\n";
+    return 0;
+  }
+
+  InstallStandardOperators();
+
+  // Prime the first token.
+  getNextToken();
+
+  // Small programs are run without LLVM at all, unless they need profiling,
+  // debugging or a feature only the compiler has.
+  if (ForceInterp ||
+      (RunProgram && Source->getBufferSize() <= InterpThreshold &&
+       !ProfileGenerate.getNumOccurrences() && !isInstrumenting() &&
+       !EmitDebugInfo && !PerfMap && !JITDump)) {
+    auto StandardOps = BinOpPrecedence;
+    InterpProgram Program;
+    if (LowerProgram(Program))
+      return RunUserCode([&] { Program.run(); });
+    if (ForceInterp) {
+      errs() << Argv0 << ": cannot interpret " << InputFilename << ": "
+             << InterpError << "\n";
+      return 1;
+    }
+    BinOpPrecedence = StandardOps;
+    rewindSource();
+    getNextToken();
+  }
+
+  InitializeLLVM();
+  if (RunProgram)
+    RegisterProfilerListeners(Argv0);
+
+  if (!ProfileUse.empty() && !LoadProfile(ProfileUse))
+    return 1;
+
+  InitializeModule();
 
   // Run the main "interpreter loop" now.
   MainLoop();
 
+  EmitProfileRegistration();
+  EmitProfileSummary();
+  EmitInstDescriptor();
+
   // Finalize the debug info.
   DBuilder->finalize();
 
-  // Print out all of the generated code.
-  TheModule->print(errs(), nullptr);
-
-  auto TargetTriple = sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(TargetTriple);
+  auto *TheTargetMachine = CreateTargetMachine();
+  if (!TheTargetMachine)
+    return 1;
+  TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+  TheModule->setDataLayout(TheTargetMachine->createDataLayout());
 
-  std::string Error;
-  auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
+  {
+    TimeRegion Optimize(TP_Optimize);
+    OptimizeModule(*TheModule, TheTargetMachine);
+  }
 
-  // Print an error and exit if we couldn't find the requested target.
-  // This generally occurs if we've forgotten to initialise the
-  // TargetRegistry or we have a bogus target triple.
-  if (!Target) {
-    errs() << Error;
-    return 1;
+  // Run the top-level expression in the JIT rather than writing it out. Its
+  // code is removed afterwards, so a server can run the next program.
+  if (RunProgram) {
+    bool HasMain = TheModule->getFunction("main");
+    auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+    int Status = 0;
+    auto RunMain = [&]() -> llvm::Error {
+      Optional<TimeRegion> Emit(in_place, TP_Emit);
+      if (auto Err = TheJIT->addModule(
+              ThreadSafeModule(std::move(TheModule), std::move(TheContext)),
+              RT))
+        return Err;
+      if (!HasMain)
+        return llvm::Error::success();
+      auto Main = TheJIT->lookup("main");
+      if (!Main)
+        return Main.takeError();
+      auto *MainFn = reinterpret_cast<double (*)()>(Main->getAddress());
+      Emit.reset();
+      Status = RunUserCode([&] { MainFn(); });
+      return llvm::Error::success();
+    };
+    llvm::Error Err = RunMain();
+    Err = joinErrors(std::move(Err), RT->remove());
+    if (Err) {
+      logAllUnhandledErrors(std::move(Err), errs(), std::string(Argv0) + ": ");
+      return 1;
+    }
+    return Status;
   }
 
-  auto CPU = "generic";
-  auto Features = "";
+  // Print out all of the generated code.
+  std::string IR;
+  raw_string_ostream IROS(IR);
+  TheModule->print(IROS, nullptr);
+  errs() << IROS.str();
 
-  TargetOptions opt;
-  auto RM = Optional<Reloc::Model>();
-  auto TheTargetMachine =
-      Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+  SmallVector<char, 0> Object;
+  raw_svector_ostream ObjectOS(Object);
+  legacy::PassManager pass;
+  auto FileType = CGFT_ObjectFile;
 
-  TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+  if (TheTargetMachine->addPassesToEmitFile(pass, ObjectOS, nullptr,
+                                            FileType)) {
+    errs() << "TheTargetMachine can't emit a file of this type";
+    return 1;
+  }
+
+  {
+    TimeRegion Emit(TP_Emit);
+    pass.run(*TheModule);
+  }
 
   auto Filename = "output.o";
   std::error_code EC;
@@ -1377,19 +7272,205 @@ int main() {
     errs() << "Could not open file: " << EC.message();
     return 1;
   }
+  dest << ObjectOS.str();
+  dest.flush();
 
-  legacy::PassManager pass;
-  auto FileType = CGFT_ObjectFile;
+  if (!CacheKey.empty())
+    CompiledObjects[CacheKey] = {std::move(IR), std::string(ObjectOS.str())};
 
-  if (TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
-    errs() << "TheTargetMachine can't emit a file of this type";
+  outs() << "Wrote " << Filename << "\n";
+
+  return 0;
+}
+
+/// ====== //
+/// Server //
+/// ====== //
+
+// meowc --server keeps one warm compiler serving requests from meowclient
+// over a Unix domain socket, so each compile pays only for the frontend and
+// code generation: the target is initialized and the JIT created once, target
+// machines are kept per target and options, and unchanged programs come from
+// the object cache.
+//
+// A request is a 32-bit length followed by that many bytes: the client's
+// working directory and then its arguments, each NUL-terminated. The
+// client's stdin, stdout and stderr are passed with the length as
+// SCM_RIGHTS descriptors, so the server reads and writes the client's own
+// streams. The reply is the 32-bit exit status.
+
+/// readAll - read exactly Size bytes from FD.
+static bool readAll(int FD, void *Buf, size_t Size) {
+  char *P = static_cast<char *>(Buf);
+  while (Size) {
+    ssize_t N = read(FD, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+/// receiveRequest - read a request from Conn into Payload, and the client's
+/// streams into FDs.
+static bool receiveRequest(int Conn, std::string &Payload, int FDs[3]) {
+  uint32_t Len;
+  iovec IOV = {&Len, sizeof(Len)};
+  alignas(cmsghdr) char Control[CMSG_SPACE(3 * sizeof(int))];
+  msghdr Msg = {};
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control;
+  Msg.msg_controllen = sizeof(Control);
+  if (recvmsg(Conn, &Msg, MSG_WAITALL) != sizeof(Len))
+    return false;
+
+  cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+  if (!C || C->cmsg_level != SOL_SOCKET || C->cmsg_type != SCM_RIGHTS ||
+      C->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    return false;
+  memcpy(FDs, CMSG_DATA(C), 3 * sizeof(int));
+
+  // The payload is at least a working directory, and ends with a NUL.
+  Payload.resize(Len);
+  if (Len == 0 || Len > (1 << 20) || !readAll(Conn, &Payload[0], Len) ||
+      Payload.back() != '\0') {
+    for (int i = 0; i != 3; ++i)
+      close(FDs[i]);
+    return false;
+  }
+  return true;
+}
+
+/// ServeRequest - compile or run the program as meowc would for the command
+/// line in Payload, in the client's working directory and with its streams.
+/// Returns the exit status.
+static int ServeRequest(const char *Argv0, const std::string &Payload,
+                        const int FDs[3]) {
+  const char *Cwd = Payload.c_str();
+  std::vector<const char *> Args = {Argv0};
+  for (const char *P = Cwd + strlen(Cwd) + 1, *E = Payload.data() + Payload.size();
+       P != E; P += strlen(P) + 1)
+    Args.push_back(P);
+
+  fflush(stdout);
+  outs().flush();
+  int SavedCwd = open(".", O_RDONLY | O_DIRECTORY);
+  int SavedFDs[3];
+  for (int i = 0; i != 3; ++i) {
+    SavedFDs[i] = dup(i);
+    dup2(FDs[i], i);
+  }
+
+  int Status = 1;
+  RequestKey.clear();
+  for (const char *Arg : makeArrayRef(Args).drop_front())
+    RequestKey.append(Arg, strlen(Arg) + 1);
+  // Options that print and exit would end the server.
+  auto ExitsEarly = [](StringRef Arg) {
+    Arg = Arg.ltrim('-');
+    return Arg.startswith("help") || Arg == "version" || Arg == "print-options" ||
+           Arg == "print-all-options";
+  };
+  if (chdir(Cwd) != 0) {
+    errs() << Argv0 << ": cannot enter " << Cwd << ": " << strerror(errno)
+           << "\n";
+  } else if (any_of(makeArrayRef(Args).drop_front(), ExitsEarly)) {
+    errs() << Argv0 << ": --help and --version are not served; run meowc\n";
+  } else {
+    ResetCompilerState();
+    cl::ResetAllOptionOccurrences();
+    if (cl::ParseCommandLineOptions(Args.size(), Args.data(),
+                                    "meowlang compiler\n", &errs())) {
+      if (ServerSocket.getNumOccurrences())
+        errs() << Argv0 << ": a request cannot start another server\n";
+      else {
+        StartTimeReport();
+        Status = CompileProgram(Argv0);
+        FinishTimeReport(Argv0);
+      }
+    }
+  }
+
+  flushd();
+  fflush(stdout);
+  fflush(stderr);
+  outs().flush();
+  for (int i = 0; i != 3; ++i) {
+    dup2(SavedFDs[i], i);
+    close(SavedFDs[i]);
+  }
+  if (SavedCwd >= 0) {
+    if (fchdir(SavedCwd) != 0)
+      errs() << Argv0 << ": cannot return to the server's directory\n";
+    close(SavedCwd);
+  }
+  return Status;
+}
+
+/// RunServer - serve requests on the socket at Path until killed.
+static int RunServer(const char *Argv0, const std::string &Path) {
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  if (Path.size() >= sizeof(Addr.sun_path)) {
+    errs() << Argv0 << ": socket path too long: " << Path << "\n";
+    return 1;
+  }
+  memcpy(Addr.sun_path, Path.c_str(), Path.size() + 1);
+
+  // Replace the socket of a server that is no longer running.
+  int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(Path.c_str());
+  if (Listener < 0 ||
+      bind(Listener, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0 ||
+      listen(Listener, SOMAXCONN) < 0) {
+    errs() << Argv0 << ": cannot listen on " << Path << ": "
+           << strerror(errno) << "\n";
     return 1;
   }
 
-  pass.run(*TheModule);
-  dest.flush();
+  // A client that goes away mustn't take the server with it.
+  signal(SIGPIPE, SIG_IGN);
+  ServerMode = true;
+  InitializeLLVM();
+  errs() << Argv0 << ": serving on " << Path << "\n";
 
-  outs() << "Wrote " << Filename << "\n";
+  while (true) {
+    int Conn = accept(Listener, nullptr, nullptr);
+    if (Conn < 0) {
+      if (errno == EINTR)
+        continue;
+      errs() << Argv0 << ": accept: " << strerror(errno) << "\n";
+      return 1;
+    }
+    std::string Payload;
+    int FDs[3];
+    if (receiveRequest(Conn, Payload, FDs)) {
+      int32_t Status = ServeRequest(Argv0, Payload, FDs);
+      for (int i = 0; i != 3; ++i)
+        close(FDs[i]);
+      if (write(Conn, &Status, sizeof(Status)) != sizeof(Status))
+        errs() << Argv0 << ": lost the client before replying\n";
+    }
+    close(Conn);
+  }
+}
 
-  return 0;
+/// ================== //
+///  Main driver code. //
+/// ================== //
+
+int main(int argc, char **argv) {
+  RegisterFastMathOption();
+  cl::ParseCommandLineOptions(argc, argv, "meowlang compiler\n");
+  if (ServerSocket.getNumOccurrences())
+    return RunServer(argv[0], ServerSocket.empty() ? std::string("meowc.sock")
+                                                   : ServerSocket.getValue());
+  StartTimeReport();
+  int Status = CompileProgram(argv[0]);
+  FinishTimeReport(argv[0]);
+  return Status;
 }